@@ -0,0 +1,149 @@
+// The common objects come with their doctest test cases
+#define DOCTEST_CONFIG_IMPLEMENT
+#include "doctest.h"
+
+#include "crc32.hpp"
+#include "modbus_ops.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+// Loading of a firmware image: the CRC32 implementations alone, then the
+// whole registers_from_file against the former byte at a time stream reads
+namespace {
+using modbus::crc32::update_bytewise;
+
+// MB per second
+double
+run(std::function<uint32_t()> const &f, size_t bytes, int iterations)
+{
+    uint32_t checksum = 0;
+
+    auto const start = std::chrono::steady_clock::now();
+    for (int it = 0; it != iterations; ++it)
+        checksum ^= f();
+    auto const elapsed = std::chrono::steady_clock::now() - start;
+
+    // Keep the optimizer from dropping the loop
+    if (checksum == 42)
+        std::cerr << "";
+
+    return static_cast<double>(bytes) * iterations / 1e6 /
+           std::chrono::duration<double>(elapsed).count();
+}
+
+// registers_from_file as it was: istreambuf_iterator and one CRC update per
+// byte
+uint32_t
+load_bytewise(std::string const &filename)
+{
+    std::ifstream ifs(filename, std::ios::binary);
+    std::istreambuf_iterator<char> it{ifs}, ibe;
+
+    std::vector<uint16_t> content;
+    uint32_t crc = 0;
+    while (it != ibe)
+    {
+        uint8_t const bytes[2] = {
+          static_cast<uint8_t>(*it++),
+          it != ibe ? static_cast<uint8_t>(*it++) : uint8_t{0}};
+        crc = update_bytewise(crc, bytes, 1);
+        crc = update_bytewise(crc, bytes + 1, 1);
+        content.push_back(bytes[0] << 8 | bytes[1]);
+    }
+    while (content.size() % 2)
+    {
+        uint8_t const zeros[2] = {};
+        crc = update_bytewise(crc, zeros, 2);
+        content.push_back(0);
+    }
+
+    return crc ^ content.back();
+}
+
+uint32_t
+load_mapped(std::string const &filename)
+{
+    uint32_t crc;
+    auto const content = modbus::registers_from_file(filename, &crc);
+    return crc ^ content.back();
+}
+} // namespace
+
+int
+main(int argc, char *argv[])
+{
+    size_t const image_bytes = argc > 1 ? std::atoi(argv[1]) : 256 * 1024;
+    int const iterations     = argc > 2 ? std::atoi(argv[2]) : 50;
+
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::vector<uint8_t> image(image_bytes);
+    for (auto &b: image)
+        b = static_cast<uint8_t>(byte(gen));
+
+    std::string const filename = "crc_benchmark.bin";
+    std::ofstream(filename, std::ios::binary)
+      .write(reinterpret_cast<char const *>(image.data()), image.size());
+
+    // registers_from_file logs each load
+    auto *const clog_buf = std::clog.rdbuf(nullptr);
+
+    std::cout << image_bytes << " bytes image, MB/s\n"
+              << std::fixed << std::setprecision(1);
+
+    std::cout << std::setw(24) << "crc32 byte-wise"
+              << std::setw(10)
+              << run([&]
+                     { return update_bytewise(0, image.data(), image.size()); },
+                     image.size(),
+                     iterations)
+              << '\n'
+              << std::setw(24) << "crc32 slice-by-8" << std::setw(10)
+              << run(
+                   [&]
+                   {
+                       return modbus::crc32::update_slice8(
+                         0, image.data(), image.size());
+                   },
+                   image.size(),
+                   iterations)
+              << '\n';
+#if defined(MODBUS_CRC32_HARDWARE)
+    std::cout << std::setw(24) << "crc32 hardware" << std::setw(10)
+              << run(
+                   [&]
+                   {
+                       return modbus::crc32::update_hardware(
+                         0, image.data(), image.size());
+                   },
+                   image.size(),
+                   iterations)
+              << '\n';
+#endif
+
+    std::cout << std::setw(24) << "load istreambuf" << std::setw(10)
+              << run([&] { return load_bytewise(filename); },
+                     image.size(),
+                     iterations)
+              << '\n'
+              << std::setw(24) << "load registers_from_file" << std::setw(10)
+              << run([&] { return load_mapped(filename); },
+                     image.size(),
+                     iterations)
+              << '\n';
+
+    std::clog.rdbuf(clog_buf);
+    std::remove(filename.c_str());
+
+    return EXIT_SUCCESS;
+}
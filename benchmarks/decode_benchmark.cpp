@@ -0,0 +1,161 @@
+// The crawler objects come with their doctest test cases
+#define DOCTEST_CONFIG_IMPLEMENT
+#include "doctest.h"
+
+#include "column_decoder.h"
+#include "meas_decoder.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// Decoding of a block of back to back values of the same type, as read from
+// a high density meter, through the per-measure decoders and through the
+// column decoder, scalar and vectorized
+namespace {
+using measure::Reporter;
+using modbus::value_type;
+using modbus::word_endianess;
+
+constexpr size_t num_values = 120;
+
+struct fixture
+{
+    value_type vt;
+    word_endianess endianess;
+    std::vector<uint16_t> regs;
+    std::vector<measure::sample_decoder> decoders;
+    measure::column_t column;
+    std::vector<double> measurements;
+    std::vector<Reporter::SampleType> sample_types;
+
+    fixture(value_type vt, word_endianess e)
+      : vt(vt)
+      , endianess(e)
+      , column(vt, e)
+      , measurements(num_values)
+      , sample_types(num_values)
+    {
+        std::mt19937 gen(42);
+        std::uniform_int_distribution<uint16_t> word;
+
+        regs.resize(num_values * modbus::reg_size(vt));
+        for (auto &r: regs)
+            r = word(gen);
+
+        for (size_t i = 0; i != num_values; ++i)
+        {
+            measure::source_register_t source;
+            source.value_type   = vt;
+            source.endianess    = e;
+            source.scale_factor = 0.01;
+            source.min_read_value.assign_min(vt);
+            source.max_read_value.assign_max(vt);
+
+            decoders.emplace_back(source);
+            column.append(source);
+        }
+    }
+};
+
+void
+decode_per_measure(fixture &f)
+{
+    auto const regsize = modbus::reg_size(f.vt);
+    for (size_t i = 0; i != num_values; ++i)
+    {
+        intmax_t raw;
+        f.sample_types[i] =
+          f.decoders[i](f.regs.data() + i * regsize, raw, f.measurements[i]);
+    }
+}
+
+void
+decode_scalar_column(fixture &f)
+{
+    measure::decode_column_scalar(
+      f.column, f.regs.data(), f.measurements.data(), f.sample_types.data());
+}
+
+void
+decode_vector_column(fixture &f)
+{
+    measure::decode_column(
+      f.column, f.regs.data(), f.measurements.data(), f.sample_types.data());
+}
+
+// Nanoseconds per value
+double
+run(fixture &f, std::function<void(fixture &)> const &decode, int iterations)
+{
+    double checksum = 0;
+
+    auto const start = std::chrono::steady_clock::now();
+    for (int it = 0; it != iterations; ++it)
+    {
+        decode(f);
+        checksum += f.measurements[it % num_values];
+    }
+    auto const elapsed = std::chrono::steady_clock::now() - start;
+
+    // Keep the optimizer from dropping the loop
+    if (checksum == 42)
+        std::cerr << "";
+
+    return std::chrono::duration<double, std::nano>(elapsed).count() /
+           (static_cast<double>(iterations) * num_values);
+}
+
+char const *
+name(value_type vt)
+{
+    switch (vt)
+    {
+    case value_type::INT16:
+        return "INT16";
+    case value_type::UINT16:
+        return "UINT16";
+    case value_type::INT32:
+        return "INT32";
+    case value_type::UINT32:
+        return "UINT32";
+    default:
+        return "?";
+    }
+}
+} // namespace
+
+int
+main(int argc, char *argv[])
+{
+    int const iterations = argc > 1 ? std::atoi(argv[1]) : 200000;
+
+    std::cout << num_values << " values per block, ns per value\n"
+              << std::setw(16) << "type" << std::setw(12) << "per-measure"
+              << std::setw(10) << "scalar"
+              << std::setw(10) << "vector" << '\n';
+
+    for (auto const vt: {value_type::INT16,
+                         value_type::UINT16,
+                         value_type::INT32,
+                         value_type::UINT32})
+        for (auto const e: {word_endianess::little, word_endianess::big})
+        {
+            fixture f(vt, e);
+
+            std::cout << std::setw(9) << name(vt) << std::setw(7)
+                      << (e == word_endianess::little ? "little" : "big")
+                      << std::fixed << std::setprecision(2) << std::setw(12)
+                      << run(f, decode_per_measure, iterations)
+                      << std::setw(10)
+                      << run(f, decode_scalar_column, iterations)
+                      << std::setw(10)
+                      << run(f, decode_vector_column, iterations) << '\n';
+        }
+
+    return EXIT_SUCCESS;
+}
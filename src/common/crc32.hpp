@@ -0,0 +1,145 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__ARM_FEATURE_CRC32) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#    include <arm_acle.h>
+#    define MODBUS_CRC32_HARDWARE 1
+#endif
+
+// CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320), which the devices
+// check the firmware images against. Each update takes the CRC of the data
+// so far, 0 to start with, and returns the CRC of that data followed by buf
+namespace modbus::crc32 {
+namespace detail {
+    uint32_t constexpr polynomial = 0xEDB88320;
+
+    using table_t = std::array<uint32_t, 256>;
+
+    // tables[0] is the classic byte-wise table, tables[k] gives the CRC of
+    // a byte followed by k zero bytes, so that slice-by-8 can look up the 8
+    // bytes of a word independently
+    constexpr std::array<table_t, 8> make_tables()
+    {
+        std::array<table_t, 8> tables{};
+        for (uint32_t i = 0; i != 256; ++i)
+        {
+            uint32_t c = i;
+            for (int j = 0; j != 8; ++j)
+                c = (c & 1) ? polynomial ^ (c >> 1) : c >> 1;
+            tables[0][i] = c;
+        }
+        for (size_t k = 1; k != tables.size(); ++k)
+            for (uint32_t i = 0; i != 256; ++i)
+                tables[k][i] = (tables[k - 1][i] >> 8) ^
+                               tables[0][tables[k - 1][i] & 0xFF];
+        return tables;
+    }
+
+    inline constexpr auto tables = make_tables();
+
+    inline uint32_t load_le32(uint8_t const *p)
+    {
+        return p[0] | p[1] << 8 | p[2] << 16 |
+               static_cast<uint32_t>(p[3]) << 24;
+    }
+} // namespace detail
+
+// One table lookup per byte, the reference the others must match
+inline uint32_t
+update_bytewise(uint32_t crc, void const *buf, size_t len)
+{
+    auto const &t = detail::tables[0];
+    auto const *p = static_cast<uint8_t const *>(buf);
+
+    crc = ~crc;
+    for (size_t i = 0; i != len; ++i)
+        crc = t[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// 8 bytes at a time, through 8 independent lookups
+inline uint32_t
+update_slice8(uint32_t crc, void const *buf, size_t len)
+{
+    auto const &t = detail::tables;
+    auto const *p = static_cast<uint8_t const *>(buf);
+
+    crc = ~crc;
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        uint32_t const lo = crc ^ detail::load_le32(p);
+        uint32_t const hi = detail::load_le32(p + 4);
+
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^
+              t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^ t[3][hi & 0xFF] ^
+              t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+    for (; len; --len)
+        crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(MODBUS_CRC32_HARDWARE)
+// The ARMv8 CRC32 instructions, which use the same polynomial
+inline uint32_t
+update_hardware(uint32_t crc, void const *buf, size_t len)
+{
+    auto const *p = static_cast<uint8_t const *>(buf);
+
+    crc = ~crc;
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, p, sizeof word);
+        crc = __crc32d(crc, word);
+    }
+    for (; len; --len)
+        crc = __crc32b(crc, *p++);
+    return ~crc;
+}
+#endif
+
+// The fastest implementation the target supports
+inline uint32_t
+update(uint32_t crc, void const *buf, size_t len)
+{
+#if defined(MODBUS_CRC32_HARDWARE)
+    return update_hardware(crc, buf, len);
+#else
+    return update_slice8(crc, buf, len);
+#endif
+}
+} // namespace modbus::crc32
+
+#if defined(DOCTEST_LIBRARY_INCLUDED)
+TEST_CASE("CRC32 implementations agree")
+{
+    using namespace modbus::crc32;
+
+    // Check value of the CRC-32 catalogue
+    char const check[] = "123456789";
+    CHECK(update_bytewise(0, check, 9) == 0xCBF43926);
+    CHECK(update_slice8(0, check, 9) == 0xCBF43926);
+    CHECK(update(0, check, 9) == 0xCBF43926);
+
+    uint8_t data[1000];
+    for (size_t i = 0; i != sizeof data; ++i)
+        data[i] = static_cast<uint8_t>(i * 31 + (i >> 3));
+
+    // Every length modulo 8, and updates chained at odd boundaries
+    for (size_t len: {0, 1, 7, 8, 9, 63, 64, 999, 1000})
+    {
+        auto const expected = update_bytewise(0, data, len);
+        CHECK(update_slice8(0, data, len) == expected);
+        CHECK(update(0, data, len) == expected);
+
+        auto const half = len / 2 + 1;
+        if (half < len)
+            CHECK(update(update(0, data, half), data + half, len - half) ==
+                  expected);
+    }
+}
+#endif
@@ -0,0 +1,405 @@
+#include "flash_session.h"
+
+#if defined(USE_LOGURU)
+#    include <loguru.hpp>
+#    define EOL
+#else
+#    define LOG_S(x) std::clog
+#    define EOL << std::endl;
+#endif
+#include "doctest.h"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+namespace modbus {
+namespace {
+    // Offset and length, right before the buffer
+    int constexpr header_regs = 3;
+
+    int reg(flash_register r) { return static_cast<int>(r); }
+
+    // A line, preceded by its offset and length, as staged on the device
+    struct staged_line_t
+    {
+        uint16_t regs[header_regs + flash_session::line_regs];
+        int num_regs; // Header included
+
+        staged_line_t(std::vector<uint16_t> const &image, size_t line)
+        {
+            auto const first  = line * flash_session::line_regs;
+            auto const offset = static_cast<uint32_t>(first * 2);
+            auto const len    = std::min<size_t>(flash_session::line_regs,
+                                              image.size() - first);
+
+            regs[0] = offset >> 16;
+            regs[1] = offset & 0xFFFF;
+            regs[2] = len * 2;
+            std::copy_n(image.data() + first, len, regs + header_regs);
+            num_regs = header_regs + static_cast<int>(len);
+        }
+
+        [[nodiscard]] uint32_t offset() const
+        {
+            return static_cast<uint32_t>(regs[0]) << 16 | regs[1];
+        }
+
+        // Call f(address, regs, num_regs) for each of the writes staging the
+        // line: the header takes as much of the line as still fits in the
+        // first one
+        template <class F>
+        void write(F &&f) const
+        {
+            int const first = std::min(num_regs, MODBUS_MAX_WRITE_REGISTERS);
+
+            f(reg(flash_register::offset_high), regs, first);
+            if (num_regs > first)
+                f(reg(flash_register::offset_high) + first,
+                  regs + first,
+                  num_regs - first);
+        }
+    };
+
+    // Total length and CRC are contiguous as well
+    struct trailer_t
+    {
+        uint16_t regs[4];
+
+        trailer_t(std::vector<uint16_t> const &image, uint32_t crc32)
+        {
+            auto const total_len = static_cast<uint32_t>(image.size() * 2);
+            regs[0] = total_len >> 16;
+            regs[1] = total_len & 0xFFFF;
+            regs[2] = crc32 >> 16;
+            regs[3] = crc32 & 0xFFFF;
+        }
+    };
+} // namespace
+
+flash_session::flash_session(slave &device,
+                             std::vector<uint16_t> const &image,
+                             uint32_t crc32,
+                             options_t const &options)
+  : device_(device)
+  , image_(image)
+  , crc32_(crc32)
+  , options_(options)
+  , lines_((image.size() + line_regs - 1) / line_regs)
+{
+    auto const *base = options.base;
+    for (size_t line = 0; line != lines_; ++line)
+    {
+        auto const first = line * line_regs;
+        auto const last  = std::min(first + line_regs, image.size());
+        if (!base || base->size() < last ||
+            !std::equal(image.begin() + first,
+                        image.begin() + last,
+                        base->begin() + first))
+            changed_.push_back(line);
+    }
+}
+
+bool
+flash_session::step()
+{
+    for (int attempt = 0;; ++attempt)
+    {
+        try
+        {
+            switch (state_)
+            {
+            case state_t::start:
+                LOG_S(INFO) << "Sending 'start' command, " << changed_.size()
+                            << " of " << lines_ << " lines to go" EOL;
+                command(flash_command::start);
+                state_ = changed_.empty() ? state_t::finish : state_t::lines;
+                return true;
+            case state_t::lines:
+                send_line(changed_[next_line_]);
+                if (++next_line_ == changed_.size())
+                    state_ = state_t::finish;
+                return true;
+            case state_t::finish:
+                finish();
+                state_ = state_t::done;
+                return false;
+            case state_t::done:
+                return false;
+            }
+        }
+        catch (std::exception const &e)
+        {
+            if (attempt == options_.max_retries)
+                throw;
+
+            ++retransmissions_;
+            LOG_S(WARNING) << "FLASH step failed: " << e.what()
+                           << ", retransmitting" EOL;
+        }
+    }
+}
+
+void
+flash_session::send_line(size_t line)
+{
+    staged_line_t const staged(image_, line);
+
+    LOG_S(INFO) << "FLASH line " << line + 1 << "/" << lines_ << " @ 0x"
+                << std::hex << staged.offset() << std::dec << ", "
+                << staged.regs[2] << " bytes" EOL;
+
+    staged.write(
+      [this](int address, uint16_t const *regs, int num_regs)
+      { device_.write_multiple_registers(address, regs, num_regs); });
+
+    if (options_.verify)
+        verify_line(staged.regs, staged.num_regs);
+
+    command(flash_command::write_segment);
+}
+
+void
+flash_session::verify_line(uint16_t const *staged, int num_regs)
+{
+    uint16_t readback[header_regs + line_regs];
+    for (int done = 0; done != num_regs;)
+    {
+        int const chunk = std::min(num_regs - done, MODBUS_MAX_READ_REGISTERS);
+        device_.read_holding_registers(
+          reg(flash_register::offset_high) + done, chunk, readback + done);
+        done += chunk;
+    }
+
+    auto const mismatch = std::mismatch(staged, staged + num_regs, readback);
+    if (mismatch.first != staged + num_regs)
+        throw std::runtime_error(
+          "readback mismatch at register " +
+          std::to_string(reg(flash_register::offset_high) +
+                         (mismatch.first - staged)));
+}
+
+bool
+flash_session::check_received()
+{
+    uint16_t reported[2];
+    try
+    {
+        device_.read_holding_registers(
+          reg(flash_register::crc32_high), 2, reported);
+    }
+    catch (std::exception const &e)
+    {
+        LOG_S(WARNING) << "FLASH " << device_.name() << ": " << e.what() EOL;
+        return false;
+    }
+
+    auto const crc32 = static_cast<uint32_t>(reported[0]) << 16 | reported[1];
+    if (crc32 != crc32_)
+    {
+        LOG_S(WARNING) << "FLASH " << device_.name() << ": received CRC32 "
+                       << std::hex << crc32 << " instead of " << crc32_
+                       << std::dec EOL;
+        return false;
+    }
+
+    next_line_ = changed_.size();
+    state_     = state_t::finish;
+    return true;
+}
+
+void
+flash_session::finish()
+{
+    trailer_t const trailer(image_, crc32_);
+
+    LOG_S(INFO) << "Sending total len " << image_.size() * 2 << " and crc32 "
+                << std::hex << crc32_ << std::dec EOL;
+    device_.write_multiple_registers(
+      reg(flash_register::total_len_high), trailer.regs, 4);
+
+    LOG_S(INFO) << "Sending 'done' command" EOL;
+    command(flash_command::done);
+}
+
+void
+flash_session::command(flash_command cmd)
+{
+    device_.write_holding_register(reg(flash_register::cmd),
+                                   static_cast<uint16_t>(cmd));
+}
+
+std::error_code
+broadcast_image(RTUBus &bus,
+                std::vector<uint16_t> const &image,
+                std::chrono::microseconds delay)
+{
+    auto const command = [&](flash_command cmd)
+    {
+        return bus.broadcast(pdu::write_single_register_request(
+                               reg(flash_register::cmd),
+                               static_cast<uint16_t>(cmd)),
+                             delay);
+    };
+
+    LOG_S(INFO) << "BROADCAST 'start' command" EOL;
+    if (auto const ec = command(flash_command::start))
+        return ec;
+
+    auto const lines =
+      (image.size() + flash_session::line_regs - 1) / flash_session::line_regs;
+    for (size_t line = 0; line != lines; ++line)
+    {
+        staged_line_t const staged(image, line);
+
+        LOG_S(INFO) << "BROADCAST line " << line + 1 << "/" << lines
+                    << " @ 0x" << std::hex << staged.offset() << std::dec EOL;
+
+        std::error_code ec;
+        staged.write(
+          [&](int address, uint16_t const *regs, int num_regs)
+          {
+              if (!ec)
+                  ec = bus.broadcast(
+                    pdu::write_multiple_registers_request(
+                      address, regs, num_regs),
+                    delay);
+          });
+        if (!ec)
+            ec = command(flash_command::write_segment);
+        if (ec)
+            return ec;
+    }
+
+    // The CRC is left for each device to report
+    trailer_t const trailer(image, 0);
+    LOG_S(INFO) << "BROADCAST total len " << image.size() * 2 EOL;
+    return bus.broadcast(
+      pdu::write_multiple_registers_request(
+        reg(flash_register::total_len_high), trailer.regs, 2),
+      delay);
+}
+} // namespace modbus
+
+namespace {
+struct fake_flash_state
+{
+    std::map<int, uint16_t> regs;
+    std::vector<uint16_t> flash;
+    int writes     = 0;
+    int fail_every = 0;
+    bool corrupt   = false;
+};
+
+// Commits the staged lines into its flash the way the devices do, failing
+// every fail_every-th write, and corrupting the first staged line if asked
+class FakeFlashDevice: public modbus::slave_concept
+{
+    fake_flash_state &s_;
+
+public:
+    explicit FakeFlashDevice(fake_flash_state &s)
+      : slave_concept(1, "fake"), s_(s)
+    {}
+
+    std::error_code try_read_registers(modbus::regtype,
+                                       int address,
+                                       int num_regs,
+                                       uint16_t *dest) override
+    {
+        for (int i = 0; i != num_regs; ++i)
+            dest[i] = s_.regs[address + i];
+        return {};
+    }
+
+    void write_holding_register(int address, uint16_t value) override
+    {
+        write_multiple_registers(address, &value, 1);
+    }
+
+    void write_multiple_registers(int address,
+                                  uint16_t const *regs,
+                                  int num_regs) override
+    {
+        if (s_.fail_every && ++s_.writes % s_.fail_every == 0)
+            throw std::runtime_error("timeout");
+
+        for (int i = 0; i != num_regs; ++i)
+            s_.regs[address + i] = regs[i];
+
+        using modbus::flash_register;
+        auto const r = [](flash_register r) { return static_cast<int>(r); };
+
+        if (s_.corrupt && address == r(flash_register::offset_high))
+        {
+            s_.regs[r(flash_register::buffer)] ^= 1;
+            s_.corrupt = false;
+        }
+
+        if (address == r(flash_register::cmd) &&
+            regs[0] ==
+              static_cast<uint16_t>(modbus::flash_command::write_segment))
+        {
+            auto const offset = (s_.regs[r(flash_register::offset_high)] << 16 |
+                                 s_.regs[r(flash_register::offset_low)]) /
+                                2;
+            auto const len = s_.regs[r(flash_register::chunk_len)] / 2;
+            s_.flash.resize(std::max<size_t>(s_.flash.size(), offset + len));
+            for (int i = 0; i != len; ++i)
+                s_.flash[offset + i] = s_.regs[r(flash_register::buffer) + i];
+        }
+    }
+};
+} // namespace
+
+TEST_CASE("flash session retransmits the lines that fail")
+{
+    std::vector<uint16_t> image(300);
+    for (size_t i = 0; i != image.size(); ++i)
+        image[i] = static_cast<uint16_t>(i * 7);
+
+    fake_flash_state device;
+    device.fail_every = 4;
+    device.corrupt    = true;
+
+    modbus::slave s(modbus::slave::model_type<FakeFlashDevice>{}, device);
+    modbus::flash_session session(s, image, 0x12345678, {true, 3});
+    session.run();
+
+    CHECK(session.lines() == 3);
+    CHECK(session.retransmissions() > 0);
+    CHECK(device.flash == image);
+
+    using modbus::flash_register;
+    CHECK(device.regs[static_cast<int>(flash_register::total_len_low)] == 600);
+    CHECK(device.regs[static_cast<int>(flash_register::crc32_high)] == 0x1234);
+    CHECK(device.regs[static_cast<int>(flash_register::cmd)] ==
+          static_cast<uint16_t>(modbus::flash_command::done));
+}
+
+TEST_CASE("flash session sends only the lines which differ from the base")
+{
+    std::vector<uint16_t> base(300);
+    for (size_t i = 0; i != base.size(); ++i)
+        base[i] = static_cast<uint16_t>(i * 7);
+
+    // Second line changed, third one grown
+    auto image = base;
+    image[200] ^= 1;
+    image.resize(400, 0xFFFF);
+
+    fake_flash_state device;
+    device.flash = base;
+
+    modbus::slave s(modbus::slave::model_type<FakeFlashDevice>{}, device);
+    modbus::flash_session::options_t options;
+    options.base = &base;
+    modbus::flash_session session(s, image, 0, options);
+    session.run();
+
+    CHECK(session.lines() == 4);
+    CHECK(session.lines_to_send() == 3);
+    CHECK(device.flash == image);
+}
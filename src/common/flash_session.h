@@ -0,0 +1,125 @@
+#pragma once
+#include "modbus_slave.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace modbus {
+
+// Holding registers of the devices' flash update protocol. A flash line is
+// staged in the buffer, preceded by its offset in the image and its length,
+// then committed by writing the write_segment command
+enum class flash_register : int
+{
+    required_image_version = 2992,
+    total_len_high         = 2993,
+    total_len_low          = 2994,
+    crc32_high             = 2995,
+    crc32_low              = 2996,
+    offset_high            = 2997,
+    offset_low             = 2998,
+    chunk_len              = 2999,
+    buffer                 = 3000,
+    cmd                    = 3128,
+};
+
+enum class flash_command : uint16_t
+{
+    start         = 0xE05D,
+    write_segment = 0xF1A5,
+    done          = 0xD01E,
+};
+
+// Sends an image to a device, one flash line per step(), so that the caller
+// decides when the next transactions go on the wire. Offset, length and the
+// line's first registers go in a single maximum size write, as they are
+// contiguous. A line failing to be staged, committed or verified is sent
+// again, up to max_retries times, instead of restarting the whole image.
+// Given the image the device currently holds, only the lines which differ
+// from it are sent
+class flash_session
+{
+public:
+    static int constexpr line_bytes = 256;
+    static int constexpr line_regs  = line_bytes / 2;
+
+    struct options_t
+    {
+        // Read the staged line back before committing it
+        bool verify = false;
+        int max_retries = 3;
+        // Image on the device, which must outlive the session, nullptr to
+        // send every line
+        std::vector<uint16_t> const *base = nullptr;
+    };
+
+    // The image must outlive the session
+    flash_session(slave &device,
+                  std::vector<uint16_t> const &image,
+                  uint32_t crc32,
+                  options_t const &options);
+
+    // Perform the next step: the start command, a line, or the total length
+    // and CRC along with the done command. Returns false once done. Throws
+    // when a step still fails after max_retries retransmissions
+    bool step();
+
+    void run()
+    {
+        while (step())
+            ;
+    }
+
+    // After the image has been broadcast, check the CRC the device reports
+    // for what it has received. When it matches, only the total length, CRC
+    // and done command are left to send, otherwise the whole image is
+    bool check_received();
+
+    [[nodiscard]] size_t lines() const noexcept { return lines_; }
+    [[nodiscard]] size_t lines_to_send() const noexcept
+    {
+        return changed_.size();
+    }
+    [[nodiscard]] size_t lines_sent() const noexcept { return next_line_; }
+    [[nodiscard]] int retransmissions() const noexcept
+    {
+        return retransmissions_;
+    }
+
+private:
+    enum class state_t
+    {
+        start,
+        lines,
+        finish,
+        done,
+    };
+
+    void send_line(size_t line);
+    void verify_line(uint16_t const *staged, int num_regs);
+    void finish();
+    void command(flash_command cmd);
+
+    slave &device_;
+    std::vector<uint16_t> const &image_;
+    uint32_t crc32_;
+    options_t options_;
+
+    size_t lines_;
+    std::vector<size_t> changed_;
+    size_t next_line_    = 0;
+    state_t state_       = state_t::start;
+    int retransmissions_ = 0;
+};
+
+// Stream an image to all the devices of a line at once: the start command,
+// each line and the total length are broadcast, delay apart. Broadcasts get
+// no reply, flash_session::check_received then tells which devices have
+// received the image
+std::error_code
+broadcast_image(RTUBus &bus,
+                std::vector<uint16_t> const &image,
+                std::chrono::microseconds delay);
+} // namespace modbus
@@ -0,0 +1,119 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+
+namespace modbus {
+
+// Derives a per-slave response timeout from the observed response times.
+// The timeout is a multiple of the worst of the average (EWMA) and the 95th
+// percentile of the recent response times, clamped to [floor, ceiling], so
+// that a missing slave costs a few times its usual response time instead of
+// the configured answering time.
+// A factor of 0 disables the adaptation, the timeout being always the
+// ceiling. While there are too few samples, and periodically while a slave
+// keeps timing out, the ceiling is used as well, so that a slave which got
+// slower can still be heard and the estimate can catch up.
+class latency_tracker
+{
+public:
+    using duration = std::chrono::steady_clock::duration;
+
+    explicit latency_tracker(std::chrono::milliseconds ceiling,
+                             double factor                   = 0,
+                             std::chrono::milliseconds floor = {})
+      : ceiling_(ceiling)
+      , floor_(std::min(floor, ceiling))
+      , factor_(factor)
+    {}
+
+    [[nodiscard]] std::chrono::milliseconds timeout() const noexcept
+    {
+        if (factor_ <= 0 || num_samples_ < min_samples ||
+            consecutive_timeouts_ % probe_interval == probe_interval - 1)
+            return ceiling_;
+
+        return adapted_;
+    }
+
+    // A response, even an exception one, has been received
+    void on_response(duration latency) noexcept
+    {
+        consecutive_timeouts_ = 0;
+
+        auto const us =
+          std::chrono::duration<double, std::micro>(latency).count();
+
+        // Same smoothing as for the TCP round trip time estimate
+        ewma_us_ = num_samples_ ? ewma_us_ + (us - ewma_us_) / 8 : us;
+
+        recent_us_[num_samples_ % recent_us_.size()] = us;
+        ++num_samples_;
+
+        auto const n   = std::min(num_samples_, recent_us_.size());
+        auto sorted    = recent_us_;
+        auto const p95 = sorted.begin() + (n * 95 - 1) / 100;
+        std::nth_element(sorted.begin(), p95, sorted.begin() + n);
+
+        auto const adapted = std::chrono::milliseconds(static_cast<long>(
+          std::ceil(factor_ * std::max(ewma_us_, *p95) / 1000)));
+        adapted_ = std::clamp(adapted, floor_, ceiling_);
+    }
+
+    void on_timeout() noexcept { ++consecutive_timeouts_; }
+
+    [[nodiscard]] std::chrono::milliseconds ceiling() const noexcept
+    {
+        return ceiling_;
+    }
+
+private:
+    static constexpr size_t min_samples      = 8;
+    static constexpr unsigned probe_interval = 8;
+
+    std::chrono::milliseconds ceiling_;
+    std::chrono::milliseconds floor_;
+    double factor_;
+
+    std::chrono::milliseconds adapted_{ceiling_};
+    double ewma_us_ = 0;
+    std::array<double, 32> recent_us_{};
+    size_t num_samples_            = 0;
+    unsigned consecutive_timeouts_ = 0;
+};
+} // namespace modbus
+
+#if defined(DOCTEST_LIBRARY_INCLUDED)
+TEST_CASE("Response timeout adapts to the observed latency")
+{
+    using namespace std::chrono_literals;
+
+    modbus::latency_tracker timeouts(500ms, 3, 20ms);
+    CHECK(timeouts.timeout() == 500ms);
+
+    for (int i = 0; i != 16; ++i)
+        timeouts.on_response(i % 4 ? 30ms : 50ms);
+    CHECK(timeouts.timeout() == 150ms);
+
+    // Clamped to the floor
+    for (int i = 0; i != 64; ++i)
+        timeouts.on_response(1ms);
+    CHECK(timeouts.timeout() == 20ms);
+
+    // Periodically probing with the ceiling while timing out
+    int probes = 0;
+    for (int i = 0; i != 16; ++i)
+    {
+        probes += timeouts.timeout() == 500ms;
+        timeouts.on_timeout();
+    }
+    CHECK(probes == 2);
+
+    modbus::latency_tracker fixed(500ms);
+    for (int i = 0; i != 16; ++i)
+        fixed.on_response(30ms);
+    CHECK(fixed.timeout() == 500ms);
+}
+#endif
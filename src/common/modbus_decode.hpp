@@ -0,0 +1,107 @@
+#pragma once
+#include "modbus_types.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// Compile-time specialized decoding of register values. Byte-level order is
+// big-endian as per modbus spec, and it is handled by the transport. Here
+// we handle the word/register-level order, fixed at compile time, so that
+// each (value_type, word_endianess) pair gets its own straight-line routine
+namespace modbus {
+
+template <value_type VT>
+struct value_traits;
+
+template <>
+struct value_traits<value_type::INT16>
+{
+    using type = int16_t;
+};
+template <>
+struct value_traits<value_type::UINT16>
+{
+    using type = uint16_t;
+};
+template <>
+struct value_traits<value_type::INT32>
+{
+    using type = int32_t;
+};
+template <>
+struct value_traits<value_type::UINT32>
+{
+    using type = uint32_t;
+};
+template <>
+struct value_traits<value_type::INT64>
+{
+    using type = int64_t;
+};
+template <>
+struct value_traits<value_type::UINT64>
+{
+    using type = uint64_t;
+};
+
+template <value_type VT>
+using value_t = typename value_traits<VT>::type;
+
+// little: LSW->MSW, big: MSW->LSW
+template <class T, word_endianess E>
+constexpr T
+decode(uint16_t const *regs) noexcept
+{
+    static_assert(E == word_endianess::little || E == word_endianess::big);
+
+    using U                = std::make_unsigned_t<T>;
+    constexpr size_t words = sizeof(T) / sizeof(uint16_t);
+
+    U value = 0;
+    for (size_t i = 0; i != words; ++i)
+    {
+        U const word =
+          E == word_endianess::little ? regs[words - 1 - i] : regs[i];
+        if constexpr (words > 1)
+            value = static_cast<U>(value << 16);
+        value |= word;
+    }
+
+    return static_cast<T>(value);
+}
+
+template <value_type VT, word_endianess E>
+constexpr value_t<VT>
+decode(uint16_t const *regs) noexcept
+{
+    return decode<value_t<VT>, E>(regs);
+}
+} // namespace modbus
+
+#if defined(DOCTEST_LIBRARY_INCLUDED)
+TEST_CASE("registers decode according to word order")
+{
+    using modbus::value_type;
+    using modbus::word_endianess;
+
+    uint16_t const regs[] = {0x1234, 0x5678, 0x9ABC, 0xDEF0};
+
+    CHECK(modbus::decode<value_type::UINT32, word_endianess::big>(regs) ==
+          0x12345678u);
+    CHECK(modbus::decode<value_type::UINT32, word_endianess::little>(regs) ==
+          0x56781234u);
+    CHECK(modbus::decode<value_type::UINT64, word_endianess::little>(regs) ==
+          0xDEF09ABC56781234u);
+    CHECK(modbus::decode<value_type::INT64, word_endianess::big>(regs) ==
+          static_cast<int64_t>(0x123456789ABCDEF0));
+
+    uint16_t const negative[] = {0xFFFF, 0xFFFE};
+    CHECK(modbus::decode<value_type::INT16, word_endianess::big>(negative) ==
+          -1);
+    CHECK(modbus::decode<value_type::INT32, word_endianess::little>(
+            negative) == -65537);
+    CHECK(modbus::decode<value_type::UINT16, word_endianess::big>(negative) ==
+          0xFFFF);
+}
+#endif
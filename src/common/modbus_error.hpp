@@ -0,0 +1,131 @@
+#pragma once
+#include <string>
+#include <system_error>
+#include <utility>
+
+namespace modbus {
+
+enum class errc
+{
+    // Exception codes, as returned by the slave in an exception response
+    illegal_function         = 0x01,
+    illegal_data_address     = 0x02,
+    illegal_data_value       = 0x03,
+    slave_device_failure     = 0x04,
+    acknowledge              = 0x05,
+    slave_device_busy        = 0x06,
+    negative_acknowledge     = 0x07,
+    memory_parity_error      = 0x08,
+    gateway_path_unavailable = 0x0A,
+    gateway_target_failed    = 0x0B,
+
+    // Transport level errors, detected on our side
+    timeout = 0x100,
+    bad_crc,
+    bad_frame,
+    bad_slave,
+};
+
+namespace detail {
+    class error_category: public std::error_category
+    {
+    public:
+        [[nodiscard]] char const *name() const noexcept override
+        {
+            return "modbus";
+        }
+
+        [[nodiscard]] std::string message(int ev) const override
+        {
+            switch (static_cast<errc>(ev))
+            {
+            case errc::illegal_function:
+                return "Illegal function";
+            case errc::illegal_data_address:
+                return "Illegal data address";
+            case errc::illegal_data_value:
+                return "Illegal data value";
+            case errc::slave_device_failure:
+                return "Slave device or server failure";
+            case errc::acknowledge:
+                return "Acknowledge";
+            case errc::slave_device_busy:
+                return "Slave device or server is busy";
+            case errc::negative_acknowledge:
+                return "Negative acknowledge";
+            case errc::memory_parity_error:
+                return "Memory parity error";
+            case errc::gateway_path_unavailable:
+                return "Gateway path unavailable";
+            case errc::gateway_target_failed:
+                return "Target device failed to respond";
+            case errc::timeout:
+                return "Response timeout";
+            case errc::bad_crc:
+                return "Invalid CRC";
+            case errc::bad_frame:
+                return "Invalid response frame";
+            case errc::bad_slave:
+                return "Response from unexpected slave";
+            }
+            return "Unknown modbus error " + std::to_string(ev);
+        }
+    };
+} // namespace detail
+
+inline std::error_category const &
+error_category() noexcept
+{
+    static detail::error_category const category;
+    return category;
+}
+
+inline std::error_code
+make_error_code(errc e) noexcept
+{
+    return {static_cast<int>(e), error_category()};
+}
+
+// True if the slave answered, albeit with an exception response
+inline bool
+is_exception(std::error_code const &ec) noexcept
+{
+    return ec.category() == error_category() &&
+           ec.value() < static_cast<int>(errc::timeout);
+}
+} // namespace modbus
+
+namespace std {
+template <>
+struct is_error_code_enum<modbus::errc>: true_type
+{};
+} // namespace std
+
+namespace modbus {
+// Either a value or the error preventing it, returned by the non-throwing
+// APIs
+template <class T>
+class result
+{
+    T value_{};
+    std::error_code ec_;
+
+public:
+    result(T value) noexcept : value_(std::move(value)) {}
+    result(std::error_code const &ec) noexcept : ec_(ec) {}
+    result(errc e) noexcept : ec_(make_error_code(e)) {}
+
+    [[nodiscard]] explicit operator bool() const noexcept { return !ec_; }
+    [[nodiscard]] std::error_code const &error() const noexcept { return ec_; }
+
+    // Only meaningful on success
+    [[nodiscard]] T const &operator*() const noexcept { return value_; }
+
+    [[nodiscard]] T const &value(char const *what) const
+    {
+        if (ec_)
+            throw std::system_error(ec_, what);
+        return value_;
+    }
+};
+} // namespace modbus
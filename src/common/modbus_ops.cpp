@@ -7,133 +7,504 @@
 #    define LOG_S(x) std::clog
 #    define EOL << std::endl;
 #endif
+#include "crc32.hpp"
+#include "doctest.h"
 #include "modbus_slave.hpp"
 
+#include <algorithm>
+#include <cinttypes>
+#include <fcntl.h>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
 #include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+
+namespace modbus {
+
+std::vector<uint16_t>
+registers_from_file(std::string const &filename, uint32_t *maybe_crc)
+{
+    int const fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("invalid filename " + filename);
+
+    struct stat st
+    {};
+    int const stat_rv   = fstat(fd, &st);
+    auto const file_len = stat_rv == 0 ? static_cast<size_t>(st.st_size) : 0;
+
+    // The image is read straight from the page cache, without a copy
+    void *const mapped =
+      file_len ? mmap(nullptr, file_len, PROT_READ, MAP_PRIVATE, fd, 0)
+               : nullptr;
+    close(fd);
+
+    if (stat_rv != 0 || mapped == MAP_FAILED)
+        throw std::runtime_error("failed mapping " + filename);
+
+    struct mapping_t
+    {
+        void *addr;
+        size_t len;
+        ~mapping_t()
+        {
+            if (len)
+                munmap(addr, len);
+        }
+    } const mapping{mapped, file_len};
+
+    auto const *bytes = static_cast<uint8_t const *>(mapping.addr);
+
+    // Eventually we need a 4-byte aligned size, zero padded
+    std::vector<uint16_t> content((file_len + 3) / 4 * 2);
+
+    // Checksum and pack a chunk at a time, while it is still in cache
+    size_t constexpr chunk_len = 64 * 1024;
+    uint32_t crc_value         = 0;
+    for (size_t offset = 0; offset < file_len; offset += chunk_len)
+    {
+        auto const end = std::min(offset + chunk_len, file_len);
+        crc_value      = crc32::update(crc_value, bytes + offset, end - offset);
+        for (size_t i = offset; i + 1 < end; i += 2)
+            content[i / 2] = bytes[i] << 8 | bytes[i + 1];
+    }
+    if (file_len % 2)
+        content[file_len / 2] = bytes[file_len - 1] << 8;
+
+    uint8_t const padding[4] = {};
+    crc_value                = crc32::update(
+      crc_value, padding, content.size() * sizeof(uint16_t) - file_len);
+
+    LOG_S(INFO) << "read " << file_len << " bytes from " << filename << " into "
+                << content.size() << " elements. CRC32 = " << std::hex
+                << crc_value << std::dec EOL;
+
+    if (maybe_crc)
+        *maybe_crc = crc_value;
+    return content;
+}
+} // namespace modbus
 
 namespace {
-class CRC32
+// A device of a rollout manifest, and how its update went
+struct rollout_target
 {
-    uint32_t table[256];
+    std::string device;
+    int slave_id;
+    std::string image_file;
+
+    // Shared by the targets of a broadcast
+    std::shared_ptr<std::vector<uint16_t> const> image;
+    uint32_t crc = 0;
+    std::unique_ptr<modbus::slave> slave;
+    std::unique_ptr<modbus::flash_session> session;
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point finished;
+    std::string error;
+};
 
-public:
-    CRC32()
+std::vector<std::unique_ptr<rollout_target>>
+read_manifest(std::string const &filename)
+{
+    std::ifstream ifs(filename);
+    if (!ifs)
+        throw std::invalid_argument("invalid manifest " + filename);
+
+    std::vector<std::unique_ptr<rollout_target>> targets;
+    std::set<std::pair<std::string, int>> seen;
+
+    std::string line;
+    for (int line_no = 1; std::getline(ifs, line); ++line_no)
     {
-        uint32_t const polynomial = 0xEDB88320;
-        for (uint32_t i = 0; i < 256; i++)
+        line.erase(std::min(line.find('#'), line.size()));
+
+        std::istringstream iss(line);
+        auto target = std::make_unique<rollout_target>();
+        if (!(iss >> target->device))
+            continue;
+
+        auto const where = filename + ":" + std::to_string(line_no);
+        if (!(iss >> target->slave_id >> target->image_file))
+            throw std::invalid_argument(
+              where + ": expected <serial device> <slave id> <image>");
+
+        // Two sessions can't take turns updating the same device
+        if (!seen.emplace(target->device, target->slave_id).second)
+            throw std::invalid_argument(where + ": duplicate device");
+
+        targets.push_back(std::move(target));
+    }
+
+    return targets;
+}
+
+// Step the sessions of the devices of a bus in turns, so that the bus
+// serves the others while a device is busy writing a flash line
+void
+run_in_turns(std::vector<rollout_target *> active)
+{
+    while (!active.empty())
+    {
+        for (auto it = active.begin(); it != active.end();)
         {
-            uint32_t c = i;
-            for (size_t j = 0; j < 8; j++)
+            auto *target = *it;
+
+            bool more = false;
+            try
             {
-                if (c & 1)
-                {
-                    c = polynomial ^ (c >> 1);
-                }
-                else
-                {
-                    c >>= 1;
-                }
+                more = target->session->step();
             }
-            table[i] = c;
+            catch (std::exception const &e)
+            {
+                target->error = e.what();
+            }
+
+            if (more)
+            {
+                ++it;
+                continue;
+            }
+
+            target->finished = std::chrono::steady_clock::now();
+            it               = active.erase(it);
         }
     }
+}
 
-    uint32_t update(uint32_t initial, const void *buf, size_t len)
+// Log how the update of each target went, returning the number of failures
+int
+report_rollout(std::vector<std::unique_ptr<rollout_target>> const &targets)
+{
+    int failed = 0;
+    for (auto const &target: targets)
     {
-        uint32_t c       = initial ^ 0xFFFFFFFF;
-        const uint8_t *u = static_cast<const uint8_t *>(buf);
-        for (size_t i = 0; i < len; ++i)
+        if (!target->error.empty())
         {
-            c = table[(c ^ u[i]) & 0xFF] ^ (c >> 8);
+            ++failed;
+            LOG_S(ERROR) << "FLASH " << target->device << "@"
+                         << target->slave_id << " " << target->image_file
+                         << ": FAILED, " << target->error EOL;
+            continue;
         }
-        return c ^ 0xFFFFFFFF;
+
+        auto const bytes = target->image->size() * sizeof(uint16_t);
+        auto const ms =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+            target->finished - target->started)
+            .count();
+
+        LOG_S(INFO) << "FLASH " << target->device << "@" << target->slave_id
+                    << " " << target->image_file << ": OK, " << bytes
+                    << " bytes in " << ms << " ms ("
+                    << (ms ? bytes * 1000 / ms : bytes) << " B/s), "
+                    << target->session->retransmissions()
+                    << " retransmissions" EOL;
     }
 
-    uint32_t update(uint32_t initial, uint8_t byte)
+    LOG_S(INFO) << "FLASH completed, " << targets.size() - failed << "/"
+                << targets.size() << " devices updated" EOL;
+
+    return failed;
+}
+
+// Update the devices of a bus in turns
+void
+rollout_bus(std::vector<rollout_target *> const &targets,
+            modbus::rtu_parameters const &rp,
+            modbus::flash_session::options_t const &options,
+            bool verbose)
+{
+    std::shared_ptr<modbus::RTUBus> bus;
+    try
     {
-        uint32_t c = initial ^ 0xFFFFFFFF;
-        c          = table[(c ^ byte) & 0xFF] ^ (c >> 8);
-        return c ^ 0xFFFFFFFF;
+        bus = std::make_shared<modbus::RTUBus>(
+          modbus::serial_line(targets.front()->device, rp.serial_config),
+          verbose);
+    }
+    catch (std::exception const &e)
+    {
+        for (auto *target: targets)
+            target->error = e.what();
+        return;
     }
-};
 
-std::vector<uint16_t>
-registers_from_file(std::string const &filename, uint32_t *maybe_crc = nullptr)
+    std::vector<rollout_target *> active;
+    for (auto *target: targets)
+    {
+        try
+        {
+            target->image = std::make_shared<std::vector<uint16_t> const>(
+              modbus::registers_from_file(target->image_file, &target->crc));
+            target->slave = std::make_unique<modbus::slave>(
+              modbus::slave::model_type<modbus::RTUSlave>{},
+              target->slave_id,
+              "Server_" + std::to_string(target->slave_id),
+              bus,
+              rp.answering_time);
+            target->session = std::make_unique<modbus::flash_session>(
+              *target->slave, *target->image, target->crc, options);
+            target->started = std::chrono::steady_clock::now();
+            active.push_back(target);
+        }
+        catch (std::exception const &e)
+        {
+            target->error = e.what();
+        }
+    }
+
+    run_in_turns(std::move(active));
+}
+
+// Walk num_regs registers laid out in consecutive files, from record 0 of
+// file onwards, calling f(file, record, offset, n) for chunks of at most
+// max_regs registers which don't straddle two files
+template <class F>
+void
+for_each_file_record_chunk(int file, size_t num_regs, int max_regs, F &&f)
 {
-    std::ifstream ifs(filename, std::ios::binary);
+    size_t constexpr records_per_file = modbus::pdu::max_record_number + 1;
 
-    if (!ifs)
-        throw std::runtime_error("invalid filename " + filename);
+    for (size_t offset = 0; offset != num_regs;)
+    {
+        auto const record = offset % records_per_file;
+        auto const n      = std::min({num_regs - offset,
+                                 static_cast<size_t>(max_regs),
+                                 records_per_file - record});
+
+        f(file + static_cast<int>(offset / records_per_file),
+          static_cast<int>(record),
+          offset,
+          static_cast<int>(n));
+        offset += n;
+    }
+}
 
-    ifs.ignore(std::numeric_limits<std::streamsize>::max());
-    auto const file_len = ifs.gcount();
-    ifs.clear();
-    ifs.seekg(0, std::ios::beg);
+void
+check_register_value(intmax_t value)
+{
+    if (value < 0 || value > std::numeric_limits<uint16_t>::max())
+        throw std::invalid_argument("invalid value: must be [0..65535]");
+}
 
-    std::istreambuf_iterator<char> it{ifs}, ibe;
+// Perform an operation of a batch script on a slave of the bus, returning
+// the values read
+std::vector<intmax_t>
+run_batch_operation(std::istringstream &iss,
+                    std::map<int, modbus::slave> &slaves,
+                    std::shared_ptr<modbus::RTUBus> const &bus,
+                    modbus::rtu_parameters const &rp)
+{
+    std::string op;
+    int slave_id;
+    std::string address_arg;
+    std::string arg;
+    if (!(iss >> op >> slave_id >> address_arg >> arg) ||
+        (op != "R" && op != "W"))
+        throw std::invalid_argument(
+          "expected R <slave id> <register> <regsize> or W <slave id> "
+          "<register> <value>");
+
+    auto &device =
+      slaves
+        .try_emplace(slave_id,
+                     modbus::slave::model_type<modbus::RTUSlave>{},
+                     slave_id,
+                     "Server_" + std::to_string(slave_id),
+                     bus,
+                     rp.answering_time)
+        .first->second;
+
+    int const address = std::strtol(address_arg.c_str(), nullptr, 0);
+    if (op == "W")
+    {
+        intmax_t const value = std::strtoimax(arg.c_str(), nullptr, 0);
+        check_register_value(value);
+        device.write_holding_register(address, value);
+        return {};
+    }
+
+    auto const spec = modbus::parse_regspec(arg);
+    if (!spec.raw)
+        return {device.read_holding_registers(
+          address, spec.regsize, spec.endianess)};
+
+    auto const registers = device.read_holding_registers(address, spec.regsize);
+    return {registers.begin(), registers.end()};
+}
 
-    std::vector<uint16_t> content;
+// A device which has answered the scan of its bus
+struct scan_hit
+{
+    std::string device;
+    std::string line_config;
+    int slave_id;
+    std::chrono::steady_clock::duration latency;
+};
 
-    // Eventually we need a 4-byte aligned size
-    content.reserve(((file_len + 3) / 4) * 4);
+// Probe all the unit ids of a bus over a single connection, with each line
+// config in turn until one gets answers
+std::vector<scan_hit>
+scan_bus(std::string const &device,
+         std::vector<std::string> const &line_configs,
+         std::chrono::milliseconds probe_timeout,
+         bool verbose)
+{
+    int constexpr max_slave_id = 247;
 
-    CRC32 checksum;
-    uint32_t crc_value = 0;
-    uint8_t high_byte{};
-    while (it != ibe)
+    std::vector<scan_hit> hits;
+    for (auto const &line_config: line_configs)
     {
-        high_byte = static_cast<uint8_t>(*it++);
-        crc_value = checksum.update(crc_value, high_byte);
+        std::shared_ptr<modbus::RTUBus> bus;
+        try
+        {
+            bus = std::make_shared<modbus::RTUBus>(
+              modbus::serial_line(device, line_config), verbose);
+        }
+        catch (std::exception const &e)
+        {
+            LOG_S(WARNING) << "SCAN " << device << " " << line_config << ": "
+                           << e.what() EOL;
+            continue;
+        }
+
+        LOG_S(INFO) << "SCAN " << device << " " << line_config EOL;
+        for (int slave_id = 1; slave_id <= max_slave_id; ++slave_id)
+        {
+            modbus::RTUSlave probe(slave_id,
+                                   "Server_" + std::to_string(slave_id),
+                                   bus,
+                                   probe_timeout);
+
+            uint16_t value;
+            auto const start = std::chrono::steady_clock::now();
+            auto const ec    = probe.try_read_registers(
+              modbus::regtype::holding, 0, 1, &value);
+
+            // A device without register 0 still answers, with an exception
+            if (!ec || modbus::is_exception(ec))
+                hits.push_back({device,
+                                line_config,
+                                slave_id,
+                                std::chrono::steady_clock::now() - start});
+        }
+
+        if (!hits.empty())
+            break;
+    }
+
+    return hits;
+}
+
+// Read [first, first + num_regs) into csv, in a single request if the
+// device accepts it, otherwise as the two halves of the range, down to the
+// single registers it doesn't have. Below a few registers, which is where
+// the bisection of a hole ends up, they are read one at a time, costing a
+// request per register instead of two
+void
+dump_range(modbus::slave &device,
+           modbus::regtype type,
+           int first,
+           int num_regs,
+           std::ostream &csv,
+           modbus::dump_result_t &result)
+{
+    int constexpr max_attempts = 3;
+    uint16_t regs[MODBUS_MAX_READ_REGISTERS];
 
-        uint8_t const low_byte = it != ibe ? static_cast<uint8_t>(*it++) : 0;
-        crc_value              = checksum.update(crc_value, low_byte);
+    int const last = first + num_regs - 1;
+    std::error_code ec;
+    for (int attempt = 1;; ++attempt)
+    {
+        ++result.requests;
+        ec = device.try_read_registers(type, first, num_regs, regs);
+        if (!ec || modbus::is_exception(ec) || attempt == max_attempts)
+            break;
 
-        uint16_t regval = (high_byte << 8) | low_byte;
+        LOG_S(WARNING) << "DUMP registers " << first << "-" << last << ": "
+                       << ec.message() << ", retrying" EOL;
+    }
 
-        content.push_back(regval);
+    if (!ec)
+    {
+        for (int i = 0; i != num_regs; ++i)
+            csv << first + i << "," << regs[i] << "\n";
+        result.registers += num_regs;
+        return;
     }
 
-    // And now ensure the whole thing is 4-byte aligned
-    while (content.size() % 2)
+    if (ec != modbus::errc::illegal_data_address)
     {
-        crc_value = checksum.update(crc_value, 0);
-        crc_value = checksum.update(crc_value, 0);
-        content.push_back(0);
+        LOG_S(WARNING) << "DUMP registers " << first << "-" << last
+                       << " skipped: " << ec.message() EOL;
+
+        auto &skipped = result.skipped;
+        if (!skipped.empty() && skipped.back().second + 1 == first)
+            skipped.back().second = last;
+        else
+            skipped.emplace_back(first, last);
+        return;
     }
 
-    LOG_S(INFO) << "read " << file_len << " bytes from " << filename << " into "
-                << content.size() << " elements. CRC32 = " << std::hex
-                << crc_value << std::dec EOL;
+    int constexpr bisect_min = 8;
+    if (num_regs == 1)
+        return;
+    if (num_regs <= bisect_min)
+    {
+        for (int i = 0; i != num_regs; ++i)
+            dump_range(device, type, first + i, 1, csv, result);
+        return;
+    }
 
-    if (maybe_crc)
-        *maybe_crc = crc_value;
-    return content;
+    int const half = num_regs / 2;
+    dump_range(device, type, first, half, csv, result);
+    dump_range(device, type, first + half, num_regs - half, csv, result);
 }
 } // namespace
 
 namespace modbus {
 
-void
-single_read(modbus::rtu_parameters const &rp,
-            int address,
-            std::string regspec,
-            bool verbose)
+regspec_t
+parse_regspec(std::string const &regspec)
 {
-    assert(!regspec.empty());
-
-    auto const last_char = regspec.back();
+    auto const last_char = regspec.empty() ? '\0' : regspec.back();
     if (regspec.size() < 2 ||
         (last_char != 'l' && last_char != 'b' && last_char != 'r'))
         throw std::invalid_argument("invalid regsize specification: " +
                                     regspec);
 
+    if (last_char == 'r')
+        return {static_cast<int>(std::strtol(regspec.c_str(), nullptr, 0)),
+                true,
+                word_endianess::big};
+
     int const regsize = regspec[0] - '0';
-    if (last_char != 'r' && regsize != 1 && regsize != 2 && regsize != 4)
+    if (regsize != 1 && regsize != 2 && regsize != 4)
         throw std::invalid_argument("regsize must be 1, 2 or 4");
 
+    return {regsize,
+            false,
+            regspec[1] == 'l' ? word_endianess::little : word_endianess::big};
+}
+
+void
+single_read(modbus::rtu_parameters const &rp,
+            int address,
+            std::string regspec,
+            bool verbose)
+{
+    auto const spec = parse_regspec(regspec);
+
     modbus::slave rtu_slave(
       modbus::slave::model_type<modbus::RTUSlave>{},
       rp.slave_id,
@@ -142,12 +513,11 @@ single_read(modbus::rtu_parameters const &rp,
       rp.answering_time,
       verbose);
 
-    if (last_char == 'r')
+    if (spec.raw)
     {
         // Raw read
-        int const num_regs = std::strtol(regspec.c_str(), nullptr, 0);
         std::vector<uint16_t> registers =
-          rtu_slave.read_holding_registers(address, num_regs);
+          rtu_slave.read_holding_registers(address, spec.regsize);
 
         for (auto r = 0ULL; r != registers.size(); ++r)
         {
@@ -159,16 +529,106 @@ single_read(modbus::rtu_parameters const &rp,
     }
     else
     {
-        modbus::word_endianess word_endianess;
+        int64_t const val = rtu_slave.read_holding_registers(
+          address, spec.regsize, spec.endianess);
 
-        word_endianess = regspec[1] == 'l' ? modbus::word_endianess::little
-                                           : modbus::word_endianess::big;
+        LOG_S(INFO) << "SINGLE READ REGISTER " << address << ": " << val EOL;
+    }
+}
+
+dump_result_t
+register_dump(modbus::rtu_parameters const &rp,
+              modbus::regtype type,
+              int first,
+              int last,
+              std::string const &filename,
+              bool verbose)
+{
+    if (first < 0 || last > 0xFFFF || first > last)
+        throw std::invalid_argument("invalid register range");
 
-        int64_t const val =
-          rtu_slave.read_holding_registers(address, regsize, word_endianess);
+    std::ofstream ofs(filename);
+    if (!ofs)
+        throw std::invalid_argument("invalid filename " + filename);
 
-        LOG_S(INFO) << "SINGLE READ REGISTER " << address << ": " << val EOL;
+    modbus::slave rtu_slave(
+      modbus::slave::model_type<modbus::RTUSlave>{},
+      rp.slave_id,
+      "Server_" + std::to_string(rp.slave_id),
+      modbus::RTUSlave::serial_line(rp.serial_device, rp.serial_config),
+      rp.answering_time,
+      verbose);
+
+    ofs << "register,value\n";
+
+    dump_result_t result;
+    for (int address = first; address <= last;)
+    {
+        int const n = std::min(last - address + 1, MODBUS_MAX_READ_REGISTERS);
+
+        auto const found = result.registers;
+        dump_range(rtu_slave, type, address, n, ofs, result);
+        ofs.flush();
+
+        LOG_S(INFO) << "DUMP registers " << address << "-" << address + n - 1
+                    << ": " << result.registers - found << " found" EOL;
+        address += n;
+    }
+
+    LOG_S(INFO) << "DUMP completed, " << result.registers << " registers in "
+                << result.requests << " requests into " << filename EOL;
+    for (auto const &[skipped_first, skipped_last]: result.skipped)
+        LOG_S(WARNING) << "DUMP skipped registers " << skipped_first << "-"
+                       << skipped_last EOL;
+
+    return result;
+}
+
+int
+run_batch(modbus::rtu_parameters const &rp,
+          std::istream &script,
+          std::ostream &out,
+          bool verbose)
+{
+    auto const bus = std::make_shared<modbus::RTUBus>(
+      modbus::serial_line(rp.serial_device, rp.serial_config), verbose);
+    std::map<int, modbus::slave> slaves;
+
+    int failed = 0;
+    std::string line;
+    for (int line_no = 1; std::getline(script, line); ++line_no)
+    {
+        line.erase(std::min(line.find('#'), line.size()));
+
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+
+        std::istringstream iss(line);
+        auto const start = std::chrono::steady_clock::now();
+        auto const latency = [&]
+        {
+            return std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - start)
+              .count();
+        };
+
+        try
+        {
+            auto const values = run_batch_operation(iss, slaves, bus, rp);
+
+            out << line_no << " OK " << latency();
+            for (auto const value: values)
+                out << " " << value;
+        }
+        catch (std::exception const &e)
+        {
+            ++failed;
+            out << line_no << " ERROR " << latency() << " " << e.what();
+        }
+        out << std::endl;
     }
+
+    return failed;
 }
 
 void
@@ -177,8 +637,7 @@ single_write(modbus::rtu_parameters const &rp,
              intmax_t value,
              bool verbose)
 {
-    if (value < 0 || value > std::numeric_limits<uint16_t>::max())
-        throw std::invalid_argument("invalid value: must be [0..65535]");
+    check_register_value(value);
 
     modbus::slave rtu_slave(
       modbus::slave::model_type<modbus::RTUSlave>{},
@@ -215,29 +674,10 @@ file_transfer(modbus::rtu_parameters const &rp,
 void
 flash_update(modbus::rtu_parameters const &rp,
              std::string filename,
+             std::string const &base_filename,
+             flash_session::options_t const &options,
              bool verbose)
 {
-    enum class flash_update_registers : int
-    {
-        required_image_version = 2992,
-        total_len_high         = 2993,
-        total_len_low          = 2994,
-        crc32_high             = 2995,
-        crc32_low              = 2996,
-        offset_high            = 2997,
-        offset_low             = 2998,
-        chunk_len              = 2999,
-        buffer                 = 3000,
-        cmd                    = 3128,
-    };
-
-    enum class flash_update_commands : uint16_t
-    {
-        start         = 0xE05D,
-        write_segment = 0xF1A5,
-        done          = 0xD01E,
-    };
-
     modbus::slave rtu_slave(
       modbus::slave::model_type<modbus::RTUSlave>{},
       rp.slave_id,
@@ -247,7 +687,7 @@ flash_update(modbus::rtu_parameters const &rp,
       verbose);
 
     uint16_t const required_image_version = rtu_slave.read_holding_registers(
-      static_cast<int>(flash_update_registers::required_image_version),
+      static_cast<int>(flash_register::required_image_version),
       1,
       modbus::word_endianess::little);
 
@@ -264,125 +704,343 @@ flash_update(modbus::rtu_parameters const &rp,
                     << reset_vector << std::dec EOL;
     }
 
-    auto const total_len_bytes = content.size() * sizeof(uint16_t);
+    std::vector<uint16_t> base;
+    auto session_options = options;
+    if (!base_filename.empty())
+    {
+        base                 = registers_from_file(base_filename);
+        session_options.base = &base;
+    }
 
-    uint16_t constexpr flash_line_bytes = 256;
-    auto const full_lines               = total_len_bytes / flash_line_bytes;
+    flash_session session(rtu_slave, content, checksum, session_options);
+    if (session_options.base)
+        LOG_S(INFO) << "DELTA against " << base_filename << ", "
+                    << session.lines_to_send() << " of " << session.lines()
+                    << " lines changed" EOL;
+    session.run();
 
-    int constexpr modbus_regs_at_once =
-      flash_line_bytes / 2 /
-      sizeof(uint16_t); // 1/2 flash line i.e. 64 registers i.e. 128 bytes
+    LOG_S(INFO) << "FLASH UPDATE completed, " << session.retransmissions()
+                << " retransmissions" EOL;
+}
 
-    uint32_t flash_offset = 0;
-    int buffer_offset     = static_cast<int>(flash_update_registers::buffer);
-    auto const *regs      = content.data();
+int
+flash_rollout(modbus::rtu_parameters const &rp,
+              std::string const &manifest,
+              flash_session::options_t const &options,
+              bool verbose)
+{
+    auto const targets = read_manifest(manifest);
+
+    std::map<std::string, std::vector<rollout_target *>> buses;
+    for (auto const &target: targets)
+        buses[target->device].push_back(target.get());
+
+    LOG_S(INFO) << "FLASH ROLLOUT of " << targets.size() << " devices on "
+                << buses.size() << " buses" EOL;
+
+    std::vector<std::thread> workers;
+    for (auto const &bus: buses)
+        workers.emplace_back(rollout_bus,
+                             std::cref(bus.second),
+                             std::cref(rp),
+                             std::cref(options),
+                             verbose);
+    for (auto &worker: workers)
+        worker.join();
+
+    return report_rollout(targets);
+}
+
+int
+flash_broadcast(modbus::rtu_parameters const &rp,
+                std::string const &filename,
+                std::vector<int> const &slave_ids,
+                std::chrono::milliseconds delay,
+                flash_session::options_t const &options,
+                bool verbose)
+{
+    uint32_t checksum;
+    auto const content = std::make_shared<std::vector<uint16_t> const>(
+      registers_from_file(filename, &checksum));
 
-    LOG_S(INFO) << "Sending 'start' command" EOL;
-    rtu_slave.write_holding_register(
-      static_cast<int>(flash_update_registers::cmd),
-      static_cast<uint16_t>(flash_update_commands::start));
+    auto const bus = std::make_shared<modbus::RTUBus>(
+      modbus::serial_line(rp.serial_device, rp.serial_config), verbose);
 
-    for (auto flash_line = 0ULL; flash_line != full_lines; ++flash_line)
+    auto const started = std::chrono::steady_clock::now();
+    if (auto const ec = broadcast_image(*bus, *content, delay))
+        throw std::system_error(ec, "Failed broadcast");
+
+    // Devices which have received the image only get the CRC and the done
+    // command, the others the whole image again
+    std::vector<std::unique_ptr<rollout_target>> targets;
+    std::vector<rollout_target *> active;
+    for (auto const slave_id: slave_ids)
     {
-        LOG_S(INFO) << "FLASH line " << flash_line << " @ 0x" << std::hex
-                    << flash_offset << ", REGBUFF @ 0x" << buffer_offset
-                    << std::dec << ",  " << flash_line_bytes << " bytes in 2 * "
-                    << modbus_regs_at_once << " registers" EOL;
-
-        // Send current offset inside the receiver's pre-flash-write buffer,
-        // i.e. flash_line * flash_line_bytes
-        rtu_slave.write_holding_register(
-          static_cast<int>(flash_update_registers::offset_high),
-          flash_offset >> 16);
-
-        rtu_slave.write_holding_register(
-          static_cast<int>(flash_update_registers::offset_low), flash_offset);
-
-        // Send the current flash_line in two modbus' multiple-register writes
-        rtu_slave.write_multiple_registers(
-          buffer_offset, regs, modbus_regs_at_once);
-        rtu_slave.write_multiple_registers(buffer_offset + modbus_regs_at_once,
-                                           regs + modbus_regs_at_once,
-                                           modbus_regs_at_once);
-
-        // Send the actual bytes of the current flash line, in this case this is
-        // always a full line
-        rtu_slave.write_holding_register(
-          static_cast<int>(flash_update_registers::chunk_len),
-          flash_line_bytes);
-
-        // Send the write_segment command
-        rtu_slave.write_holding_register(
-          static_cast<int>(flash_update_registers::cmd),
-          static_cast<uint16_t>(flash_update_commands::write_segment));
-
-        regs += 2 * modbus_regs_at_once;
-        flash_offset += flash_line_bytes;
+        auto &target =
+          *targets.emplace_back(std::make_unique<rollout_target>());
+
+        target.device     = rp.serial_device;
+        target.slave_id   = slave_id;
+        target.image_file = filename;
+        target.image      = content;
+        target.crc        = checksum;
+
+        target.slave = std::make_unique<modbus::slave>(
+          modbus::slave::model_type<modbus::RTUSlave>{},
+          slave_id,
+          "Server_" + std::to_string(slave_id),
+          bus,
+          rp.answering_time);
+        target.session = std::make_unique<flash_session>(
+          *target.slave, *target.image, target.crc, options);
+        target.started = started;
+
+        if (!target.session->check_received())
+            LOG_S(WARNING) << "FLASH " << rp.serial_device << "@" << slave_id
+                           << ": retransmitting the whole image" EOL;
+        active.push_back(&target);
     }
 
-    auto const remaining_bytes = total_len_bytes % flash_line_bytes;
+    run_in_turns(std::move(active));
 
-    if (remaining_bytes)
-    {
-        rtu_slave.write_holding_register(
-          static_cast<int>(flash_update_registers::offset_high),
-          flash_offset >> 16);
+    return report_rollout(targets);
+}
+
+void
+file_record_upload(modbus::rtu_parameters const &rp,
+                   int file,
+                   std::string filename,
+                   bool verbose)
+{
+    uint32_t checksum;
+    std::vector<uint16_t> content = registers_from_file(filename, &checksum);
+
+    modbus::slave rtu_slave(
+      modbus::slave::model_type<modbus::RTUSlave>{},
+      rp.slave_id,
+      "Server_" + std::to_string(rp.slave_id),
+      modbus::RTUSlave::serial_line(rp.serial_device, rp.serial_config),
+      rp.answering_time,
+      verbose);
 
-        rtu_slave.write_holding_register(
-          static_cast<int>(flash_update_registers::offset_low), flash_offset);
+    for_each_file_record_chunk(
+      file,
+      content.size(),
+      pdu::max_write_file_record_regs,
+      [&](int current_file, int record, size_t offset, int n)
+      {
+          LOG_S(INFO) << "FILE RECORD WRITE file " << current_file
+                      << " record " << record << ", " << n
+                      << " registers" EOL;
+
+          if (auto const ec = rtu_slave.try_write_file_record(
+                current_file, record, content.data() + offset, n))
+              throw std::system_error(ec,
+                                      "Failed write_file_record, file " +
+                                        std::to_string(current_file) +
+                                        " record " +
+                                        std::to_string(record));
+      });
+
+    LOG_S(INFO) << "FILE RECORD UPLOAD completed, " << content.size()
+                << " registers, CRC32 = " << std::hex << checksum
+                << std::dec EOL;
+}
 
-        rtu_slave.write_holding_register(
-          static_cast<int>(flash_update_registers::chunk_len), remaining_bytes);
+void
+file_record_download(modbus::rtu_parameters const &rp,
+                     int file,
+                     int num_regs,
+                     std::string filename,
+                     bool verbose)
+{
+    if (num_regs < 1)
+        throw std::invalid_argument("invalid number of registers: " +
+                                    std::to_string(num_regs));
 
-        auto const remaining_chunks = remaining_bytes / 2 / modbus_regs_at_once;
-        auto const remaining_regs = (remaining_bytes / 2) % modbus_regs_at_once;
+    std::ofstream ofs(filename, std::ios::binary);
+    if (!ofs)
+        throw std::runtime_error("invalid filename " + filename);
 
-        if (remaining_chunks)
-        {
-            LOG_S(INFO) << "FLASH remaining chunk @ 0x" << std::hex
-                        << flash_offset << ", REGBUFF @ 0x" << buffer_offset
-                        << std::dec << ",  " << modbus_regs_at_once * 2
-                        << " bytes in " << modbus_regs_at_once
-                        << " registers" EOL;
+    modbus::slave rtu_slave(
+      modbus::slave::model_type<modbus::RTUSlave>{},
+      rp.slave_id,
+      "Server_" + std::to_string(rp.slave_id),
+      modbus::RTUSlave::serial_line(rp.serial_device, rp.serial_config),
+      rp.answering_time,
+      verbose);
 
-            rtu_slave.write_multiple_registers(
-              buffer_offset, regs, modbus_regs_at_once);
+    std::vector<uint16_t> content(num_regs);
+    for_each_file_record_chunk(
+      file,
+      content.size(),
+      pdu::max_read_file_record_regs,
+      [&](int current_file, int record, size_t offset, int n)
+      {
+          LOG_S(INFO) << "FILE RECORD READ file " << current_file
+                      << " record " << record << ", " << n
+                      << " registers" EOL;
+
+          if (auto const ec = rtu_slave.try_read_file_record(
+                current_file, record, n, content.data() + offset))
+              throw std::system_error(ec,
+                                      "Failed read_file_record, file " +
+                                        std::to_string(current_file) +
+                                        " record " +
+                                        std::to_string(record));
+      });
+
+    // Registers are stored high byte first, as registers_from_file reads them
+    for (auto const r: content)
+    {
+        ofs.put(static_cast<char>(r >> 8));
+        ofs.put(static_cast<char>(r & 0xFF));
+    }
+
+    LOG_S(INFO) << "FILE RECORD DOWNLOAD completed, " << content.size()
+                << " registers into " << filename EOL;
+}
 
-            regs += modbus_regs_at_once;
-            buffer_offset += modbus_regs_at_once;
+int
+bus_scan(std::vector<std::string> const &devices,
+         std::vector<std::string> const &line_configs,
+         std::chrono::milliseconds probe_timeout,
+         bool verbose)
+{
+    LOG_S(INFO) << "SCAN of " << devices.size() << " buses, "
+                << line_configs.size() << " line configs, "
+                << probe_timeout.count() << " ms probe timeout" EOL;
+
+    std::vector<std::vector<scan_hit>> hits(devices.size());
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i != devices.size(); ++i)
+        workers.emplace_back(
+          [&, i]
+          {
+              hits[i] = scan_bus(
+                devices[i], line_configs, probe_timeout, verbose);
+          });
+    for (auto &worker: workers)
+        worker.join();
+
+    int found = 0;
+    for (auto const &bus_hits: hits)
+        for (auto const &hit: bus_hits)
+        {
+            ++found;
+            std::cout << hit.device << " " << hit.line_config << " "
+                      << hit.slave_id << " " << std::fixed
+                      << std::setprecision(1)
+                      << std::chrono::duration<double, std::milli>(
+                           hit.latency)
+                           .count()
+                      << "\n";
         }
+    std::cout.flush();
+
+    LOG_S(INFO) << "SCAN completed, " << found << " devices found" EOL;
+
+    return found;
+}
+
+} // namespace modbus
+
+namespace {
+struct fake_dump_state
+{
+    std::set<int> holes;
+    // Reads timing out before the device answers again
+    int flaky = 0;
+    // Error of every read once set
+    std::error_code error;
+};
 
-        LOG_S(INFO) << "FLASH remaining bytes @ 0x" << std::hex << flash_offset
-                    << ", REGBUFF @ 0x" << buffer_offset << std::dec << ",  "
-                    << remaining_regs * 2 << " bytes in " << remaining_regs
-                    << " registers" EOL;
+// Holds three times its address in each register, but for the holes, a
+// read covering any of them failing with an illegal data address exception
+class FakeDumpDevice: public modbus::slave_concept
+{
+    fake_dump_state &s_;
 
-        rtu_slave.write_multiple_registers(buffer_offset, regs, remaining_regs);
+public:
+    explicit FakeDumpDevice(fake_dump_state &s)
+      : slave_concept(1, "fake"), s_(s)
+    {}
+
+    std::error_code try_read_registers(modbus::regtype,
+                                       int address,
+                                       int num_regs,
+                                       uint16_t *dest) override
+    {
+        if (s_.flaky > 0)
+        {
+            --s_.flaky;
+            return modbus::errc::timeout;
+        }
+        if (s_.error)
+            return s_.error;
 
-        // Send the write_segment command
-        rtu_slave.write_holding_register(
-          static_cast<int>(flash_update_registers::cmd),
-          static_cast<uint16_t>(flash_update_commands::write_segment));
+        auto const hole = s_.holes.lower_bound(address);
+        if (hole != s_.holes.end() && *hole < address + num_regs)
+            return modbus::errc::illegal_data_address;
+
+        for (int i = 0; i != num_regs; ++i)
+            dest[i] = static_cast<uint16_t>((address + i) * 3);
+        return {};
     }
-    LOG_S(INFO) << "Sending total len " << total_len_bytes EOL;
-    rtu_slave.write_holding_register(
-      static_cast<int>(flash_update_registers::total_len_high),
-      total_len_bytes >> 16);
-    rtu_slave.write_holding_register(
-      static_cast<int>(flash_update_registers::total_len_low), total_len_bytes);
-
-    LOG_S(INFO) << "Sending crc32 " << std::hex << checksum << std::dec EOL;
-    rtu_slave.write_holding_register(
-      static_cast<int>(flash_update_registers::crc32_high), checksum >> 16);
-    rtu_slave.write_holding_register(
-      static_cast<int>(flash_update_registers::crc32_low), checksum);
-
-    LOG_S(INFO) << "Sending 'done' command" EOL;
-    rtu_slave.write_holding_register(
-      static_cast<int>(flash_update_registers::cmd),
-      static_cast<uint16_t>(flash_update_commands::done));
-
-    LOG_S(INFO) << "FLASH UPDATE completed" EOL;
+};
+} // namespace
+
+TEST_CASE("register dump bisects the ranges down to their holes")
+{
+    fake_dump_state device;
+    device.holes = {20};
+    modbus::slave s(modbus::slave::model_type<FakeDumpDevice>{}, device);
+
+    std::ostringstream csv;
+    modbus::dump_result_t result;
+    dump_range(s, modbus::regtype::holding, 0, 40, csv, result);
+
+    std::ostringstream expected;
+    for (int i = 0; i != 40; ++i)
+        if (i != 20)
+            expected << i << "," << i * 3 << "\n";
+    CHECK(csv.str() == expected.str());
+    CHECK(result.registers == 39);
+    // 0-39, 0-19, 20-39, 20-29, 20-24, 20 to 24 one at a time, 25-29, 30-39
+    CHECK(result.requests == 12);
+    CHECK(result.skipped.empty());
 }
 
-} // namespace modbus
\ No newline at end of file
+TEST_CASE("register dump retries, then skips the ranges that keep failing")
+{
+    fake_dump_state device;
+    modbus::slave s(modbus::slave::model_type<FakeDumpDevice>{}, device);
+
+    std::ostringstream csv;
+    modbus::dump_result_t result;
+
+    // Answers at the third attempt
+    device.flaky = 2;
+    dump_range(s, modbus::regtype::holding, 0, 10, csv, result);
+    CHECK(result.registers == 10);
+    CHECK(result.requests == 3);
+    CHECK(result.skipped.empty());
+
+    // Contiguous skipped ranges are merged
+    device.error = modbus::errc::timeout;
+    dump_range(s, modbus::regtype::holding, 10, 10, csv, result);
+    dump_range(s, modbus::regtype::holding, 20, 10, csv, result);
+    dump_range(s, modbus::regtype::holding, 40, 5, csv, result);
+    CHECK(result.requests == 12);
+
+    // Exception responses are not retried
+    device.error = modbus::errc::slave_device_failure;
+    dump_range(s, modbus::regtype::holding, 45, 5, csv, result);
+    CHECK(result.requests == 13);
+
+    CHECK(result.registers == 10);
+    auto const rows = csv.str();
+    CHECK(std::count(rows.begin(), rows.end(), '\n') == 10);
+    using range = std::pair<int, int>;
+    CHECK(result.skipped == std::vector<range>{{10, 29}, {40, 49}});
+}
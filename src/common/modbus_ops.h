@@ -1,17 +1,76 @@
 #pragma once
+#include "flash_session.h"
 #include "modbus_types.hpp"
 
+#include <chrono>
 #include <cstdint>
+#include <iosfwd>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace modbus {
+// Load a file as registers, 2 bytes each, high byte first, zero padded to a
+// multiple of 4 bytes, along with the CRC32 of the padded content
+std::vector<uint16_t>
+registers_from_file(std::string const &filename, uint32_t *maybe_crc = nullptr);
+
+// A register size specification, as single_read takes it: {1|2|4}{l|b} for
+// a value of that many registers, Nr for N raw registers
+struct regspec_t
+{
+    int regsize;
+    bool raw;
+    word_endianess endianess;
+};
+
+regspec_t
+parse_regspec(std::string const &regspec);
+
 void
 single_read(modbus::rtu_parameters const &rp,
             int address,
             std::string regspec,
             bool verbose);
 
+// Run a script of operations over a single connection to the serial line,
+// one per line, blank lines and '#' comments aside:
+//     R <slave id> <register> <regsize ={{1|2|4}{l|b} | Nr}>
+//     W <slave id> <register> <value [0..65535]>
+// Each operation gets a result line on out, flushed right away so that the
+// script can as well be typed in:
+//     <line number> OK <latency us> <value>...
+//     <line number> ERROR <latency us> <message>
+// rp's slave id is not used. Returns the number of failed operations
+int
+run_batch(modbus::rtu_parameters const &rp,
+          std::istream &script,
+          std::ostream &out,
+          bool verbose);
+
+// What a register dump found, and the [first, last] ranges it gave up on
+struct dump_result_t
+{
+    int registers = 0;
+    int requests  = 0;
+    std::vector<std::pair<int, int>> skipped;
+};
+
+// Dump the registers of [first, last] into a "register,value" CSV file, one
+// line per register the device has. The range is read in maximum size
+// requests, those rejected with an illegal data address exception being
+// bisected down to the registers which do exist. A request failing on the
+// transport is retried a couple of times before its range is skipped, as
+// are right away the ones getting any other exception. The file is written
+// as the dump goes, so that an interrupted dump keeps what it has found
+dump_result_t
+register_dump(modbus::rtu_parameters const &rp,
+              modbus::regtype type,
+              int first,
+              int last,
+              std::string const &filename,
+              bool verbose);
+
 void
 single_write(modbus::rtu_parameters const &rp,
              int address,
@@ -25,9 +84,67 @@ file_transfer(modbus::rtu_parameters const &rp,
               std::string filename,
               bool verbose);
 
+// Update a device with the image it requires. Given base_filename, the image
+// the device currently holds, only the flash lines which differ are sent
 void
 flash_update(modbus::rtu_parameters const &rp,
              std::string filename,
+             std::string const &base_filename,
+             flash_session::options_t const &options,
              bool verbose);
 
+// Update all the devices of a manifest, with one line per device:
+//     <serial device> <slave id> <image filename>
+// blank lines and '#' comments aside. rp's serial device and slave id are
+// not used. Each bus gets a thread of its own, the devices sharing a bus
+// being updated in turns, one flash line at a time. Returns the number of
+// devices which failed to update
+int
+flash_rollout(modbus::rtu_parameters const &rp,
+              std::string const &manifest,
+              flash_session::options_t const &options,
+              bool verbose);
+
+// Update all the listed devices of a line with the same image, broadcasting
+// it once, each frame followed by delay for the devices to process it. The
+// devices then report the CRC of what they have received, and those which
+// missed part of it get the whole image again. Returns the number of
+// devices which failed to update
+int
+flash_broadcast(modbus::rtu_parameters const &rp,
+                std::string const &filename,
+                std::vector<int> const &slave_ids,
+                std::chrono::milliseconds delay,
+                flash_session::options_t const &options,
+                bool verbose);
+
+// Look for the devices of the given serial lines, each one probed on a
+// thread of its own, over a single connection. Every unit id gets a read of
+// holding register 0, and any response within probe_timeout, even an
+// exception one, reveals a device. The line configs are tried in turn until
+// one gets responses. Prints a "<device> <line config> <slave id> <latency
+// ms>" line per device found and returns their number
+int
+bus_scan(std::vector<std::string> const &devices,
+         std::vector<std::string> const &line_configs,
+         std::chrono::milliseconds probe_timeout,
+         bool verbose);
+
+// Bulk transfers through file records (FC20/FC21), for the devices that
+// support them, at up to 244 bytes per frame. The registers span as many
+// files as needed, from record 0 of the given file onwards, each file
+// holding 10000 records
+void
+file_record_upload(modbus::rtu_parameters const &rp,
+                   int file,
+                   std::string filename,
+                   bool verbose);
+
+void
+file_record_download(modbus::rtu_parameters const &rp,
+                     int file,
+                     int num_regs,
+                     std::string filename,
+                     bool verbose);
+
 } // namespace modbus
\ No newline at end of file
@@ -0,0 +1,336 @@
+#pragma once
+#include "modbus_error.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <modbus.h>
+#include <system_error>
+
+// Encoding/decoding of modbus Protocol Data Units, for the transports that
+// don't go through libmodbus. All the buffers have a fixed size, so that
+// building or parsing a frame never allocates
+namespace modbus::pdu {
+
+enum class function : uint8_t
+{
+    read_coils               = 0x01,
+    read_discrete_inputs     = 0x02,
+    read_holding_registers   = 0x03,
+    read_input_registers     = 0x04,
+    write_single_register    = 0x06,
+    write_multiple_registers = 0x10,
+    read_file_record         = 0x14,
+    write_file_record        = 0x15,
+};
+
+uint8_t constexpr exception_flag = 0x80;
+
+// File records are addressed by file number, from 1, and record number, from
+// 0 to max_record_number, each record holding a register. A single
+// sub-request is issued per PDU, which can then carry the largest payload
+// the request and response data length bytes allow
+uint8_t constexpr file_record_reference  = 6;
+int constexpr max_record_number          = 9999;
+int constexpr max_read_file_record_regs  = 121;
+int constexpr max_write_file_record_regs = 122;
+
+struct buffer_t
+{
+    std::array<uint8_t, MODBUS_MAX_PDU_LENGTH> data;
+    size_t size = 0;
+
+    void push_u8(uint8_t v) { data[size++] = v; }
+    void push_u16(uint16_t v)
+    {
+        push_u8(v >> 8);
+        push_u8(v & 0xFF);
+    }
+};
+
+namespace detail {
+    constexpr std::array<uint16_t, 256> make_crc16_table()
+    {
+        std::array<uint16_t, 256> table{};
+        for (uint16_t i = 0; i != 256; ++i)
+        {
+            uint16_t c = i;
+            for (int j = 0; j != 8; ++j)
+                c = (c & 1) ? (c >> 1) ^ 0xA001 : c >> 1;
+            table[i] = c;
+        }
+        return table;
+    }
+
+    inline uint16_t get_u16(uint8_t const *p) { return (p[0] << 8) | p[1]; }
+} // namespace detail
+
+// CRC-16/MODBUS, to be appended to an RTU frame low byte first
+inline uint16_t
+crc16(uint8_t const *data, size_t len)
+{
+    static constexpr auto table = detail::make_crc16_table();
+
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i != len; ++i)
+        crc = (crc >> 8) ^ table[(crc ^ data[i]) & 0xFF];
+    return crc;
+}
+
+inline buffer_t
+read_registers_request(function fc, int address, int num_regs)
+{
+    buffer_t req;
+    req.push_u8(static_cast<uint8_t>(fc));
+    req.push_u16(address);
+    req.push_u16(num_regs);
+    return req;
+}
+
+inline buffer_t
+write_single_register_request(int address, uint16_t value)
+{
+    buffer_t req;
+    req.push_u8(static_cast<uint8_t>(function::write_single_register));
+    req.push_u16(address);
+    req.push_u16(value);
+    return req;
+}
+
+inline buffer_t
+write_multiple_registers_request(int address,
+                                 uint16_t const *regs,
+                                 int num_regs)
+{
+    buffer_t req;
+    req.push_u8(static_cast<uint8_t>(function::write_multiple_registers));
+    req.push_u16(address);
+    req.push_u16(num_regs);
+    req.push_u8(num_regs * 2);
+    for (int i = 0; i != num_regs; ++i)
+        req.push_u16(regs[i]);
+    return req;
+}
+
+inline buffer_t
+read_file_record_request(int file, int record, int num_regs)
+{
+    buffer_t req;
+    req.push_u8(static_cast<uint8_t>(function::read_file_record));
+    req.push_u8(7);
+    req.push_u8(file_record_reference);
+    req.push_u16(file);
+    req.push_u16(record);
+    req.push_u16(num_regs);
+    return req;
+}
+
+inline buffer_t
+write_file_record_request(int file,
+                          int record,
+                          uint16_t const *regs,
+                          int num_regs)
+{
+    buffer_t req;
+    req.push_u8(static_cast<uint8_t>(function::write_file_record));
+    req.push_u8(7 + num_regs * 2);
+    req.push_u8(file_record_reference);
+    req.push_u16(file);
+    req.push_u16(record);
+    req.push_u16(num_regs);
+    for (int i = 0; i != num_regs; ++i)
+        req.push_u16(regs[i]);
+    return req;
+}
+
+// Check that the response matches the requested function, translating an
+// exception response into the corresponding error
+inline std::error_code
+check_response(function fc, uint8_t const *pdu, size_t len)
+{
+    if (len < 2)
+        return errc::bad_frame;
+
+    if (pdu[0] == (static_cast<uint8_t>(fc) | exception_flag))
+        return static_cast<errc>(pdu[1]);
+
+    if (pdu[0] != static_cast<uint8_t>(fc))
+        return errc::bad_frame;
+
+    return {};
+}
+
+inline std::error_code
+parse_read_registers_response(function fc,
+                              uint8_t const *pdu,
+                              size_t len,
+                              uint16_t *dest,
+                              int num_regs)
+{
+    if (auto const ec = check_response(fc, pdu, len))
+        return ec;
+
+    auto const byte_count = static_cast<size_t>(num_regs) * 2;
+    if (pdu[1] != byte_count || len != 2 + byte_count)
+        return errc::bad_frame;
+
+    for (int i = 0; i != num_regs; ++i)
+        dest[i] = detail::get_u16(pdu + 2 + 2 * i);
+
+    return {};
+}
+
+// Coils and discrete inputs are kept packed as they come, i.e. bit i of the
+// request is dest[i / 8] >> (i % 8) & 1
+inline std::error_code
+parse_read_bits_response(function fc,
+                         uint8_t const *pdu,
+                         size_t len,
+                         uint8_t *dest,
+                         int num_bits)
+{
+    if (auto const ec = check_response(fc, pdu, len))
+        return ec;
+
+    auto const byte_count = static_cast<size_t>(num_bits + 7) / 8;
+    if (pdu[1] != byte_count || len != 2 + byte_count)
+        return errc::bad_frame;
+
+    std::copy_n(pdu + 2, byte_count, dest);
+
+    return {};
+}
+
+// The response to a single sub-request read: response data length, then
+// the sub-response's own length, reference type and records
+inline std::error_code
+parse_read_file_record_response(uint8_t const *pdu,
+                                size_t len,
+                                uint16_t *dest,
+                                int num_regs)
+{
+    if (auto const ec = check_response(function::read_file_record, pdu, len))
+        return ec;
+
+    auto const records_len = static_cast<size_t>(num_regs) * 2;
+    if (len != 4 + records_len || pdu[1] != 2 + records_len ||
+        pdu[2] != 1 + records_len || pdu[3] != file_record_reference)
+        return errc::bad_frame;
+
+    for (int i = 0; i != num_regs; ++i)
+        dest[i] = detail::get_u16(pdu + 4 + 2 * i);
+
+    return {};
+}
+
+// A write file record response echoes the request
+inline std::error_code
+parse_write_file_record_response(buffer_t const &request,
+                                 uint8_t const *pdu,
+                                 size_t len)
+{
+    if (auto const ec = check_response(function::write_file_record, pdu, len))
+        return ec;
+
+    if (len != request.size || !std::equal(pdu, pdu + len, request.data.data()))
+        return errc::bad_frame;
+
+    return {};
+}
+
+inline std::error_code
+parse_write_response(function fc, uint8_t const *pdu, size_t len)
+{
+    if (auto const ec = check_response(fc, pdu, len))
+        return ec;
+
+    // Both write single and write multiple echo address and value/quantity
+    return len == 5 ? std::error_code{} : make_error_code(errc::bad_frame);
+}
+
+// Total length of an RTU response frame (slave address and CRC included) as
+// soon as enough of its header has been received, 0 if still unknown
+inline size_t
+rtu_response_length(uint8_t const *adu, size_t len)
+{
+    if (len < 2)
+        return 0;
+
+    auto const fc = adu[1];
+    if (fc & exception_flag)
+        return 5;
+
+    switch (static_cast<function>(fc))
+    {
+    case function::read_coils:
+    case function::read_discrete_inputs:
+    case function::read_holding_registers:
+    case function::read_input_registers:
+    case function::read_file_record:
+    case function::write_file_record:
+        return len < 3 ? 0 : 5 + adu[2];
+    case function::write_single_register:
+    case function::write_multiple_registers:
+        return 8;
+    }
+
+    return 0;
+}
+} // namespace modbus::pdu
+
+#if defined(DOCTEST_LIBRARY_INCLUDED)
+TEST_CASE("modbus CRC16 and PDU encoding")
+{
+    auto const req = modbus::pdu::read_registers_request(
+      modbus::pdu::function::read_holding_registers, 0, 10);
+
+    uint8_t adu[8] = {0x01};
+    std::copy(req.data.begin(), req.data.begin() + req.size, adu + 1);
+    REQUIRE(req.size == 5);
+
+    // Reference frame from the MODBUS over serial line specification
+    CHECK(modbus::pdu::crc16(adu, 6) == 0xCDC5);
+
+    uint8_t const rsp[] = {0x03, 0x04, 0x12, 0x34, 0xAB, 0xCD};
+    uint16_t regs[2]{};
+    CHECK(!modbus::pdu::parse_read_registers_response(
+      modbus::pdu::function::read_holding_registers, rsp, 6, regs, 2));
+    CHECK(regs[0] == 0x1234);
+    CHECK(regs[1] == 0xABCD);
+
+    // 10 coils, 0 and 9 set
+    uint8_t const coils_rsp[] = {0x01, 0x02, 0x01, 0x02};
+    uint8_t coils[2]{};
+    CHECK(!modbus::pdu::parse_read_bits_response(
+      modbus::pdu::function::read_coils, coils_rsp, 4, coils, 10));
+    CHECK(coils[0] == 0x01);
+    CHECK(coils[1] == 0x02);
+
+    // Records 2 and 3 of file 4
+    auto const frreq = modbus::pdu::read_file_record_request(4, 2, 2);
+    uint8_t const frreq_ref[] = {0x14, 0x07, 0x06, 0x00, 0x04, 0x00, 0x02,
+                                 0x00, 0x02};
+    REQUIRE(frreq.size == sizeof frreq_ref);
+    CHECK(std::equal(frreq_ref, frreq_ref + frreq.size, frreq.data.data()));
+
+    uint8_t const frrsp[] = {0x14, 0x06, 0x05, 0x06, 0x0D, 0xFE, 0x00, 0x20};
+    CHECK(!modbus::pdu::parse_read_file_record_response(frrsp, 8, regs, 2));
+    CHECK(regs[0] == 0x0DFE);
+    CHECK(regs[1] == 0x0020);
+
+    auto const fwreq = modbus::pdu::write_file_record_request(4, 7, regs, 2);
+    CHECK(fwreq.size == 13);
+    CHECK(fwreq.data[1] == 11);
+    CHECK(!modbus::pdu::parse_write_file_record_response(
+      fwreq, fwreq.data.data(), fwreq.size));
+    CHECK(modbus::pdu::parse_write_file_record_response(
+            fwreq, fwreq.data.data(), fwreq.size - 1) ==
+          modbus::errc::bad_frame);
+
+    uint8_t const exc[] = {0x83, 0x02};
+    CHECK(modbus::pdu::parse_read_registers_response(
+            modbus::pdu::function::read_holding_registers, exc, 2, regs, 2) ==
+          modbus::errc::illegal_data_address);
+}
+#endif
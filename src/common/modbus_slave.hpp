@@ -1,94 +1,107 @@
 #pragma once
+#include "latency_tracker.hpp"
+#include "modbus_decode.hpp"
+#include "modbus_error.hpp"
+#include "modbus_pdu.hpp"
 #include "modbus_types.hpp"
+#include "register_cache.hpp"
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <map>
 #include <memory>
 #include <modbus.h>
+#include <mutex>
+#include <poll.h>
 #include <random>
 #include <sstream>
 #include <string>
+#include <system_error>
+#include <thread>
 #include <type_traits>
+#include <unistd.h>
 #include <vector>
 
 namespace modbus {
 namespace detail {
-    struct word_be_tag
-    {};
-    struct word_le_tag
-    {};
-
     inline bool regsize_supported(int regsize)
     {
         return regsize == 1 || regsize == 2 || regsize == 4;
     }
 
-    // Always return signed type, it's up to the consumer to convert
-    // to unsigned if desired, and that is a well defined conversion
-    inline intmax_t to_val(uint16_t const *regs, int regsize, word_le_tag)
+    // One bit per byte, as libmodbus returns them, to packed bits, LSB first
+    inline void pack_bits(uint8_t const *bits, int num_bits, uint8_t *dest)
     {
-        // Byte-level is big-endian as per modbus spec, and it is handled by
-        // libmodbus. Here we handle word/register-level endianness, in this
-        // case little: LSW->MSW
-        intmax_t val;
-        switch (regsize)
-        {
-            // NOTE: force conversion to signed counterpart (i.e. intxx_t)
-            // before assigning to the wider intmax_t type, to ensure sign
-            // extension is performed
-        case 1: {
-            val = static_cast<int16_t>(regs[0]);
-        }
-        break;
-        case 2: {
-            val = static_cast<int32_t>(regs[1]) << 16 | regs[0];
-        }
-        break;
-        case 4: {
-            val = static_cast<int64_t>(regs[3]) << 48 |
-                  static_cast<int64_t>(regs[2]) << 32 |
-                  static_cast<int64_t>(regs[1]) << 16 | regs[0];
-        }
-        break;
-        default:
-            assert(!"regsize not supported");
-        }
-
-        return val;
+        std::fill_n(dest, (num_bits + 7) / 8, 0);
+        for (int i = 0; i != num_bits; ++i)
+            dest[i / 8] |= (bits[i] ? 1 : 0) << (i % 8);
     }
 
-    inline intmax_t to_val(uint16_t const *regs, int regsize, word_be_tag)
+    // Always return signed type, it's up to the consumer to convert
+    // to unsigned if desired, and that is a well defined conversion.
+    // Decoding to the signed counterpart (i.e. intxx_t) before widening to
+    // intmax_t ensures that sign extension is performed
+    template <word_endianess E>
+    intmax_t to_val(uint16_t const *regs, int regsize)
     {
-        // Byte-level is big-endian as per modbus spec, and it is handled by
-        // libmodbus. Here we handle word/register-level endianness, in this
-        // case big: MSW->LSW
-        intmax_t val;
         switch (regsize)
         {
-            // NOTE: force conversion to signed counterpart before
-            // assigning to the wider type, to ensure sign extension is
-            // performed
         case 1:
-            val = static_cast<int16_t>(regs[0]);
-            break;
+            return decode<int16_t, E>(regs);
         case 2:
-            val = static_cast<int32_t>(regs[0]) << 16 | regs[1];
-            break;
+            return decode<int32_t, E>(regs);
         case 4:
-            val = static_cast<int64_t>(regs[0]) << 48 |
-                  static_cast<int64_t>(regs[1]) << 32 |
-                  static_cast<int64_t>(regs[2]) << 16 | regs[3];
-            break;
+            return decode<int64_t, E>(regs);
         default:
             assert(!"regsize not supported");
         }
+        __builtin_unreachable();
+    }
 
-        return val;
+    inline intmax_t to_val(uint16_t const *regs,
+                           int regsize,
+                           word_endianess endianess)
+    {
+        return endianess == word_endianess::little
+                 ? to_val<word_endianess::little>(regs, regsize)
+                 : to_val<word_endianess::big>(regs, regsize);
     }
 
 } // namespace detail
 
+// Translate the errno left by a failed libmodbus call
+inline std::error_code
+libmodbus_error(int errnum) noexcept
+{
+    if (errnum > MODBUS_ENOBASE && errnum <= EMBXGTAR)
+        return static_cast<errc>(errnum - MODBUS_ENOBASE);
+
+    switch (errnum)
+    {
+    case 0: // Short response, without an errno
+    case EMBBADDATA:
+    case EMBBADEXC:
+    case EMBUNKEXC:
+    case EMBMDATA:
+        return errc::bad_frame;
+    case EMBBADCRC:
+        return errc::bad_crc;
+#if defined(EMBBADSLAVE)
+    case EMBBADSLAVE:
+        return errc::bad_slave;
+#endif
+    case ETIMEDOUT:
+        return errc::timeout;
+    }
+
+    return {errnum, std::generic_category()};
+}
+
 class slave_concept
 {
     slave_id_t id_;
@@ -104,18 +117,106 @@ public:
 
     virtual ~slave_concept() = default;
 
-    virtual intmax_t read_input_registers(int address,
-                                          int regsize,
-                                          word_endianess endianess)  = 0;
-    virtual std::vector<uint16_t> read_input_registers(int address,
-                                                       int num_regs) = 0;
+    // Read num_regs registers into the caller provided dest buffer, without
+    // throwing nor allocating: a failure, be it on the transport or an
+    // exception response, is reported as an error code. This is the only
+    // read models need to implement, all the others being built on top
+    virtual std::error_code try_read_registers(regtype type,
+                                               int address,
+                                               int num_regs,
+                                               uint16_t *dest) = 0;
+
+    // Read num_bits coils or discrete inputs into dest, packed as they are
+    // on the wire: bit i is dest[i / 8] >> (i % 8) & 1, so that dest must
+    // hold (num_bits + 7) / 8 bytes. Models not supporting bits report
+    // operation_not_supported
+    virtual std::error_code try_read_bits(regtype /*type*/,
+                                          int /*address*/,
+                                          int /*num_bits*/,
+                                          uint8_t * /*dest*/)
+    {
+        return std::make_error_code(std::errc::operation_not_supported);
+    }
+
+    // Read num_regs records of a file, from record onwards, with a single
+    // Read File Record (FC20) sub-request, see pdu::read_file_record_request.
+    // Models not supporting file records report operation_not_supported
+    virtual std::error_code try_read_file_record(int /*file*/,
+                                                 int /*record*/,
+                                                 int /*num_regs*/,
+                                                 uint16_t * /*dest*/)
+    {
+        return std::make_error_code(std::errc::operation_not_supported);
+    }
 
+    // Same as above, with a Write File Record (FC21) sub-request
+    virtual std::error_code try_write_file_record(int /*file*/,
+                                                  int /*record*/,
+                                                  uint16_t const * /*regs*/,
+                                                  int /*num_regs*/)
+    {
+        return std::make_error_code(std::errc::operation_not_supported);
+    }
 
-    virtual intmax_t read_holding_registers(int address,
+    // Read a single, possibly multi-register, value, or a single bit
+    virtual result<intmax_t> try_read_value(regtype type,
+                                            int address,
                                             int regsize,
-                                            word_endianess endianess)  = 0;
-    virtual std::vector<uint16_t> read_holding_registers(int address,
-                                                         int num_regs) = 0;
+                                            word_endianess endianess)
+    {
+        if (is_bit(type))
+        {
+            uint8_t bit = 0;
+            if (auto const ec = try_read_bits(type, address, 1, &bit))
+                return ec;
+            return bit & 1;
+        }
+
+        if (!detail::regsize_supported(regsize))
+            return std::make_error_code(std::errc::invalid_argument);
+
+        uint16_t regs[4]{};
+        if (auto const ec = try_read_registers(type, address, regsize, regs))
+            return ec;
+
+        return detail::to_val(regs, regsize, endianess);
+    }
+
+    // Throwing reads, for the one-shot operations
+
+    void read_input_registers(int address, int num_regs, uint16_t *dest)
+    {
+        read_registers(regtype::input, address, num_regs, dest);
+    }
+    std::vector<uint16_t> read_input_registers(int address, int num_regs)
+    {
+        std::vector<uint16_t> registers(num_regs);
+        read_registers(regtype::input, address, num_regs, registers.data());
+        return registers;
+    }
+    intmax_t read_input_registers(int address,
+                                  int regsize,
+                                  word_endianess endianess)
+    {
+        return read_value(regtype::input, address, regsize, endianess);
+    }
+
+    void read_holding_registers(int address, int num_regs, uint16_t *dest)
+    {
+        read_registers(regtype::holding, address, num_regs, dest);
+    }
+    std::vector<uint16_t> read_holding_registers(int address, int num_regs)
+    {
+        std::vector<uint16_t> registers(num_regs);
+        read_registers(regtype::holding, address, num_regs, registers.data());
+        return registers;
+    }
+    intmax_t read_holding_registers(int address,
+                                    int regsize,
+                                    word_endianess endianess)
+    {
+        return read_value(regtype::holding, address, regsize, endianess);
+    }
 
     // Non-pure, as we don't require these to be implemented
     virtual void write_holding_register(int address, uint16_t value) {}
@@ -129,11 +230,105 @@ public:
                                           uint16_t const *regs,
                                           int num_regs)
     {}
+
+    // On success, regs points to num_regs registers, valid only for the
+    // duration of the handler invocation
+    using read_handler_t =
+      std::function<void(std::error_code const &ec, uint16_t const *regs)>;
+
+    // The handler is taken by reference, and must outlive the operation, so
+    // that a long lived handler can be reused without any allocation.
+    // Models that can't perform the read asynchronously just do it
+    // synchronously and invoke the handler before returning
+    virtual void async_read_registers(regtype type,
+                                      int address,
+                                      int num_regs,
+                                      read_handler_t const &handler)
+    {
+        if (num_regs > MODBUS_MAX_READ_REGISTERS)
+        {
+            handler(std::make_error_code(std::errc::invalid_argument),
+                    nullptr);
+            return;
+        }
+
+        uint16_t registers[MODBUS_MAX_READ_REGISTERS];
+        auto const ec = try_read_registers(type, address, num_regs, registers);
+        handler(ec, ec ? nullptr : registers);
+    }
+
+    // On success, bits points to num_bits packed bits, see try_read_bits
+    using bits_handler_t =
+      std::function<void(std::error_code const &ec, uint8_t const *bits)>;
+
+    // Same as async_read_registers, for coils and discrete inputs
+    virtual void async_read_bits(regtype type,
+                                 int address,
+                                 int num_bits,
+                                 bits_handler_t const &handler)
+    {
+        if (num_bits > MODBUS_MAX_READ_BITS)
+        {
+            handler(std::make_error_code(std::errc::invalid_argument),
+                    nullptr);
+            return;
+        }
+
+        uint8_t bits[(MODBUS_MAX_READ_BITS + 7) / 8];
+        auto const ec = try_read_bits(type, address, num_bits, bits);
+        handler(ec, ec ? nullptr : bits);
+    }
+
+    using write_handler_t = std::function<void(std::error_code const &ec)>;
+
+    // Same as async_read_registers, for a single holding register write.
+    // Models without a non-throwing write go through write_holding_register
+    virtual void async_write_holding_register(int address,
+                                              uint16_t value,
+                                              write_handler_t const &handler)
+    {
+        std::error_code ec;
+        try
+        {
+            write_holding_register(address, value);
+        }
+        catch (std::system_error const &e)
+        {
+            ec = e.code();
+        }
+        handler(ec);
+    }
+
+private:
+    void read_registers(regtype type, int address, int num_regs, uint16_t *dest)
+    {
+        if (auto const ec = try_read_registers(type, address, num_regs, dest))
+            throw std::system_error(ec,
+                                    type == regtype::holding
+                                      ? "Failed read_holding_registers"
+                                      : "Failed read_input_registers");
+    }
+
+    intmax_t read_value(regtype type,
+                        int address,
+                        int regsize,
+                        word_endianess endianess)
+    {
+        if (!detail::regsize_supported(regsize))
+            throw std::invalid_argument("Invalid regsize: " +
+                                        std::to_string(regsize));
+
+        return try_read_value(type, address, regsize, endianess)
+          .value(type == regtype::holding ? "Failed read_holding_registers"
+                                          : "Failed read_input_registers");
+    }
 };
 
 class slave
 {
     std::unique_ptr<slave_concept> c;
+    std::shared_ptr<register_cache> cache_ =
+      std::make_shared<register_cache>();
 
 public:
     template <class T>
@@ -148,6 +343,15 @@ public:
     [[nodiscard]] slave_id_t id() const noexcept { return c->id(); }
     [[nodiscard]] std::string const &name() const noexcept { return c->name(); }
 
+    // Filled and looked up by the users of the slave, for the registers
+    // they don't need to read every time. Writes through the slave
+    // invalidate it
+    [[nodiscard]] register_cache &cache() noexcept { return *cache_; }
+
+    // Use the cache of other, a slave for the same device, so that the
+    // writes through either one invalidate what the other one has cached
+    void share_cache(slave const &other) { cache_ = other.cache_; }
+
     intmax_t read_input_registers(int address,
                                   int regsize,
                                   word_endianess endianess)
@@ -158,6 +362,10 @@ public:
     {
         return c->read_input_registers(address, num_regs);
     }
+    void read_input_registers(int address, int num_regs, uint16_t *dest)
+    {
+        c->read_input_registers(address, num_regs, dest);
+    }
 
 
     intmax_t read_holding_registers(int address,
@@ -170,15 +378,22 @@ public:
     {
         return c->read_holding_registers(address, num_regs);
     }
+    void read_holding_registers(int address, int num_regs, uint16_t *dest)
+    {
+        c->read_holding_registers(address, num_regs, dest);
+    }
 
     void write_holding_register(int address, uint16_t value)
     {
+        cache_->invalidate(regtype::holding, address, 1);
         c->write_holding_register(address, value);
     }
 
     void write_multiple_registers(int address,
                                   std::vector<uint16_t> const &registers)
     {
+        cache_->invalidate(
+          regtype::holding, address, static_cast<int>(registers.size()));
         c->write_multiple_registers(address, registers);
     }
 
@@ -186,8 +401,74 @@ public:
                                   uint16_t const *regs,
                                   int num_regs)
     {
+        cache_->invalidate(regtype::holding, address, num_regs);
         c->write_multiple_registers(address, regs, num_regs);
     }
+
+    std::error_code try_read_registers(regtype type,
+                                       int address,
+                                       int num_regs,
+                                       uint16_t *dest)
+    {
+        return c->try_read_registers(type, address, num_regs, dest);
+    }
+
+    std::error_code try_read_bits(regtype type,
+                                  int address,
+                                  int num_bits,
+                                  uint8_t *dest)
+    {
+        return c->try_read_bits(type, address, num_bits, dest);
+    }
+
+    result<intmax_t> try_read_value(regtype type,
+                                    int address,
+                                    int regsize,
+                                    word_endianess endianess)
+    {
+        return c->try_read_value(type, address, regsize, endianess);
+    }
+
+    std::error_code try_read_file_record(int file,
+                                         int record,
+                                         int num_regs,
+                                         uint16_t *dest)
+    {
+        return c->try_read_file_record(file, record, num_regs, dest);
+    }
+
+    std::error_code try_write_file_record(int file,
+                                          int record,
+                                          uint16_t const *regs,
+                                          int num_regs)
+    {
+        return c->try_write_file_record(file, record, regs, num_regs);
+    }
+
+    void async_read_registers(regtype type,
+                              int address,
+                              int num_regs,
+                              slave_concept::read_handler_t const &handler)
+    {
+        c->async_read_registers(type, address, num_regs, handler);
+    }
+
+    void async_read_bits(regtype type,
+                         int address,
+                         int num_bits,
+                         slave_concept::bits_handler_t const &handler)
+    {
+        c->async_read_bits(type, address, num_bits, handler);
+    }
+
+    void
+    async_write_holding_register(int address,
+                                 uint16_t value,
+                                 slave_concept::write_handler_t const &handler)
+    {
+        cache_->invalidate(regtype::holding, address, 1);
+        c->async_write_holding_register(address, value, handler);
+    }
 };
 
 class RandomSlave: public slave_concept
@@ -203,6 +484,7 @@ public:
     public:
         random_source(T mean, T stdev) : d(mean, stdev), engine(r()) {}
         T operator()() { return d(engine); }
+        T mean() const { return d.mean(); }
     };
     class random_params
     {
@@ -248,49 +530,124 @@ public:
               fr.first, fr.second.mean_, fr.second.stdev_);
     }
 
-    intmax_t read_input_registers(int address, int, word_endianess) override
+    result<intmax_t> try_read_value(regtype type,
+                                    int address,
+                                    int,
+                                    word_endianess) override
     {
         auto where = fake_registers_.find(address);
         if (where == std::end(fake_registers_))
-            throw std::runtime_error(
-              "no random source configured for address " +
-              std::to_string(address));
-        return where->second();
+            return errc::illegal_data_address;
+        auto const value = where->second();
+        // Bits are set when above the mean, i.e. half of the time
+        if (is_bit(type))
+            return value >= where->second.mean() ? 1 : 0;
+        return static_cast<intmax_t>(value);
+    }
+
+    // Each register holds a value of its own, whatever the register type
+    std::error_code try_read_registers(regtype,
+                                       int address,
+                                       int num_regs,
+                                       uint16_t *dest) override
+    {
+        for (auto i = 0; i != num_regs; ++i)
+        {
+            auto where = fake_registers_.find(address + i);
+            if (where == std::end(fake_registers_))
+                return errc::illegal_data_address;
+            dest[i] = static_cast<uint16_t>(where->second());
+        }
+
+        return {};
     }
-    std::vector<uint16_t> read_input_registers(int address,
-                                               int num_regs) override
+
+    std::error_code try_read_bits(regtype type,
+                                  int address,
+                                  int num_bits,
+                                  uint8_t *dest) override
     {
-        std::vector<uint16_t> res;
-        res.reserve(num_regs);
+        std::fill_n(dest, (num_bits + 7) / 8, 0);
+        for (auto i = 0; i != num_bits; ++i)
+        {
+            auto const bit = try_read_value(type, address + i, 1, {});
+            if (!bit)
+                return bit.error();
+            dest[i / 8] |= *bit << (i % 8);
+        }
 
-        auto const regsize_dontcare        = 0;
-        auto const word_endianess_dontcare = word_endianess::little;
+        return {};
+    }
+};
 
-        for (auto i = 0; i != num_regs; ++i)
+class serial_line
+{
+    friend class RTUBus;
+    std::string device_;
+    int bps_;
+    int data_bits_;
+    char parity_;
+    int stop_bits_;
+
+    static auto unpack_line_config(std::istringstream iss)
+    {
+        std::vector<std::string> parts;
+        std::string elem;
+        while (std::getline(iss, elem, ':'))
         {
-            res.push_back(read_input_registers(
-              address + i, regsize_dontcare, word_endianess_dontcare));
+            parts.push_back(elem);
         }
 
-        return res;
+        if (parts.size() != 4)
+            throw std::invalid_argument("Invalid line config: " + iss.str());
+
+        return std::tuple<int, int, char, int>{std::stoi(parts[0]),
+                                               std::stoi(parts[1]),
+                                               parts[2][0],
+                                               std::stoi(parts[3])};
     }
 
-    intmax_t read_holding_registers(int address, int, word_endianess) override
+public:
+    serial_line(std::string device, std::string const &line_config)
+      : device_(std::move(device))
     {
-        int const regsize_dontcare         = 0;
-        auto const word_endianess_dontcare = word_endianess::little;
+        std::tie(bps_, data_bits_, parity_, stop_bits_) =
+          unpack_line_config(std::istringstream(line_config));
+    }
 
-        return read_input_registers(
-          address, regsize_dontcare, word_endianess_dontcare);
+    [[nodiscard]] std::string const &device() const noexcept
+    {
+        return device_;
+    }
+    [[nodiscard]] int bps() const noexcept { return bps_; }
+    [[nodiscard]] int data_bits() const noexcept { return data_bits_; }
+    [[nodiscard]] char parity() const noexcept { return parity_; }
+    [[nodiscard]] int stop_bits() const noexcept { return stop_bits_; }
+
+    friend bool operator==(serial_line const &lhs, serial_line const &rhs)
+    {
+        return std::tie(lhs.device_,
+                        lhs.bps_,
+                        lhs.data_bits_,
+                        lhs.parity_,
+                        lhs.stop_bits_) == std::tie(rhs.device_,
+                                                    rhs.bps_,
+                                                    rhs.data_bits_,
+                                                    rhs.parity_,
+                                                    rhs.stop_bits_);
     }
-    std::vector<uint16_t> read_holding_registers(int address,
-                                                 int num_regs) override
+    friend bool operator!=(serial_line const &lhs, serial_line const &rhs)
     {
-        return read_input_registers(address, num_regs);
+        return !(lhs == rhs);
     }
 };
 
-class RTUSlave: public slave_concept
+// A physical serial line, shared by all the slaves daisy-chained on it.
+// Owns the only libmodbus context for the device, and serializes all the
+// transactions in FIFO order, so that requests for different slaves can't
+// interleave on the wire even when issued from different threads. Priority
+// transactions, e.g. an operator's, go ahead of all the others waiting
+class RTUBus
 {
     struct ctx_deleter
     {
@@ -301,177 +658,408 @@ class RTUSlave: public slave_concept
         }
     };
 
-    std::unique_ptr<modbus_t, ctx_deleter> modbus_source_;
-
-public:
-    class serial_line
+    // Holding a turn grants exclusive use of the bus. Turns are handed out
+    // as tickets and served strictly in order of arrival, the priority ones
+    // before any regular one
+    class turn
     {
-        friend class RTUSlave;
-        std::string device_;
-        int bps_;
-        int data_bits_;
-        char parity_;
-        int stop_bits_;
+        RTUBus &bus_;
+        bool const priority_;
 
-        static auto unpack_line_config(std::istringstream iss)
+    public:
+        explicit turn(RTUBus &bus, bool priority = false)
+          : bus_(bus), priority_(priority)
         {
-            std::vector<std::string> parts;
-            std::string elem;
-            while (std::getline(iss, elem, ':'))
+            std::unique_lock<std::mutex> lk(bus_.queue_mutex_);
+            if (priority_)
             {
-                parts.push_back(elem);
+                auto const ticket = bus_.next_priority_ticket_++;
+                bus_.queue_cv_.wait(
+                  lk,
+                  [&]
+                  { return !bus_.busy_ && bus_.priority_serving_ == ticket; });
             }
-
-            if (parts.size() != 4)
-                throw std::invalid_argument("Invalid line config: " +
-                                            iss.str());
-
-            return std::tuple<int, int, char, int>{std::stoi(parts[0]),
-                                                   std::stoi(parts[1]),
-                                                   parts[2][0],
-                                                   std::stoi(parts[3])};
+            else
+            {
+                auto const ticket = bus_.next_ticket_++;
+                bus_.queue_cv_.wait(
+                  lk,
+                  [&]
+                  {
+                      return !bus_.busy_ &&
+                             bus_.priority_serving_ ==
+                               bus_.next_priority_ticket_ &&
+                             bus_.now_serving_ == ticket;
+                  });
+            }
+            bus_.busy_ = true;
         }
 
-    public:
-        serial_line(std::string device, std::string const &line_config)
-          : device_(std::move(device))
+        turn(turn const &) = delete;
+        turn &operator=(turn const &) = delete;
+
+        ~turn()
         {
-            std::tie(bps_, data_bits_, parity_, stop_bits_) =
-              unpack_line_config(std::istringstream(line_config));
+            // Don't let the queue bookkeeping clobber the errno of the
+            // transaction that has just been performed
+            int const saved_errno = errno;
+            {
+                std::lock_guard<std::mutex> lk(bus_.queue_mutex_);
+                ++(priority_ ? bus_.priority_serving_ : bus_.now_serving_);
+                bus_.busy_ = false;
+            }
+            bus_.queue_cv_.notify_all();
+            errno = saved_errno;
         }
     };
 
-    RTUSlave(slave_id_t server_id,
-             std::string server_name,
-             serial_line const &serial_line,
-             std::chrono::milliseconds const &answering_time,
-             bool verbose = false)
-      : slave_concept(server_id, std::move(server_name))
+    serial_line line_;
+    std::unique_ptr<modbus_t, ctx_deleter> ctx_;
+
+    std::mutex queue_mutex_;
+    std::condition_variable queue_cv_;
+    unsigned long next_ticket_          = 0;
+    unsigned long now_serving_          = 0;
+    unsigned long next_priority_ticket_ = 0;
+    unsigned long priority_serving_     = 0;
+    bool busy_                          = false;
+
+public:
+    RTUBus(serial_line line, bool verbose = false) : line_(std::move(line))
     {
-        modbus_source_.reset(modbus_new_rtu(serial_line.device_.c_str(),
-                                            serial_line.bps_,
-                                            serial_line.parity_,
-                                            serial_line.data_bits_,
-                                            serial_line.stop_bits_));
+        ctx_.reset(modbus_new_rtu(line_.device_.c_str(),
+                                  line_.bps_,
+                                  line_.parity_,
+                                  line_.data_bits_,
+                                  line_.stop_bits_));
 
-        if (!modbus_source_)
+        if (!ctx_)
             throw std::runtime_error("Failed creating ctx for device " +
-                                     serial_line.device_);
+                                     line_.device_);
 
         int api_rv;
         if (verbose)
-            api_rv = modbus_set_debug(modbus_source_.get(), TRUE);
+            api_rv = modbus_set_debug(ctx_.get(), TRUE);
 
         api_rv = modbus_set_error_recovery(
-          modbus_source_.get(),
+          ctx_.get(),
           static_cast<modbus_error_recovery_mode>(
             MODBUS_ERROR_RECOVERY_LINK | MODBUS_ERROR_RECOVERY_PROTOCOL));
 
-        auto seconds =
+        if (modbus_connect(ctx_.get()) < 0)
+            throw std::runtime_error(std::string("Failed modbus_connect: ") +
+                                     modbus_strerror(errno));
+    }
+
+    RTUBus(RTUBus const &) = delete;
+    RTUBus &operator=(RTUBus const &) = delete;
+
+    [[nodiscard]] serial_line const &line() const noexcept { return line_; }
+
+    // Wait for our turn on the bus, address the given slave and run f(ctx),
+    // with the timeout suggested by, and reporting the response time to, the
+    // slave's latency tracker. The errno set by the libmodbus call(s) in f is
+    // preserved. A priority transaction only waits for the one in progress
+    // and the priority ones before it
+    template <class F>
+    auto transact(slave_id_t slave_id,
+                  latency_tracker &timeouts,
+                  F &&f,
+                  bool priority = false)
+    {
+        turn const t(*this, priority);
+
+        auto const answering_time = timeouts.timeout();
+        auto const seconds =
           std::chrono::duration_cast<std::chrono::seconds>(answering_time);
-        auto microseconds = std::chrono::microseconds(answering_time - seconds);
+        auto const microseconds =
+          std::chrono::microseconds(answering_time - seconds);
 
         modbus_set_response_timeout(
-          modbus_source_.get(), seconds.count(), microseconds.count());
-        modbus_set_slave(modbus_source_.get(), server_id);
+          ctx_.get(), seconds.count(), microseconds.count());
+        modbus_set_slave(ctx_.get(), slave_id);
 
-        if (modbus_connect(modbus_source_.get()) < 0)
-            throw std::runtime_error(std::string("Failed modbus_connect: ") +
-                                     modbus_strerror(errno));
+        auto const start = std::chrono::steady_clock::now();
+        auto const rv    = f(ctx_.get());
+
+        // An exception response is still a response
+        if (rv >= 0 || (errno >= EMBXILFUN && errno <= EMBXGTAR))
+            timeouts.on_response(std::chrono::steady_clock::now() - start);
+        else if (errno == ETIMEDOUT)
+            timeouts.on_timeout();
+
+        return rv;
     }
 
-    intmax_t read_input_registers(int address,
-                                  int regsize,
-                                  word_endianess endianess) override
+    // Send a request to all the slaves of the line at once. None of them
+    // replies, so the turn is held until the frame is out on the wire, plus
+    // the given delay for the slaves to process it
+    std::error_code broadcast(pdu::buffer_t const &request,
+                              std::chrono::microseconds delay)
     {
-        if (!detail::regsize_supported(regsize))
-            throw std::invalid_argument("Invalid regsize: " +
-                                        std::to_string(regsize));
-
-        uint16_t regs[4]{};
-        int api_rv =
-          modbus_read_input_registers(modbus_source_.get(),
-                                      address,
-                                      regsize,
-                                      regs); // Input register: Code 0x04
+        turn const t(*this);
+
+        uint8_t raw[1 + MODBUS_MAX_PDU_LENGTH];
+        raw[0] = MODBUS_BROADCAST_ADDRESS;
+        std::copy_n(request.data.data(), request.size, raw + 1);
+
+        if (modbus_send_raw_request(
+              ctx_.get(), raw, static_cast<int>(request.size + 1)) < 0)
+            return libmodbus_error(errno);
+
+        // Start, data, parity and stop bits of the slave address, PDU and
+        // CRC, which may still be queued in the driver
+        auto const char_bits =
+          1 + line_.data_bits_ + (line_.parity_ != 'N') + line_.stop_bits_;
+        auto const frame_bits = (request.size + 3) * char_bits;
+        std::this_thread::sleep_for(
+          std::chrono::microseconds(frame_bits * 1000000 / line_.bps_) +
+          delay);
+
+        return {};
+    }
+};
 
-        if (api_rv != regsize)
-            throw std::runtime_error(
-              std::string("Failed modbus_read_input_registers: ") +
-              modbus_strerror(errno));
+class RTUSlave: public slave_concept
+{
+    std::shared_ptr<RTUBus> bus_;
+    latency_tracker timeouts_;
+    bool priority_;
 
-        return endianess == word_endianess::little
-                 ? to_val(regs, regsize, detail::word_le_tag{})
-                 : to_val(regs, regsize, detail::word_be_tag{});
+    template <class F>
+    int transact(F &&f)
+    {
+        return bus_->transact(id(), timeouts_, std::forward<F>(f), priority_);
     }
 
-    intmax_t read_holding_registers(int address,
-                                    int regsize,
-                                    word_endianess endianess) override
+    // Read a response frame off the line, within the response timeout, and
+    // check its CRC. Returns the frame length, or -1 with errno set the way
+    // libmodbus would
+    static int receive_frame(modbus_t *ctx, uint8_t *adu)
     {
-        if (!detail::regsize_supported(regsize))
-            throw std::invalid_argument("Invalid regsize: " +
-                                        std::to_string(regsize));
+        uint32_t sec  = 0;
+        uint32_t usec = 0;
+        modbus_get_response_timeout(ctx, &sec, &usec);
+
+        auto const deadline = std::chrono::steady_clock::now() +
+                              std::chrono::seconds(sec) +
+                              std::chrono::microseconds(usec);
+
+        int const fd    = modbus_get_socket(ctx);
+        size_t len      = 0;
+        size_t expected = 0;
+        while (expected == 0 || len < expected)
+        {
+            auto const left =
+              std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now())
+                .count();
+
+            pollfd pfd{fd, POLLIN, 0};
+            int const ready =
+              left > 0 ? poll(&pfd, 1, static_cast<int>(left)) : 0;
+            if (ready == 0)
+            {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            if (ready < 0)
+                return -1;
 
-        uint16_t regs[4]{};
-        int api_rv = modbus_read_registers(modbus_source_.get(),
-                                           address,
-                                           regsize,
-                                           regs); // Holding register: Code 0x03
+            // A full buffer without a recognizable frame, or the line
+            // closing under us, leave no errno of their own to report
+            if (len == MODBUS_RTU_MAX_ADU_LENGTH)
+            {
+                errno = EMBBADDATA;
+                return -1;
+            }
+            auto const n = read(fd, adu + len, MODBUS_RTU_MAX_ADU_LENGTH - len);
+            if (n < 0)
+                return -1;
+            if (n == 0)
+            {
+                errno = EMBBADDATA;
+                return -1;
+            }
 
-        if (api_rv != regsize)
-            throw std::runtime_error(
-              std::string("Failed modbus_read_registers: ") +
-              modbus_strerror(errno));
+            len += n;
+            if (expected == 0)
+                expected = pdu::rtu_response_length(adu, len);
+            if (expected > MODBUS_RTU_MAX_ADU_LENGTH)
+            {
+                errno = EMBBADDATA;
+                return -1;
+            }
+        }
 
-        return endianess == word_endianess::little
-                 ? to_val(regs, regsize, detail::word_le_tag{})
-                 : to_val(regs, regsize, detail::word_be_tag{});
+        if (pdu::crc16(adu, expected - 2) !=
+            (adu[expected - 2] | adu[expected - 1] << 8))
+        {
+            errno = EMBBADCRC;
+            return -1;
+        }
+
+        return static_cast<int>(expected);
     }
 
-    std::vector<uint16_t> read_input_registers(int address,
-                                               int regsize) override
+    // libmodbus only frames the responses to the function codes it
+    // implements: for the others, the request goes through
+    // modbus_send_raw_request, and the response is read off the line here.
+    // on_response(pdu, len) validates the response's PDU
+    template <class F>
+    std::error_code raw_transact(pdu::buffer_t const &request, F &&on_response)
     {
-        std::vector<uint16_t> registers(regsize);
-        int api_rv = modbus_read_input_registers(
-          modbus_source_.get(),
-          address,
-          regsize,
-          registers.data()); // Holding register: Code 0x03
+        uint8_t raw[1 + MODBUS_MAX_PDU_LENGTH];
+        raw[0] = static_cast<uint8_t>(id());
+        std::copy_n(request.data.data(), request.size, raw + 1);
+
+        uint8_t adu[MODBUS_RTU_MAX_ADU_LENGTH];
+        int const api_rv = transact(
+          [&](modbus_t *ctx)
+          {
+              if (modbus_send_raw_request(
+                    ctx, raw, static_cast<int>(request.size + 1)) < 0)
+                  return -1;
+              return receive_frame(ctx, adu);
+          });
+
+        if (api_rv < 0)
+            return libmodbus_error(errno);
+        if (adu[0] != raw[0])
+            return errc::bad_slave;
+
+        // Slave address and CRC aside
+        return on_response(adu + 1, static_cast<size_t>(api_rv - 3));
+    }
 
-        if (api_rv != regsize)
-            throw std::runtime_error(
-              std::string("Failed modbus_read_input_registers: ") +
-              modbus_strerror(errno));
+public:
+    using serial_line = modbus::serial_line;
 
-        return registers;
-    }
+    // A slave sharing the bus with other slaves on the same serial line.
+    // With priority, its transactions go ahead of the others'
+    RTUSlave(slave_id_t server_id,
+             std::string server_name,
+             std::shared_ptr<RTUBus> bus,
+             latency_tracker const &timeouts,
+             bool priority = false)
+      : slave_concept(server_id, std::move(server_name))
+      , bus_(std::move(bus))
+      , timeouts_(timeouts)
+      , priority_(priority)
+    {}
+
+    RTUSlave(slave_id_t server_id,
+             std::string server_name,
+             std::shared_ptr<RTUBus> bus,
+             std::chrono::milliseconds const &answering_time)
+      : RTUSlave(server_id,
+                 std::move(server_name),
+                 std::move(bus),
+                 latency_tracker(answering_time))
+    {}
 
-    std::vector<uint16_t> read_holding_registers(int address,
-                                                 int regsize) override
+    // A slave with a serial line of its own
+    RTUSlave(slave_id_t server_id,
+             std::string server_name,
+             serial_line const &serial_line,
+             std::chrono::milliseconds const &answering_time,
+             bool verbose = false)
+      : RTUSlave(server_id,
+                 std::move(server_name),
+                 std::make_shared<RTUBus>(serial_line, verbose),
+                 answering_time)
+    {}
+
+    std::error_code try_read_registers(regtype type,
+                                       int address,
+                                       int num_regs,
+                                       uint16_t *dest) override
     {
-        std::vector<uint16_t> registers(regsize);
-        int api_rv = modbus_read_registers(
-          modbus_source_.get(),
-          address,
-          regsize,
-          registers.data()); // Holding register: Code 0x03
+        if (is_bit(type))
+            return std::make_error_code(std::errc::invalid_argument);
+
+        int const api_rv = transact(
+          [&](modbus_t *ctx)
+          {
+              // Holding register: Code 0x03, Input register: Code 0x04
+              return type == regtype::holding
+                       ? modbus_read_registers(ctx, address, num_regs, dest)
+                       : modbus_read_input_registers(
+                           ctx, address, num_regs, dest);
+          });
+
+        return api_rv == num_regs ? std::error_code{} : libmodbus_error(errno);
+    }
 
-        if (api_rv != regsize)
-            throw std::runtime_error(
-              std::string("Failed modbus_read_registers: ") +
-              modbus_strerror(errno));
+    std::error_code try_read_bits(regtype type,
+                                  int address,
+                                  int num_bits,
+                                  uint8_t *dest) override
+    {
+        if (!is_bit(type) || num_bits > MODBUS_MAX_READ_BITS)
+            return std::make_error_code(std::errc::invalid_argument);
+
+        // libmodbus unpacks the bits, one per byte
+        uint8_t bits[MODBUS_MAX_READ_BITS];
+        int const api_rv = transact(
+          [&](modbus_t *ctx)
+          {
+              // Coils: Code 0x01, Discrete inputs: Code 0x02
+              return type == regtype::coil
+                       ? modbus_read_bits(ctx, address, num_bits, bits)
+                       : modbus_read_input_bits(ctx, address, num_bits, bits);
+          });
+
+        if (api_rv != num_bits)
+            return libmodbus_error(errno);
+
+        detail::pack_bits(bits, num_bits, dest);
+        return {};
+    }
 
-        return registers;
+    std::error_code try_read_file_record(int file,
+                                         int record,
+                                         int num_regs,
+                                         uint16_t *dest) override
+    {
+        if (num_regs < 1 || num_regs > pdu::max_read_file_record_regs)
+            return std::make_error_code(std::errc::invalid_argument);
+
+        return raw_transact(
+          pdu::read_file_record_request(file, record, num_regs),
+          [&](uint8_t const *pdu, size_t len)
+          {
+              return pdu::parse_read_file_record_response(
+                pdu, len, dest, num_regs);
+          });
     }
 
+    std::error_code try_write_file_record(int file,
+                                          int record,
+                                          uint16_t const *regs,
+                                          int num_regs) override
+    {
+        if (num_regs < 1 || num_regs > pdu::max_write_file_record_regs)
+            return std::make_error_code(std::errc::invalid_argument);
+
+        auto const request =
+          pdu::write_file_record_request(file, record, regs, num_regs);
+        return raw_transact(request,
+                            [&](uint8_t const *pdu, size_t len)
+                            {
+                                return pdu::parse_write_file_record_response(
+                                  request, pdu, len);
+                            });
+    }
 
     void write_holding_register(int address, uint16_t value) override
     {
-        int api_rv =
-          modbus_write_register(modbus_source_.get(),
-                                address,
-                                value); // Write Holding Register: Code 0x06
+        int api_rv = transact(
+          [&](modbus_t *ctx)
+          {
+              return modbus_write_register(
+                ctx, address, value); // Write Holding Register: Code 0x06
+          });
 
         if (api_rv != 1)
             throw std::runtime_error(
@@ -479,6 +1067,17 @@ public:
               modbus_strerror(errno));
     }
 
+    void async_write_holding_register(int address,
+                                      uint16_t value,
+                                      write_handler_t const &handler) override
+    {
+        int const api_rv = transact(
+          [&](modbus_t *ctx)
+          { return modbus_write_register(ctx, address, value); });
+
+        handler(api_rv == 1 ? std::error_code{} : libmodbus_error(errno));
+    }
+
     void write_multiple_registers(
       int address,
       std::vector<uint16_t> const &registers) override
@@ -490,11 +1089,15 @@ public:
         uint16_t const *regs = registers.data();
         for (auto chunk = 0ULL; chunk != chunks; ++chunk)
         {
-            api_rv = modbus_write_registers(
-              modbus_source_.get(),
-              address,
-              MODBUS_MAX_WRITE_REGISTERS,
-              regs); // Write Multiple Registers: Code 0x10
+            api_rv = transact(
+              [&](modbus_t *ctx)
+              {
+                  return modbus_write_registers(
+                    ctx,
+                    address,
+                    MODBUS_MAX_WRITE_REGISTERS,
+                    regs); // Write Multiple Registers: Code 0x10
+              });
             if (api_rv != MODBUS_MAX_WRITE_REGISTERS)
                 throw std::runtime_error(
                   std::string("Failed modbus_write_registers chunk #") +
@@ -504,11 +1107,15 @@ public:
             regs += MODBUS_MAX_WRITE_REGISTERS;
         }
 
-        api_rv =
-          modbus_write_registers(modbus_source_.get(),
-                                 address,
-                                 remaining,
-                                 regs); // Write Multiple Registers: Code 0x10
+        api_rv = transact(
+          [&](modbus_t *ctx)
+          {
+              return modbus_write_registers(
+                ctx,
+                address,
+                remaining,
+                regs); // Write Multiple Registers: Code 0x10
+          });
         if (api_rv != remaining)
             throw std::runtime_error(
               std::string("Failed modbus_write_registers remaining: ") +
@@ -519,11 +1126,15 @@ public:
                                   uint16_t const *regs,
                                   int num_regs) override
     {
-        int const api_rv =
-          modbus_write_registers(modbus_source_.get(),
-                                 address,
-                                 num_regs,
-                                 regs); // Write Multiple Registers: Code 0x10
+        int const api_rv = transact(
+          [&](modbus_t *ctx)
+          {
+              return modbus_write_registers(
+                ctx,
+                address,
+                num_regs,
+                regs); // Write Multiple Registers: Code 0x10
+          });
 
         if (api_rv != num_regs)
             throw std::runtime_error(
@@ -551,4 +1162,36 @@ TEST_CASE("Random Slave Should respect params")
     bool const in_range = (val >= 2000 - 100) && (val <= 2000 + 100);
     CHECK(in_range);
 }
+
+TEST_CASE("Slaves sharing a cache see each other's writes")
+{
+    using modbus::regtype;
+
+    std::map<int, modbus::RandomSlave::random_params> const random_params;
+    modbus::slave poller(modbus::slave::model_type<modbus::RandomSlave>{},
+                         7,
+                         "poller",
+                         random_params,
+                         false);
+    modbus::slave control(modbus::slave::model_type<modbus::RandomSlave>{},
+                          7,
+                          "control",
+                          random_params,
+                          false);
+    control.share_cache(poller);
+
+    auto const now = modbus::register_cache::clock_type::now();
+    uint16_t const regs[] = {1, 2};
+    poller.cache().store(regtype::holding, 10, 2, regs, now);
+
+    uint16_t dest[2];
+    REQUIRE(control.cache().lookup(
+      regtype::holding, 10, 2, std::chrono::hours(1), now, dest));
+
+    control.write_holding_register(11, 42);
+    CHECK_FALSE(poller.cache().lookup(
+      regtype::holding, 10, 2, std::chrono::hours(1), now, dest));
+    CHECK(poller.cache().lookup(
+      regtype::holding, 10, 1, std::chrono::hours(1), now, dest));
+}
 #endif
\ No newline at end of file
@@ -29,7 +29,9 @@ enum class value_type
     INT32,
     UINT32,
     INT64,
-    UINT64
+    UINT64,
+    // A single coil or discrete input
+    BIT
 };
 
 inline std::string
@@ -49,6 +51,8 @@ to_string(value_type vt)
         return "INT64";
     case modbus::value_type::UINT64:
         return "UINT64";
+    case modbus::value_type::BIT:
+        return "BIT";
     default:
         assert(!"Unreachable switch case");
     }
@@ -89,6 +93,8 @@ value_in_range(T value, value_type vt)
         return detail::in_range_impl<int64_t>(value);
     case modbus::value_type::UINT64:
         return detail::in_range_impl<uint64_t>(value);
+    case modbus::value_type::BIT:
+        return value == 0 || value == 1;
     default:
         assert(!"Unreachable switch case");
     }
@@ -101,6 +107,7 @@ reg_size(value_type vt)
     {
     case value_type::INT16:
     case value_type::UINT16:
+    case value_type::BIT: // In units of its register type, i.e. bits
         return 1;
     case value_type::INT32:
     case value_type::UINT32:
@@ -118,9 +125,18 @@ enum class regtype
 {
     INVALID = 0,
     holding,
-    input
+    input,
+    coil,
+    discrete_input
 };
 
+// Coils and discrete inputs are single bits, addressed and read by the bit
+inline bool
+is_bit(regtype type)
+{
+    return type == regtype::coil || type == regtype::discrete_input;
+}
+
 template <class E>
 void
 check_enum(E e)
@@ -0,0 +1,105 @@
+#pragma once
+#include "modbus_types.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+namespace modbus {
+
+// Last known values of a slave's registers, along with when they were read,
+// so that registers which never or seldom change, e.g. a serial number or
+// a CT ratio, can be served without issuing a transaction. Thread safe, as
+// the slaves sharing a device may share its cache as well, see slave
+class register_cache
+{
+public:
+    using clock_type = std::chrono::steady_clock;
+
+    // Copy the num_regs registers starting at address into dest, provided
+    // that all of them have been read less than max_age ago
+    [[nodiscard]] bool lookup(regtype type,
+                              int address,
+                              int num_regs,
+                              clock_type::duration max_age,
+                              clock_type::time_point now,
+                              uint16_t *dest) const
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        for (int i = 0; i != num_regs; ++i)
+        {
+            auto const it = entries_.find(key(type, address + i));
+            if (it == entries_.end() || now - it->second.read_at >= max_age)
+                return false;
+            dest[i] = it->second.value;
+        }
+
+        return true;
+    }
+
+    void store(regtype type,
+               int address,
+               int num_regs,
+               uint16_t const *regs,
+               clock_type::time_point now)
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        for (int i = 0; i != num_regs; ++i)
+            entries_[key(type, address + i)] = {regs[i], now};
+    }
+
+    // The slave's registers have been written, their cached values can't be
+    // trusted anymore
+    void invalidate(regtype type, int address, int num_regs)
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        for (int i = 0; i != num_regs; ++i)
+            entries_.erase(key(type, address + i));
+    }
+
+private:
+    struct entry_t
+    {
+        uint16_t value;
+        clock_type::time_point read_at;
+    };
+
+    static uint32_t key(regtype type, int address) noexcept
+    {
+        return static_cast<uint32_t>(type) << 16 |
+               static_cast<uint16_t>(address);
+    }
+
+    mutable std::mutex mutex_;
+    std::unordered_map<uint32_t, entry_t> entries_;
+};
+} // namespace modbus
+
+#if defined(DOCTEST_LIBRARY_INCLUDED)
+TEST_CASE("Register cache serves fresh registers only")
+{
+    using namespace std::chrono_literals;
+    using modbus::regtype;
+
+    modbus::register_cache cache;
+    auto const t0 = modbus::register_cache::clock_type::now();
+
+    uint16_t const regs[] = {1, 2, 3};
+    cache.store(regtype::holding, 10, 3, regs, t0);
+
+    uint16_t dest[3] = {};
+    CHECK(cache.lookup(regtype::holding, 11, 2, 60s, t0 + 30s, dest));
+    CHECK(dest[0] == 2);
+    CHECK(dest[1] == 3);
+
+    // Expired, partly missing, or of another type
+    CHECK_FALSE(cache.lookup(regtype::holding, 10, 3, 60s, t0 + 60s, dest));
+    CHECK_FALSE(cache.lookup(regtype::holding, 12, 2, 60s, t0, dest));
+    CHECK_FALSE(cache.lookup(regtype::input, 10, 1, 60s, t0, dest));
+
+    cache.invalidate(regtype::holding, 11, 1);
+    CHECK_FALSE(cache.lookup(regtype::holding, 10, 3, 60s, t0, dest));
+    CHECK(cache.lookup(regtype::holding, 12, 1, 60s, t0, dest));
+}
+#endif
@@ -0,0 +1,207 @@
+#pragma once
+#include "modbus_error.hpp"
+#include "modbus_types.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <system_error>
+#include <unordered_map>
+
+namespace modbus {
+
+// Latest raw registers and bits read off each slave, along with when they
+// were read, shared between the threads polling the slaves and the ones
+// serving them to other masters. Only the ranges added beforehand are kept,
+// so that a register which is never going to be read can be told apart
+// from one which hasn't been read yet
+class register_image
+{
+public:
+    using clock_type = std::chrono::steady_clock;
+
+    void add_range(slave_id_t unit, regtype type, int address, int num_regs)
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        auto &entries = units_[unit];
+        for (int i = 0; i != num_regs; ++i)
+            entries.try_emplace(key(type, address + i));
+    }
+
+    void store(slave_id_t unit,
+               regtype type,
+               int address,
+               int num_regs,
+               uint16_t const *regs,
+               clock_type::time_point now)
+    {
+        update(unit,
+               type,
+               address,
+               num_regs,
+               [&](entry_t &entry, int i) { entry = {regs[i], now}; });
+    }
+
+    // Coils and discrete inputs, packed as they come off the wire
+    void store_bits(slave_id_t unit,
+                    regtype type,
+                    int address,
+                    int num_bits,
+                    uint8_t const *bits,
+                    clock_type::time_point now)
+    {
+        update(unit,
+               type,
+               address,
+               num_bits,
+               [&](entry_t &entry, int i)
+               {
+                   entry = {static_cast<uint16_t>(bits[i / 8] >> (i % 8) & 1),
+                            now};
+               });
+    }
+
+    // The slave reported that the range hasn't changed since it was last
+    // read, so the values held are as good as read now
+    void refresh(slave_id_t unit,
+                 regtype type,
+                 int address,
+                 int num_regs,
+                 clock_type::time_point now)
+    {
+        update(unit,
+               type,
+               address,
+               num_regs,
+               [&](entry_t &entry, int)
+               {
+                   if (entry.read_at != clock_type::time_point{})
+                       entry.read_at = now;
+               });
+    }
+
+    // Copy the num_regs values starting at address into values and, if not
+    // null, how long ago they were read into ages, in seconds saturated at
+    // 65535. Fails with the exception a gateway replies with: an unknown
+    // unit has no path, a range not added isn't addressable, and a range
+    // added but never read means that the slave hasn't answered yet
+    [[nodiscard]] std::error_code read(slave_id_t unit,
+                                       regtype type,
+                                       int address,
+                                       int num_regs,
+                                       clock_type::time_point now,
+                                       uint16_t *values,
+                                       uint16_t *ages = nullptr) const
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+
+        auto const unit_it = units_.find(unit);
+        if (unit_it == units_.end())
+            return errc::gateway_path_unavailable;
+
+        for (int i = 0; i != num_regs; ++i)
+        {
+            auto const it = unit_it->second.find(key(type, address + i));
+            if (it == unit_it->second.end())
+                return errc::illegal_data_address;
+            if (it->second.read_at == clock_type::time_point{})
+                return errc::gateway_target_failed;
+
+            values[i] = it->second.value;
+            if (ages)
+                ages[i] = static_cast<uint16_t>(std::min<long long>(
+                  std::chrono::duration_cast<std::chrono::seconds>(
+                    now - it->second.read_at)
+                    .count(),
+                  UINT16_MAX));
+        }
+
+        return {};
+    }
+
+private:
+    struct entry_t
+    {
+        uint16_t value = 0;
+        // Default, i.e. the epoch, until first read
+        clock_type::time_point read_at;
+    };
+    using entries_t = std::unordered_map<uint32_t, entry_t>;
+
+    static uint32_t key(regtype type, int address) noexcept
+    {
+        return static_cast<uint32_t>(type) << 16 |
+               static_cast<uint16_t>(address);
+    }
+
+    // Apply f(entry, i) to each of the added entries of the range
+    template <class F>
+    void update(slave_id_t unit, regtype type, int address, int num, F &&f)
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+
+        auto const unit_it = units_.find(unit);
+        if (unit_it == units_.end())
+            return;
+
+        for (int i = 0; i != num; ++i)
+        {
+            auto const it = unit_it->second.find(key(type, address + i));
+            if (it != unit_it->second.end())
+                f(it->second, i);
+        }
+    }
+
+    mutable std::mutex mutex_;
+    std::unordered_map<slave_id_t, entries_t> units_;
+};
+} // namespace modbus
+
+#if defined(DOCTEST_LIBRARY_INCLUDED)
+TEST_CASE("Register image tells missing, unread and aged registers apart")
+{
+    using namespace std::chrono_literals;
+    using modbus::errc;
+    using modbus::regtype;
+
+    modbus::register_image image;
+    auto const t0 = modbus::register_image::clock_type::now();
+
+    image.add_range(3, regtype::holding, 10, 3);
+    image.add_range(3, regtype::coil, 0, 10);
+
+    uint16_t values[10] = {};
+    uint16_t ages[10]   = {};
+    CHECK(image.read(4, regtype::holding, 10, 1, t0, values) ==
+          errc::gateway_path_unavailable);
+    CHECK(image.read(3, regtype::holding, 10, 1, t0, values) ==
+          errc::gateway_target_failed);
+
+    uint16_t const regs[] = {1, 2, 3, 4};
+    image.store(3, regtype::holding, 10, 4, regs, t0);
+    CHECK(!image.read(3, regtype::holding, 11, 2, t0 + 5s, values, ages));
+    CHECK(values[0] == 2);
+    CHECK(values[1] == 3);
+    CHECK(ages[0] == 5);
+
+    // Only the added ranges are kept
+    CHECK(image.read(3, regtype::holding, 12, 2, t0, values) ==
+          errc::illegal_data_address);
+    CHECK(image.read(3, regtype::input, 10, 1, t0, values) ==
+          errc::illegal_data_address);
+
+    image.refresh(3, regtype::holding, 10, 3, t0 + 10s);
+    CHECK(!image.read(3, regtype::holding, 10, 1, t0 + 12s, values, ages));
+    CHECK(ages[0] == 2);
+
+    // Coils 0 and 9 set
+    uint8_t const bits[] = {0x01, 0x02};
+    image.store_bits(3, regtype::coil, 0, 10, bits, t0);
+    CHECK(!image.read(3, regtype::coil, 0, 10, t0 + 100000s, values, ages));
+    CHECK(values[0] == 1);
+    CHECK(values[1] == 0);
+    CHECK(values[9] == 1);
+    CHECK(ages[9] == UINT16_MAX);
+}
+#endif
@@ -0,0 +1,17 @@
+#pragma once
+
+#if defined(ASIO_STANDALONE)
+#    include <asio.hpp>
+#else
+#    include <boost/asio.hpp>
+#endif
+
+namespace modbus {
+#if defined(ASIO_STANDALONE)
+namespace net      = asio;
+using net_error_code = asio::error_code;
+#else
+namespace net      = boost::asio;
+using net_error_code = boost::system::error_code;
+#endif
+} // namespace modbus
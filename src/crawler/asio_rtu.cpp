@@ -0,0 +1,414 @@
+#include "asio_rtu.h"
+
+#include "doctest.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <memory>
+#include <termios.h>
+#include <vector>
+
+namespace modbus {
+namespace {
+    using clock_type = std::chrono::steady_clock;
+
+    std::chrono::microseconds char_time(serial_line const &line)
+    {
+        // start bit + data bits + optional parity bit + stop bits
+        int const bits_per_char =
+          1 + line.data_bits() + (line.parity() != 'N') + line.stop_bits();
+        return std::chrono::microseconds(bits_per_char * 1000000LL /
+                                         line.bps());
+    }
+} // namespace
+
+AsioRTUBus::AsioRTUBus(net::io_context &ctx, serial_line const &line)
+  : ctx_(ctx)
+  , line_(line)
+  , port_(ctx, line.device())
+  , response_timer_(ctx)
+  , silence_timer_(ctx)
+  , char_time_(modbus::char_time(line))
+  , line_idle_since_(clock_type::now())
+{
+    // As per the modbus over serial line specification, above 19200 bps a
+    // fixed 1.75ms is used for the inter-frame delay
+    t35_ = line.bps() > 19200 ? std::chrono::microseconds(1750)
+                              : char_time_ * 7 / 2;
+
+    using sp = net::serial_port;
+    port_.set_option(sp::baud_rate(line.bps()));
+    port_.set_option(sp::character_size(line.data_bits()));
+    port_.set_option(sp::flow_control(sp::flow_control::none));
+    port_.set_option(sp::parity(line.parity() == 'E'   ? sp::parity::even
+                                : line.parity() == 'O' ? sp::parity::odd
+                                                       : sp::parity::none));
+    port_.set_option(sp::stop_bits(line.stop_bits() == 2 ? sp::stop_bits::two
+                                                         : sp::stop_bits::one));
+}
+
+void
+AsioRTUBus::async_transaction(slave_id_t slave_id,
+                              pdu::buffer_t const &request,
+                              latency_tracker &timeouts,
+                              handler_t handler,
+                              bool priority)
+{
+    transaction_t t{slave_id, {}, 0, &timeouts, std::move(handler), priority};
+
+    t.adu[t.adu_size++] = static_cast<uint8_t>(slave_id);
+    std::copy_n(request.data.begin(), request.size, t.adu.begin() + 1);
+    t.adu_size += request.size;
+
+    auto const crc = pdu::crc16(t.adu.data(), t.adu_size);
+
+    t.adu[t.adu_size++] = crc & 0xFF;
+    t.adu[t.adu_size++] = crc >> 8;
+
+    net::post(ctx_,
+              [this, t = std::move(t)]() mutable
+              {
+                  // The front transaction may already be in progress
+                  auto pos = queue_.end();
+                  if (t.priority)
+                      pos = std::find_if(
+                        queue_.begin() + (busy_ ? 1 : 0),
+                        queue_.end(),
+                        [](transaction_t const &q) { return !q.priority; });
+
+                  queue_.insert(pos, std::move(t));
+                  start_next();
+              });
+}
+
+void
+AsioRTUBus::start_next()
+{
+    if (busy_ || queue_.empty())
+        return;
+
+    busy_    = true;
+    rx_size_ = 0;
+
+    // Respect the silent interval after the last frame seen on the line
+    auto const earliest = line_idle_since_ + t35_;
+    if (earliest <= clock_type::now())
+        return send();
+
+    silence_timer_.expires_at(earliest);
+    silence_timer_.async_wait(
+      [this, gen = generation_](auto const &ec)
+      {
+          if (!ec && gen == generation_)
+              send();
+      });
+}
+
+void
+AsioRTUBus::send()
+{
+    auto const &t = queue_.front();
+
+    // Discard whatever is left of a late response to a timed out request
+    ::tcflush(port_.native_handle(), TCIFLUSH);
+
+    net::async_write(
+      port_,
+      net::buffer(t.adu.data(), t.adu_size),
+      [this, gen = generation_](auto const &ec, size_t)
+      {
+          if (gen != generation_)
+              return;
+          if (ec)
+              return complete(ec);
+
+          auto const &t = queue_.front();
+
+          // The write completes as soon as the frame has been handed over to
+          // the driver, so account for the time needed to actually transmit
+          // it before starting the response timeout
+          auto const tx_time = char_time_ * static_cast<int>(t.adu_size);
+          line_idle_since_   = clock_type::now() + tx_time;
+          sent_at_           = line_idle_since_;
+
+          if (t.slave_id == MODBUS_BROADCAST_ADDRESS)
+              return complete({});
+
+          response_timer_.expires_at(line_idle_since_ +
+                                     t.timeouts->timeout());
+          response_timer_.async_wait(
+            [this, gen](auto const &ec)
+            {
+                if (!ec && gen == generation_)
+                {
+                    port_.cancel();
+                    queue_.front().timeouts->on_timeout();
+                    complete(errc::timeout);
+                }
+            });
+
+          receive();
+      });
+}
+
+void
+AsioRTUBus::receive()
+{
+    port_.async_read_some(
+      net::buffer(rx_.data() + rx_size_, rx_.size() - rx_size_),
+      [this, gen = generation_](auto const &ec, size_t received)
+      {
+          if (gen != generation_ || ec == net::error::operation_aborted)
+              return;
+          if (ec)
+              return complete(ec);
+
+          rx_size_ += received;
+          line_idle_since_ = clock_type::now();
+
+          auto const expected = pdu::rtu_response_length(rx_.data(), rx_size_);
+          if ((expected && rx_size_ >= expected) || rx_size_ == rx_.size())
+              return frame_received();
+
+          // The frame is not complete yet, but a silent interval would
+          // anyway end it
+          silence_timer_.expires_after(t35_);
+          silence_timer_.async_wait(
+            [this, gen](auto const &ec)
+            {
+                if (!ec && gen == generation_)
+                {
+                    port_.cancel();
+                    frame_received();
+                }
+            });
+
+          receive();
+      });
+}
+
+void
+AsioRTUBus::frame_received()
+{
+    auto const &t = queue_.front();
+
+    // Slave address + function code + CRC, at the very least
+    if (rx_size_ < 4)
+        return complete(errc::bad_frame);
+
+    uint16_t const crc = rx_[rx_size_ - 2] | (rx_[rx_size_ - 1] << 8);
+    if (crc != pdu::crc16(rx_.data(), rx_size_ - 2))
+        return complete(errc::bad_crc);
+
+    if (rx_[0] != t.slave_id)
+        return complete(errc::bad_slave);
+
+    t.timeouts->on_response(line_idle_since_ - sent_at_);
+
+    complete({}, rx_.data() + 1, rx_size_ - 3);
+}
+
+void
+AsioRTUBus::complete(std::error_code const &ec, uint8_t const *pdu, size_t len)
+{
+    ++generation_;
+    response_timer_.cancel();
+    silence_timer_.cancel();
+
+    auto const handler = std::move(queue_.front().handler);
+    queue_.pop_front();
+    busy_ = false;
+
+    // Invoke the handler before starting the next transaction, as the
+    // response is still sitting in the receive buffer
+    handler(ec, pdu, len);
+
+    start_next();
+}
+} // namespace modbus
+
+namespace {
+using namespace std::chrono_literals;
+namespace net = modbus::net;
+
+enum class reply_t
+{
+    answer,
+    wrong_slave,
+    bad_crc,
+    silent,
+};
+
+// The slaves' end of a pseudo terminal standing for the serial line. Each
+// read of a holding register gets the reply queued for it, answering by
+// default, the register holding twice its address
+class fake_rtu_line
+{
+    net::posix::stream_descriptor master_;
+    std::string device_;
+    std::array<uint8_t, 8> rx_;
+
+    void read()
+    {
+        net::async_read(
+          master_,
+          net::buffer(rx_),
+          [this](auto const &ec, size_t)
+          {
+              if (ec)
+                  return;
+
+              int const address = modbus::pdu::detail::get_u16(&rx_[2]);
+              addresses.push_back(address);
+
+              auto reply = reply_t::answer;
+              if (!replies.empty())
+              {
+                  reply = replies.front();
+                  replies.pop_front();
+              }
+
+              if (reply != reply_t::silent)
+              {
+                  uint8_t const slave_id =
+                    rx_[0] + (reply == reply_t::wrong_slave ? 1 : 0);
+                  auto const frame = std::make_shared<std::vector<uint8_t>>(
+                    std::initializer_list<uint8_t>{
+                      slave_id,
+                      rx_[1],
+                      2,
+                      static_cast<uint8_t>(address * 2 >> 8),
+                      static_cast<uint8_t>(address * 2 & 0xFF)});
+                  auto const crc =
+                    modbus::pdu::crc16(frame->data(), frame->size());
+                  frame->push_back(crc & 0xFF);
+                  frame->push_back(crc >> 8);
+                  if (reply == reply_t::bad_crc)
+                      frame->back() ^= 1;
+
+                  net::async_write(master_,
+                                   net::buffer(*frame),
+                                   [frame](auto const &, size_t) {});
+              }
+
+              read();
+          });
+    }
+
+public:
+    std::vector<int> addresses;
+    std::deque<reply_t> replies;
+
+    explicit fake_rtu_line(net::io_context &ctx) : master_(ctx)
+    {
+        int const fd = ::posix_openpt(O_RDWR | O_NOCTTY);
+        if (fd < 0 || ::grantpt(fd) || ::unlockpt(fd))
+            throw std::system_error(errno, std::generic_category(), "pty");
+        master_.assign(fd);
+        device_ = ::ptsname(fd);
+        read();
+    }
+
+    [[nodiscard]] std::string const &device() const noexcept
+    {
+        return device_;
+    }
+};
+
+struct outcome_t
+{
+    int calls = 0;
+    std::error_code ec;
+    int value = -1;
+};
+
+// Run ctx until done, or give up after a while
+void
+run_until(net::io_context &ctx, std::function<bool()> const &done)
+{
+    auto const deadline = std::chrono::steady_clock::now() + 5s;
+    while (!done() && std::chrono::steady_clock::now() < deadline)
+    {
+        if (ctx.stopped())
+            ctx.restart();
+        ctx.run_one_for(10ms);
+    }
+}
+
+void
+read_register(modbus::AsioRTUBus &bus,
+              modbus::latency_tracker &timeouts,
+              int address,
+              outcome_t &outcome,
+              std::vector<int> *completed = nullptr,
+              bool priority               = false)
+{
+    bus.async_transaction(
+      1,
+      modbus::pdu::read_registers_request(
+        modbus::pdu::function::read_holding_registers, address, 1),
+      timeouts,
+      [&outcome, address, completed](
+        std::error_code const &ec, uint8_t const *pdu, size_t)
+      {
+          ++outcome.calls;
+          outcome.ec = ec;
+          if (!ec)
+              outcome.value = modbus::pdu::detail::get_u16(pdu + 2);
+          if (completed)
+              completed->push_back(address);
+      },
+      priority);
+}
+} // namespace
+
+TEST_CASE("RTU transactions go one at a time, the priority ones first")
+{
+    net::io_context ctx;
+    fake_rtu_line line(ctx);
+    modbus::AsioRTUBus bus(ctx, {line.device(), "115200:8:N:1"});
+    modbus::latency_tracker timeouts(1000ms);
+
+    outcome_t a, b, c;
+    std::vector<int> completed;
+    read_register(bus, timeouts, 10, a, &completed);
+    read_register(bus, timeouts, 20, b, &completed);
+    // Ahead of the second one, the first being already under way
+    read_register(bus, timeouts, 30, c, &completed, true);
+    run_until(ctx, [&] { return completed.size() == 3; });
+
+    CHECK(line.addresses == std::vector<int>{10, 30, 20});
+    CHECK(completed == std::vector<int>{10, 30, 20});
+    CHECK(!a.ec);
+    CHECK(a.value == 20);
+    CHECK(!b.ec);
+    CHECK(b.value == 40);
+    CHECK(!c.ec);
+    CHECK(c.value == 60);
+}
+
+TEST_CASE("RTU responses are checked for their slave, CRC and timeout")
+{
+    net::io_context ctx;
+    fake_rtu_line line(ctx);
+    modbus::AsioRTUBus bus(ctx, {line.device(), "115200:8:N:1"});
+    modbus::latency_tracker timeouts(100ms);
+
+    line.replies = {reply_t::wrong_slave, reply_t::bad_crc, reply_t::silent};
+
+    outcome_t a, b, c, d;
+    read_register(bus, timeouts, 10, a);
+    read_register(bus, timeouts, 20, b);
+    read_register(bus, timeouts, 30, c);
+    read_register(bus, timeouts, 40, d);
+    run_until(ctx, [&] { return d.calls != 0; });
+
+    CHECK(a.ec == modbus::errc::bad_slave);
+    CHECK(b.ec == modbus::errc::bad_crc);
+    CHECK(c.ec == modbus::errc::timeout);
+    CHECK(!d.ec);
+    CHECK(d.value == 80);
+    CHECK(a.calls + b.calls + c.calls + d.calls == 4);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "asio_net.h"
+#include "latency_tracker.hpp"
+#include "modbus_pdu.hpp"
+#include "modbus_slave.hpp"
+
+#include <array>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <system_error>
+
+namespace modbus {
+// Modbus RTU master on top of an asio serial port. A whole transaction,
+// i.e. inter-frame silent interval, request, response framing and timeout,
+// is carried out asynchronously, so the thread running the io_context is
+// never blocked while waiting for a slave and can multiplex many ports.
+// Transactions are queued and performed one at a time, as the line is
+// shared by all the slaves on it, the priority ones ahead of the others.
+class AsioRTUBus
+{
+public:
+    // On success, pdu points to the response PDU (function code first),
+    // valid only for the duration of the handler invocation
+    using handler_t = std::function<
+      void(std::error_code const &ec, uint8_t const *pdu, size_t len)>;
+
+    AsioRTUBus(net::io_context &ctx, serial_line const &line);
+
+    AsioRTUBus(AsioRTUBus const &) = delete;
+    AsioRTUBus &operator=(AsioRTUBus const &) = delete;
+
+    [[nodiscard]] net::io_context &context() noexcept { return ctx_; }
+    [[nodiscard]] serial_line const &line() const noexcept { return line_; }
+
+    // Can be called from any thread, the handler is always invoked by the
+    // thread running the io_context. Requests to the broadcast address
+    // complete as soon as they've been sent. The response timeout is taken
+    // from, and the response time reported to, the slave's latency tracker,
+    // which must outlive the transaction. A priority transaction is queued
+    // after the priority ones only
+    void async_transaction(slave_id_t slave_id,
+                           pdu::buffer_t const &request,
+                           latency_tracker &timeouts,
+                           handler_t handler,
+                           bool priority = false);
+
+private:
+    struct transaction_t
+    {
+        slave_id_t slave_id;
+        std::array<uint8_t, MODBUS_RTU_MAX_ADU_LENGTH> adu;
+        size_t adu_size;
+        latency_tracker *timeouts;
+        handler_t handler;
+        bool priority;
+    };
+
+    void start_next();
+    void send();
+    void receive();
+    void frame_received();
+    void complete(std::error_code const &ec,
+                  uint8_t const *pdu = nullptr,
+                  size_t len         = 0);
+
+    net::io_context &ctx_;
+    serial_line line_;
+    net::serial_port port_;
+    net::steady_timer response_timer_;
+    net::steady_timer silence_timer_;
+
+    std::chrono::microseconds char_time_;
+    // The 3.5 characters silent interval delimiting RTU frames
+    std::chrono::microseconds t35_;
+    std::chrono::steady_clock::time_point line_idle_since_;
+    // End of the transmission of the current request
+    std::chrono::steady_clock::time_point sent_at_;
+
+    std::deque<transaction_t> queue_;
+    bool busy_ = false;
+    // Bumped at each completion, so that late handlers of timers and port
+    // operations belonging to a completed transaction can be discarded
+    unsigned long generation_ = 0;
+
+    std::array<uint8_t, MODBUS_RTU_MAX_ADU_LENGTH> rx_;
+    size_t rx_size_ = 0;
+};
+} // namespace modbus
@@ -0,0 +1,288 @@
+#include "asio_slave.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace modbus {
+namespace {
+    pdu::function read_function(regtype type)
+    {
+        switch (type)
+        {
+        case regtype::holding:
+            return pdu::function::read_holding_registers;
+        case regtype::input:
+            return pdu::function::read_input_registers;
+        case regtype::coil:
+            return pdu::function::read_coils;
+        default:
+            return pdu::function::read_discrete_inputs;
+        }
+    }
+} // namespace
+
+template <class Transport>
+AsioSlave<Transport>::AsioSlave(slave_id_t server_id,
+                                std::string server_name,
+                                std::shared_ptr<Transport> transport,
+                                latency_tracker const &timeouts,
+                                bool priority)
+  : slave_concept(server_id, std::move(server_name))
+  , transport_(std::move(transport))
+  , timeouts_(timeouts)
+  , priority_(priority)
+{}
+
+template <class Transport>
+template <class F>
+std::error_code
+AsioSlave<Transport>::try_transact(pdu::buffer_t const &request,
+                                   F &&on_response)
+{
+    bool done = false;
+    std::error_code result;
+
+    transport_->async_transaction(
+      id(),
+      request,
+      timeouts_,
+      [&](std::error_code const &ec, uint8_t const *pdu, size_t len)
+      {
+          result = ec ? ec : on_response(pdu, len);
+          done   = true;
+      },
+      priority_);
+
+    auto &ctx = transport_->context();
+    if (ctx.stopped())
+        ctx.restart();
+    while (!done)
+        ctx.run_one();
+
+    return result;
+}
+
+template <class Transport>
+template <class F>
+void
+AsioSlave<Transport>::transact(pdu::buffer_t const &request,
+                               F &&on_response,
+                               char const *what)
+{
+    if (auto const ec = try_transact(request, std::forward<F>(on_response)))
+        throw std::system_error(ec, what);
+}
+
+template <class Transport>
+std::error_code
+AsioSlave<Transport>::try_read_registers(regtype type,
+                                         int address,
+                                         int num_regs,
+                                         uint16_t *dest)
+{
+    if (is_bit(type))
+        return std::make_error_code(std::errc::invalid_argument);
+
+    auto const fc = read_function(type);
+
+    return try_transact(
+      pdu::read_registers_request(fc, address, num_regs),
+      [&](uint8_t const *pdu, size_t len)
+      {
+          return pdu::parse_read_registers_response(
+            fc, pdu, len, dest, num_regs);
+      });
+}
+
+template <class Transport>
+std::error_code
+AsioSlave<Transport>::try_read_bits(regtype type,
+                                    int address,
+                                    int num_bits,
+                                    uint8_t *dest)
+{
+    if (!is_bit(type))
+        return std::make_error_code(std::errc::invalid_argument);
+
+    auto const fc = read_function(type);
+
+    return try_transact(pdu::read_registers_request(fc, address, num_bits),
+                        [&](uint8_t const *pdu, size_t len)
+                        {
+                            return pdu::parse_read_bits_response(
+                              fc, pdu, len, dest, num_bits);
+                        });
+}
+
+template <class Transport>
+std::error_code
+AsioSlave<Transport>::try_read_file_record(int file,
+                                           int record,
+                                           int num_regs,
+                                           uint16_t *dest)
+{
+    if (num_regs < 1 || num_regs > pdu::max_read_file_record_regs)
+        return std::make_error_code(std::errc::invalid_argument);
+
+    return try_transact(pdu::read_file_record_request(file, record, num_regs),
+                        [&](uint8_t const *pdu, size_t len)
+                        {
+                            return pdu::parse_read_file_record_response(
+                              pdu, len, dest, num_regs);
+                        });
+}
+
+template <class Transport>
+std::error_code
+AsioSlave<Transport>::try_write_file_record(int file,
+                                            int record,
+                                            uint16_t const *regs,
+                                            int num_regs)
+{
+    if (num_regs < 1 || num_regs > pdu::max_write_file_record_regs)
+        return std::make_error_code(std::errc::invalid_argument);
+
+    auto const request =
+      pdu::write_file_record_request(file, record, regs, num_regs);
+    return try_transact(request,
+                        [&](uint8_t const *pdu, size_t len)
+                        {
+                            return pdu::parse_write_file_record_response(
+                              request, pdu, len);
+                        });
+}
+
+template <class Transport>
+void
+AsioSlave<Transport>::write_holding_register(int address, uint16_t value)
+{
+    transact(pdu::write_single_register_request(address, value),
+             [](uint8_t const *pdu, size_t len)
+             {
+                 return pdu::parse_write_response(
+                   pdu::function::write_single_register, pdu, len);
+             },
+             "Failed write_holding_register");
+}
+
+template <class Transport>
+void
+AsioSlave<Transport>::write_multiple_registers(
+  int address,
+  std::vector<uint16_t> const &registers)
+{
+    uint16_t const *regs = registers.data();
+    auto remaining       = static_cast<int>(registers.size());
+
+    while (remaining)
+    {
+        auto const chunk = std::min(remaining, MODBUS_MAX_WRITE_REGISTERS);
+        write_multiple_registers(address, regs, chunk);
+
+        address += chunk;
+        regs += chunk;
+        remaining -= chunk;
+    }
+}
+
+template <class Transport>
+void
+AsioSlave<Transport>::write_multiple_registers(int address,
+                                               uint16_t const *regs,
+                                               int num_regs)
+{
+    transact(pdu::write_multiple_registers_request(address, regs, num_regs),
+             [](uint8_t const *pdu, size_t len)
+             {
+                 return pdu::parse_write_response(
+                   pdu::function::write_multiple_registers, pdu, len);
+             },
+             "Failed write_multiple_registers");
+}
+
+template <class Transport>
+void
+AsioSlave<Transport>::async_read_registers(regtype type,
+                                           int address,
+                                           int num_regs,
+                                           read_handler_t const &handler)
+{
+    // The response is parsed into a buffer of the protocol's maximum size
+    if (is_bit(type) || num_regs < 1 || num_regs > MODBUS_MAX_READ_REGISTERS)
+        return handler(std::make_error_code(std::errc::invalid_argument),
+                       nullptr);
+
+    auto const fc = read_function(type);
+
+    transport_->async_transaction(
+      id(),
+      pdu::read_registers_request(fc, address, num_regs),
+      timeouts_,
+      // Small enough for std::function not to allocate
+      [&handler, fc, num_regs](
+        std::error_code const &ec, uint8_t const *pdu, size_t len)
+      {
+          uint16_t registers[MODBUS_MAX_READ_REGISTERS];
+          auto const rc =
+            ec ? ec
+               : pdu::parse_read_registers_response(
+                   fc, pdu, len, registers, num_regs);
+
+          handler(rc, rc ? nullptr : registers);
+      },
+      priority_);
+}
+
+template <class Transport>
+void
+AsioSlave<Transport>::async_read_bits(regtype type,
+                                      int address,
+                                      int num_bits,
+                                      bits_handler_t const &handler)
+{
+    if (!is_bit(type) || num_bits < 1 || num_bits > MODBUS_MAX_READ_BITS)
+        return handler(std::make_error_code(std::errc::invalid_argument),
+                       nullptr);
+
+    auto const fc = read_function(type);
+
+    transport_->async_transaction(
+      id(),
+      pdu::read_registers_request(fc, address, num_bits),
+      timeouts_,
+      [&handler, fc, num_bits](
+        std::error_code const &ec, uint8_t const *pdu, size_t len)
+      {
+          uint8_t bits[(MODBUS_MAX_READ_BITS + 7) / 8];
+          auto const rc =
+            ec ? ec
+               : pdu::parse_read_bits_response(fc, pdu, len, bits, num_bits);
+
+          handler(rc, rc ? nullptr : bits);
+      },
+      priority_);
+}
+
+template <class Transport>
+void
+AsioSlave<Transport>::async_write_holding_register(
+  int address,
+  uint16_t value,
+  write_handler_t const &handler)
+{
+    transport_->async_transaction(
+      id(),
+      pdu::write_single_register_request(address, value),
+      timeouts_,
+      [&handler](std::error_code const &ec, uint8_t const *pdu, size_t len)
+      {
+          handler(ec ? ec
+                     : pdu::parse_write_response(
+                         pdu::function::write_single_register, pdu, len));
+      },
+      priority_);
+}
+
+template class AsioSlave<AsioRTUBus>;
+template class AsioSlave<TCPConnection>;
+} // namespace modbus
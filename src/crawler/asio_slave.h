@@ -0,0 +1,100 @@
+#pragma once
+
+#include "asio_rtu.h"
+#include "asio_tcp.h"
+#include "modbus_pdu.hpp"
+#include "modbus_slave.hpp"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace modbus {
+
+// Slave model on top of one of the asio transports (AsioRTUBus or
+// TCPConnection), which only need to provide context() and
+// async_transaction()
+template <class Transport>
+class AsioSlave: public slave_concept
+{
+    std::shared_ptr<Transport> transport_;
+    latency_tracker timeouts_;
+    bool priority_;
+
+    // Drive the io_context until the transaction has completed. This is what
+    // the synchronous API does, for the one-shot operations: it must not be
+    // used from a handler running on the same io_context, see the async_
+    // functions instead. on_response(pdu, len) validates the response,
+    // returning an error if it is not the expected one
+    template <class F>
+    std::error_code try_transact(pdu::buffer_t const &request,
+                                 F &&on_response);
+
+    template <class F>
+    void transact(pdu::buffer_t const &request,
+                  F &&on_response,
+                  char const *what);
+
+public:
+    // With priority, the transactions go ahead of the other slaves' in the
+    // transport's queue
+    AsioSlave(slave_id_t server_id,
+              std::string server_name,
+              std::shared_ptr<Transport> transport,
+              latency_tracker const &timeouts,
+              bool priority = false);
+
+    std::error_code try_read_registers(regtype type,
+                                       int address,
+                                       int num_regs,
+                                       uint16_t *dest) override;
+
+    std::error_code try_read_bits(regtype type,
+                                  int address,
+                                  int num_bits,
+                                  uint8_t *dest) override;
+
+    std::error_code try_read_file_record(int file,
+                                         int record,
+                                         int num_regs,
+                                         uint16_t *dest) override;
+
+    std::error_code try_write_file_record(int file,
+                                          int record,
+                                          uint16_t const *regs,
+                                          int num_regs) override;
+
+    void write_holding_register(int address, uint16_t value) override;
+
+    void write_multiple_registers(
+      int address,
+      std::vector<uint16_t> const &registers) override;
+
+    void write_multiple_registers(int address,
+                                  uint16_t const *regs,
+                                  int num_regs) override;
+
+    void async_read_registers(regtype type,
+                              int address,
+                              int num_regs,
+                              read_handler_t const &handler) override;
+
+    void async_read_bits(regtype type,
+                         int address,
+                         int num_bits,
+                         bits_handler_t const &handler) override;
+
+    void async_write_holding_register(int address,
+                                      uint16_t value,
+                                      write_handler_t const &handler) override;
+};
+
+extern template class AsioSlave<AsioRTUBus>;
+extern template class AsioSlave<TCPConnection>;
+
+using AsioRTUSlave = AsioSlave<AsioRTUBus>;
+using TCPSlave     = AsioSlave<TCPConnection>;
+} // namespace modbus
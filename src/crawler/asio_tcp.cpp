@@ -0,0 +1,575 @@
+#include "asio_tcp.h"
+
+#include "doctest.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace modbus {
+
+TCPConnection::TCPConnection(net::io_context &ctx,
+                             std::string endpoint,
+                             int max_in_flight)
+  : ctx_(ctx)
+  , endpoint_(std::move(endpoint))
+  , max_in_flight_(std::max(max_in_flight, 1))
+  , resolver_(ctx)
+  , socket_(ctx)
+{
+    auto const colon = endpoint_.rfind(':');
+    if (colon == std::string::npos || endpoint_.back() == ']')
+    {
+        host_ = endpoint_;
+        port_ = std::to_string(MODBUS_TCP_DEFAULT_PORT);
+    }
+    else
+    {
+        host_ = endpoint_.substr(0, colon);
+        port_ = endpoint_.substr(colon + 1);
+    }
+
+    // [::1]:502 style IPv6 addresses
+    if (host_.size() > 2 && host_.front() == '[' && host_.back() == ']')
+        host_ = host_.substr(1, host_.size() - 2);
+}
+
+void
+TCPConnection::async_transaction(slave_id_t unit_id,
+                                 pdu::buffer_t const &request,
+                                 latency_tracker &timeouts,
+                                 handler_t handler,
+                                 bool priority)
+{
+    auto *const tracker = &timeouts;
+
+    net::post(
+      ctx_,
+      [this,
+       unit_id,
+       request,
+       tracker,
+       handler = std::move(handler),
+       priority]() mutable
+      {
+          // Skip the ids still in use, in the unlikely case of a wrap around
+          // while a transaction is stuck waiting for its timeout
+          while (transactions_.count(next_tid_))
+              ++next_tid_;
+          uint16_t const tid = next_tid_++;
+
+          auto &t = transactions_.try_emplace(tid, ctx_).first->second;
+
+          t.unit_id  = unit_id;
+          t.timeouts = tracker;
+          t.handler  = std::move(handler);
+          t.priority = priority;
+
+          // MBAP header: transaction id, protocol id (always 0), length of
+          // what follows, unit id
+          uint16_t const length = request.size + 1;
+          uint8_t const header[] = {static_cast<uint8_t>(tid >> 8),
+                                   static_cast<uint8_t>(tid & 0xFF),
+                                   0,
+                                   0,
+                                   static_cast<uint8_t>(length >> 8),
+                                   static_cast<uint8_t>(length & 0xFF),
+                                   static_cast<uint8_t>(unit_id)};
+
+          auto const out =
+            std::copy(std::begin(header), std::end(header), t.adu.begin());
+          std::copy_n(request.data.begin(), request.size, out);
+          t.adu_size = sizeof(header) + request.size;
+
+          t.timer.expires_after(tracker->timeout());
+          t.timer.async_wait(
+            [this, tid](auto const &ec)
+            {
+                if (ec)
+                    return;
+
+                auto const t_it = transactions_.find(tid);
+                if (t_it != transactions_.end() && t_it->second.sent)
+                    t_it->second.timeouts->on_timeout();
+                complete(tid, errc::timeout);
+            });
+
+          submit(tid);
+      });
+}
+
+void
+TCPConnection::submit(uint16_t tid)
+{
+    auto pos = waiting_.end();
+    if (transactions_.at(tid).priority)
+        pos = std::find_if(waiting_.begin(),
+                           waiting_.end(),
+                           [this](uint16_t waiting)
+                           {
+                               auto const t_it = transactions_.find(waiting);
+                               return t_it == transactions_.end() ||
+                                      !t_it->second.priority;
+                           });
+    waiting_.insert(pos, tid);
+
+    if (state_ == state_t::disconnected)
+        return connect();
+
+    send_pending();
+}
+
+void
+TCPConnection::connect()
+{
+    state_ = state_t::connecting;
+
+    resolver_.async_resolve(
+      host_,
+      port_,
+      [this, gen = generation_](auto const &ec, auto const &results)
+      {
+          if (gen != generation_)
+              return;
+          if (ec)
+              return fail_all(ec);
+
+          net::async_connect(
+            socket_,
+            results,
+            [this, gen](auto const &ec, auto const &)
+            {
+                if (gen != generation_)
+                    return;
+                if (ec)
+                    return fail_all(ec);
+
+                state_ = state_t::connected;
+
+                // Requests are small and pipelined, don't let them wait for
+                // the previous ones to be acknowledged
+                socket_.set_option(net::ip::tcp::no_delay(true));
+
+                read_header();
+                send_pending();
+            });
+      });
+}
+
+void
+TCPConnection::send_pending()
+{
+    if (state_ != state_t::connected)
+        return;
+
+    while (in_flight_ < max_in_flight_ && !waiting_.empty())
+    {
+        auto const tid = waiting_.front();
+        waiting_.pop_front();
+
+        // Timed out while waiting for a slot
+        auto const t_it = transactions_.find(tid);
+        if (t_it == transactions_.end())
+            continue;
+
+        t_it->second.sent = true;
+        ++in_flight_;
+        write_queue_.push_back(tid);
+    }
+
+    write_next();
+}
+
+void
+TCPConnection::write_next()
+{
+    if (writing_)
+        return;
+
+    while (!write_queue_.empty())
+    {
+        auto const t_it = transactions_.find(write_queue_.front());
+        write_queue_.pop_front();
+        if (t_it == transactions_.end())
+            continue;
+
+        // The frame is copied, as the transaction could time out, and be
+        // gone, while it is being written
+        auto &t = t_it->second;
+        std::copy_n(t.adu.begin(), t.adu_size, tx_.begin());
+        t.sent_at = std::chrono::steady_clock::now();
+
+        writing_ = true;
+        net::async_write(socket_,
+                         net::buffer(tx_.data(), t.adu_size),
+                         [this, gen = generation_](auto const &ec, size_t)
+                         {
+                             if (gen != generation_)
+                                 return;
+                             writing_ = false;
+                             if (ec)
+                                 return fail_all(ec);
+
+                             write_next();
+                         });
+        return;
+    }
+}
+
+void
+TCPConnection::read_header()
+{
+    net::async_read(
+      socket_,
+      net::buffer(rx_header_),
+      [this, gen = generation_](auto const &ec, size_t)
+      {
+          if (gen != generation_)
+              return;
+          if (ec)
+              return fail_all(ec);
+
+          uint16_t const tid      = pdu::detail::get_u16(&rx_header_[0]);
+          uint16_t const protocol = pdu::detail::get_u16(&rx_header_[2]);
+          uint16_t const length   = pdu::detail::get_u16(&rx_header_[4]);
+
+          // There's no way to resynchronize on the stream after a bogus
+          // header, so the connection has to be dropped
+          if (protocol != 0 || length < 2 || length > rx_pdu_.size() + 1)
+              return fail_all(errc::bad_frame);
+
+          read_body(tid, length - 1);
+      });
+}
+
+void
+TCPConnection::read_body(uint16_t tid, size_t pdu_len)
+{
+    net::async_read(socket_,
+                    net::buffer(rx_pdu_.data(), pdu_len),
+                    [this, tid, pdu_len, gen = generation_](auto const &ec,
+                                                            size_t)
+                    {
+                        if (gen != generation_)
+                            return;
+                        if (ec)
+                            return fail_all(ec);
+
+                        // Late responses to timed out requests are dropped
+                        auto const t_it = transactions_.find(tid);
+                        if (t_it != transactions_.end() && t_it->second.sent)
+                        {
+                            auto &t = t_it->second;
+                            if (rx_header_[6] != t.unit_id)
+                                complete(tid, errc::bad_slave);
+                            else
+                            {
+                                t.timeouts->on_response(
+                                  std::chrono::steady_clock::now() -
+                                  t.sent_at);
+                                complete(tid, {}, rx_pdu_.data(), pdu_len);
+                            }
+                        }
+
+                        if (gen == generation_)
+                            read_header();
+                    });
+}
+
+void
+TCPConnection::complete(uint16_t tid,
+                        std::error_code const &ec,
+                        uint8_t const *pdu,
+                        size_t len)
+{
+    auto const t_it = transactions_.find(tid);
+    if (t_it == transactions_.end())
+        return;
+
+    if (t_it->second.sent)
+        --in_flight_;
+
+    t_it->second.timer.cancel();
+    auto const handler = std::move(t_it->second.handler);
+    transactions_.erase(t_it);
+
+    handler(ec, pdu, len);
+
+    send_pending();
+}
+
+void
+TCPConnection::fail_all(std::error_code const &ec)
+{
+    ++generation_;
+    state_ = state_t::disconnected;
+
+    resolver_.cancel();
+    net_error_code ignored;
+    socket_.close(ignored);
+
+    writing_   = false;
+    in_flight_ = 0;
+    write_queue_.clear();
+    waiting_.clear();
+
+    // Handlers could submit new transactions, which will go through a new
+    // connection
+    std::vector<handler_t> handlers;
+    for (auto &t: transactions_)
+        handlers.push_back(std::move(t.second.handler));
+    transactions_.clear();
+
+    for (auto const &handler: handlers)
+        handler(ec, nullptr, 0);
+}
+} // namespace modbus
+
+namespace {
+using namespace std::chrono_literals;
+namespace net = modbus::net;
+
+// The device end of the connection, taking the requests as they come and
+// answering them in whatever order the test decides, with their own PDU
+class fake_tcp_device
+{
+    net::ip::tcp::acceptor acceptor_;
+    net::ip::tcp::socket socket_;
+    std::array<uint8_t, MODBUS_TCP_MAX_ADU_LENGTH> rx_;
+
+    void read()
+    {
+        net::async_read(
+          socket_,
+          net::buffer(rx_.data(), 7),
+          [this](auto const &ec, size_t)
+          {
+              if (ec)
+                  return;
+
+              size_t const len = modbus::pdu::detail::get_u16(&rx_[4]);
+              net::async_read(socket_,
+                              net::buffer(rx_.data() + 7, len - 1),
+                              [this, len](auto const &ec, size_t)
+                              {
+                                  if (ec)
+                                      return;
+                                  requests.emplace_back(rx_.begin(),
+                                                        rx_.begin() + 6 + len);
+                                  read();
+                              });
+          });
+    }
+
+public:
+    // The ADUs received, across connections
+    std::vector<std::vector<uint8_t>> requests;
+
+    explicit fake_tcp_device(net::io_context &ctx)
+      : acceptor_(ctx, {net::ip::make_address("127.0.0.1"), 0}), socket_(ctx)
+    {
+        accept();
+    }
+
+    [[nodiscard]] std::string endpoint() const
+    {
+        return "127.0.0.1:" + std::to_string(acceptor_.local_endpoint().port());
+    }
+
+    void accept()
+    {
+        acceptor_.async_accept(socket_,
+                               [this](auto const &ec)
+                               {
+                                   if (!ec)
+                                       read();
+                               });
+    }
+
+    // Echo the request's PDU back, from the given unit id if any
+    void respond(size_t request, int unit_id = -1)
+    {
+        auto const adu =
+          std::make_shared<std::vector<uint8_t>>(requests.at(request));
+        if (unit_id >= 0)
+            (*adu)[6] = static_cast<uint8_t>(unit_id);
+        net::async_write(
+          socket_, net::buffer(*adu), [adu](auto const &, size_t) {});
+    }
+
+    void drop()
+    {
+        modbus::net_error_code ignored;
+        socket_.close(ignored);
+        accept();
+    }
+};
+
+struct outcome_t
+{
+    int calls = 0;
+    std::error_code ec;
+    // Of the request echoed back
+    int address = -1;
+};
+
+// Run ctx until done, or give up after a while
+void
+run_until(net::io_context &ctx, std::function<bool()> const &done)
+{
+    auto const deadline = std::chrono::steady_clock::now() + 5s;
+    while (!done() && std::chrono::steady_clock::now() < deadline)
+    {
+        if (ctx.stopped())
+            ctx.restart();
+        ctx.run_one_for(10ms);
+    }
+}
+
+void
+run_for(net::io_context &ctx, std::chrono::milliseconds duration)
+{
+    auto const deadline = std::chrono::steady_clock::now() + duration;
+    run_until(ctx,
+              [deadline]
+              { return std::chrono::steady_clock::now() > deadline; });
+}
+
+// A read of the register at address, the response being the request echoed
+void
+read_register(modbus::TCPConnection &connection,
+              modbus::latency_tracker &timeouts,
+              int address,
+              outcome_t &outcome,
+              bool priority = false)
+{
+    connection.async_transaction(
+      1,
+      modbus::pdu::read_registers_request(
+        modbus::pdu::function::read_holding_registers, address, 1),
+      timeouts,
+      [&outcome](std::error_code const &ec, uint8_t const *pdu, size_t)
+      {
+          ++outcome.calls;
+          outcome.ec = ec;
+          if (!ec)
+              outcome.address = modbus::pdu::detail::get_u16(pdu + 1);
+      },
+      priority);
+}
+} // namespace
+
+TEST_CASE("TCP responses are matched to their requests by transaction id")
+{
+    net::io_context ctx;
+    fake_tcp_device device(ctx);
+    modbus::TCPConnection connection(ctx, device.endpoint(), 2);
+    modbus::latency_tracker timeouts(2000ms);
+
+    outcome_t a, b, c;
+    read_register(connection, timeouts, 10, a);
+    read_register(connection, timeouts, 20, b);
+    read_register(connection, timeouts, 30, c);
+
+    // Only max_in_flight requests are outstanding
+    run_until(ctx, [&] { return device.requests.size() == 2; });
+    run_for(ctx, 50ms);
+    REQUIRE(device.requests.size() == 2);
+
+    device.respond(1);
+    run_until(ctx, [&] { return b.calls != 0; });
+    CHECK(b.calls == 1);
+    CHECK(!b.ec);
+    CHECK(b.address == 20);
+    CHECK(a.calls == 0);
+
+    // The slot freed goes to the third one
+    run_until(ctx, [&] { return device.requests.size() == 3; });
+    device.respond(2, 9);
+    device.respond(0);
+    run_until(ctx, [&] { return a.calls != 0 && c.calls != 0; });
+    CHECK(!a.ec);
+    CHECK(a.address == 10);
+    CHECK(c.ec == modbus::errc::bad_slave);
+}
+
+TEST_CASE("TCP priority transactions wait ahead of the regular ones")
+{
+    net::io_context ctx;
+    fake_tcp_device device(ctx);
+    modbus::TCPConnection connection(ctx, device.endpoint(), 1);
+    modbus::latency_tracker timeouts(2000ms);
+
+    outcome_t a, b, c;
+    read_register(connection, timeouts, 10, a);
+    run_until(ctx, [&] { return device.requests.size() == 1; });
+    read_register(connection, timeouts, 20, b);
+    read_register(connection, timeouts, 30, c, true);
+
+    for (size_t i = 0; i != 3; ++i)
+    {
+        run_until(ctx, [&] { return device.requests.size() == i + 1; });
+        device.respond(i);
+    }
+    run_until(ctx, [&] { return b.calls != 0; });
+
+    REQUIRE(device.requests.size() == 3);
+    CHECK(modbus::pdu::detail::get_u16(&device.requests[1][8]) == 30);
+    CHECK(c.address == 30);
+    CHECK(b.address == 20);
+}
+
+TEST_CASE("TCP transactions time out, their late responses being dropped")
+{
+    net::io_context ctx;
+    fake_tcp_device device(ctx);
+    modbus::TCPConnection connection(ctx, device.endpoint());
+    modbus::latency_tracker timeouts(100ms);
+
+    outcome_t a, b;
+    read_register(connection, timeouts, 10, a);
+    run_until(ctx, [&] { return a.calls != 0; });
+    CHECK(a.ec == modbus::errc::timeout);
+    REQUIRE(device.requests.size() == 1);
+
+    device.respond(0);
+    read_register(connection, timeouts, 20, b);
+    run_until(ctx, [&] { return device.requests.size() == 2; });
+    device.respond(1);
+    run_until(ctx, [&] { return b.calls != 0; });
+
+    CHECK(a.calls == 1);
+    CHECK(!b.ec);
+    CHECK(b.address == 20);
+}
+
+TEST_CASE("TCP transactions fail with the connection, the next ones reconnect")
+{
+    net::io_context ctx;
+    fake_tcp_device device(ctx);
+    modbus::TCPConnection connection(ctx, device.endpoint());
+    modbus::latency_tracker timeouts(2000ms);
+
+    outcome_t a, b, c;
+    read_register(connection, timeouts, 10, a);
+    read_register(connection, timeouts, 20, b);
+    run_until(ctx, [&] { return device.requests.size() == 2; });
+
+    device.drop();
+    run_until(ctx, [&] { return a.calls != 0 && b.calls != 0; });
+    CHECK(a.ec);
+    CHECK(a.ec != modbus::errc::timeout);
+    CHECK(b.ec == a.ec);
+
+    // Whatever the handlers of the previous connection still had pending is
+    // discarded, and doesn't disturb the new one
+    read_register(connection, timeouts, 30, c);
+    run_until(ctx, [&] { return device.requests.size() == 3; });
+    device.respond(2);
+    run_until(ctx, [&] { return c.calls != 0; });
+    CHECK(c.calls == 1);
+    CHECK(!c.ec);
+    CHECK(c.address == 30);
+    CHECK(a.calls == 1);
+    CHECK(b.calls == 1);
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "asio_net.h"
+#include "latency_tracker.hpp"
+#include "modbus_pdu.hpp"
+#include "modbus_types.hpp"
+
+#include <array>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <system_error>
+
+namespace modbus {
+
+// Persistent Modbus TCP connection to a single endpoint (a device or a
+// gateway), shared by all the unit ids behind it. Requests are pipelined:
+// up to max_in_flight transactions are outstanding at any time, responses
+// being matched to their request by MBAP transaction id, so that polling
+// many devices is bound by throughput rather than round trip time.
+// The connection is (re)established on demand, all the outstanding
+// transactions failing with the connection error when it drops.
+class TCPConnection
+{
+public:
+    // On success, pdu points to the response PDU (function code first),
+    // valid only for the duration of the handler invocation
+    using handler_t = std::function<
+      void(std::error_code const &ec, uint8_t const *pdu, size_t len)>;
+
+    // endpoint as "host:port", the port defaulting to 502 when missing
+    TCPConnection(net::io_context &ctx,
+                  std::string endpoint,
+                  int max_in_flight = 8);
+
+    TCPConnection(TCPConnection const &) = delete;
+    TCPConnection &operator=(TCPConnection const &) = delete;
+
+    [[nodiscard]] net::io_context &context() noexcept { return ctx_; }
+    [[nodiscard]] std::string const &endpoint() const noexcept
+    {
+        return endpoint_;
+    }
+
+    // Can be called from any thread, the handler is always invoked by the
+    // thread running the io_context. The timeout covers the whole
+    // transaction, including the time spent waiting for a free slot and for
+    // the connection to be established. The timeout is taken from, and the
+    // response time reported to, the slave's latency tracker, which must
+    // outlive the transaction. A priority transaction waits for a free slot
+    // ahead of the regular ones
+    void async_transaction(slave_id_t unit_id,
+                           pdu::buffer_t const &request,
+                           latency_tracker &timeouts,
+                           handler_t handler,
+                           bool priority = false);
+
+private:
+    struct transaction_t
+    {
+        explicit transaction_t(net::io_context &ctx) : timer(ctx) {}
+
+        slave_id_t unit_id;
+        std::array<uint8_t, MODBUS_TCP_MAX_ADU_LENGTH> adu;
+        size_t adu_size;
+        bool sent     = false;
+        bool priority = false;
+        std::chrono::steady_clock::time_point sent_at;
+        latency_tracker *timeouts;
+        handler_t handler;
+        net::steady_timer timer;
+    };
+
+    enum class state_t
+    {
+        disconnected,
+        connecting,
+        connected
+    };
+
+    void submit(uint16_t tid);
+    void connect();
+    void send_pending();
+    void write_next();
+    void read_header();
+    void read_body(uint16_t tid, size_t pdu_len);
+    void complete(uint16_t tid,
+                  std::error_code const &ec,
+                  uint8_t const *pdu = nullptr,
+                  size_t len         = 0);
+    void fail_all(std::error_code const &ec);
+
+    net::io_context &ctx_;
+    std::string const endpoint_;
+    std::string host_;
+    std::string port_;
+    int const max_in_flight_;
+
+    net::ip::tcp::resolver resolver_;
+    net::ip::tcp::socket socket_;
+    state_t state_ = state_t::disconnected;
+    // Bumped at each disconnection, so that late handlers of operations on
+    // a previous connection can be discarded
+    unsigned long generation_ = 0;
+
+    uint16_t next_tid_ = 0;
+    std::map<uint16_t, transaction_t> transactions_;
+    // Transactions waiting for a free slot, in order of submission, the
+    // priority ones first
+    std::deque<uint16_t> waiting_;
+    // Transactions sent, or about to be, and not yet answered
+    int in_flight_ = 0;
+
+    std::deque<uint16_t> write_queue_;
+    bool writing_ = false;
+    std::array<uint8_t, MODBUS_TCP_MAX_ADU_LENGTH> tx_;
+
+    std::array<uint8_t, 7> rx_header_;
+    std::array<uint8_t, MODBUS_MAX_PDU_LENGTH> rx_pdu_;
+};
+} // namespace modbus
@@ -0,0 +1,110 @@
+#include "circuit_breaker.h"
+
+#include "doctest.h"
+
+#include <algorithm>
+
+namespace infra {
+
+circuit_breaker::circuit_breaker(unsigned failure_threshold,
+                                 std::chrono::seconds initial_backoff,
+                                 std::chrono::seconds max_backoff)
+  : failure_threshold_(failure_threshold)
+  , initial_backoff_(std::max(initial_backoff, std::chrono::seconds(1)))
+  , max_backoff_(std::max(max_backoff, initial_backoff_))
+{}
+
+bool
+circuit_breaker::allow(clock_type::time_point now)
+{
+    switch (state_)
+    {
+    case state_t::closed:
+        return true;
+    case state_t::open:
+        if (now < retry_at_)
+            return false;
+        state_   = state_t::half_open;
+        probing_ = false;
+        [[fallthrough]];
+    case state_t::half_open:
+        if (probing_)
+            return false;
+        probing_ = true;
+        return true;
+    }
+
+    return true;
+}
+
+void
+circuit_breaker::on_success()
+{
+    state_                = state_t::closed;
+    consecutive_failures_ = 0;
+    backoff_              = initial_backoff_;
+    probing_              = false;
+}
+
+void
+circuit_breaker::on_failure(clock_type::time_point now)
+{
+    if (!failure_threshold_)
+        return;
+
+    switch (state_)
+    {
+    case state_t::closed:
+        if (++consecutive_failures_ < failure_threshold_)
+            return;
+        break;
+    case state_t::half_open:
+        backoff_ = std::min(backoff_ * 2, max_backoff_);
+        break;
+    case state_t::open:
+        // Outcome of a request issued before the breaker opened
+        return;
+    }
+
+    state_    = state_t::open;
+    retry_at_ = now + backoff_;
+    probing_  = false;
+}
+} // namespace infra
+
+TEST_CASE("circuit breaker backs off exponentially")
+{
+    using namespace std::chrono_literals;
+    using infra::circuit_breaker;
+
+    circuit_breaker breaker(3, 10s, 30s);
+    auto now = circuit_breaker::clock_type::now();
+
+    for (int i = 0; i != 3; ++i)
+    {
+        CHECK(breaker.allow(now));
+        breaker.on_failure(now);
+    }
+    CHECK(breaker.state() == circuit_breaker::state_t::open);
+    CHECK(!breaker.allow(now + 9s));
+
+    // A single probe, failing
+    now += 10s;
+    CHECK(breaker.allow(now));
+    CHECK(!breaker.allow(now));
+    breaker.on_failure(now);
+    CHECK(breaker.backoff() == 20s);
+    CHECK(!breaker.allow(now + 19s));
+
+    now += 20s;
+    CHECK(breaker.allow(now));
+    breaker.on_failure(now);
+    CHECK(breaker.backoff() == 30s);
+
+    now += 30s;
+    CHECK(breaker.allow(now));
+    breaker.on_success();
+    CHECK(breaker.state() == circuit_breaker::state_t::closed);
+    CHECK(breaker.backoff() == 10s);
+    CHECK(breaker.allow(now));
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+
+namespace infra {
+
+// Per-slave health state machine. While closed, every poll goes through.
+// After failure_threshold consecutive failures the breaker opens and the
+// slave is left alone for a backoff period, then a single probe is let
+// through (half-open): a success closes the breaker again, a failure
+// reopens it with a doubled backoff, up to max_backoff
+class circuit_breaker
+{
+public:
+    using clock_type = std::chrono::steady_clock;
+
+    enum class state_t
+    {
+        closed,
+        open,
+        half_open,
+    };
+
+    // A failure_threshold of 0 disables the breaker, which stays closed
+    circuit_breaker(unsigned failure_threshold,
+                    std::chrono::seconds initial_backoff,
+                    std::chrono::seconds max_backoff);
+
+    // Whether the slave should be polled now. In half-open state only the
+    // first caller gets to probe the slave, until its outcome is known
+    [[nodiscard]] bool allow(clock_type::time_point now);
+
+    void on_success();
+    void on_failure(clock_type::time_point now);
+
+    [[nodiscard]] state_t state() const noexcept { return state_; }
+    [[nodiscard]] std::chrono::seconds backoff() const noexcept
+    {
+        return backoff_;
+    }
+
+private:
+    unsigned const failure_threshold_;
+    std::chrono::seconds const initial_backoff_;
+    std::chrono::seconds const max_backoff_;
+
+    clock_type::time_point retry_at_;
+    state_t state_                 = state_t::closed;
+    unsigned consecutive_failures_ = 0;
+    std::chrono::seconds backoff_  = initial_backoff_;
+    bool probing_                  = false;
+};
+} // namespace infra
@@ -0,0 +1,492 @@
+#include "column_decoder.h"
+
+#include "doctest.h"
+#include "meas_decoder.h"
+#include "modbus_decode.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <utility>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#    define COLUMN_DECODER_X86
+#    include <immintrin.h>
+#    define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace measure {
+namespace {
+    using modbus::value_type;
+    using modbus::word_endianess;
+    using SampleType = Reporter::SampleType;
+
+    constexpr double nan = std::numeric_limits<double>::quiet_NaN();
+
+    // Scalar decoding of the values from first on, i.e. the whole column or
+    // the tail the vectorized loops leave over
+    template <value_type VT, word_endianess E>
+    void
+    decode_tail(column_t const &column,
+                uint16_t const *regs,
+                size_t first,
+                double *measurements,
+                SampleType *sample_types)
+    {
+        constexpr size_t regsize = sizeof(modbus::value_t<VT>) / 2;
+
+        for (size_t i = first; i != column.size(); ++i)
+        {
+            auto const value =
+              static_cast<double>(modbus::decode<VT, E>(regs + i * regsize));
+
+            if (value < column.min[i])
+            {
+                measurements[i] = nan;
+                sample_types[i] = SampleType::underflow;
+            }
+            else if (value > column.max[i])
+            {
+                measurements[i] = nan;
+                sample_types[i] = SampleType::overflow;
+            }
+            else
+            {
+                measurements[i] = value * column.scale[i];
+                sample_types[i] = SampleType::regular;
+            }
+        }
+    }
+
+    template <word_endianess E>
+    void
+    decode_tail(column_t const &column,
+                uint16_t const *regs,
+                size_t first,
+                double *measurements,
+                SampleType *sample_types)
+    {
+        switch (column.value_type)
+        {
+        case value_type::INT16:
+            return decode_tail<value_type::INT16, E>(
+              column, regs, first, measurements, sample_types);
+        case value_type::UINT16:
+            return decode_tail<value_type::UINT16, E>(
+              column, regs, first, measurements, sample_types);
+        case value_type::INT32:
+            return decode_tail<value_type::INT32, E>(
+              column, regs, first, measurements, sample_types);
+        case value_type::UINT32:
+            return decode_tail<value_type::UINT32, E>(
+              column, regs, first, measurements, sample_types);
+        default:
+            assert(!"value type not supported by columns");
+        }
+    }
+
+    void
+    decode_tail(column_t const &column,
+                uint16_t const *regs,
+                size_t first,
+                double *measurements,
+                SampleType *sample_types)
+    {
+        if (column.endianess == word_endianess::little)
+            decode_tail<word_endianess::little>(
+              column, regs, first, measurements, sample_types);
+        else
+            decode_tail<word_endianess::big>(
+              column, regs, first, measurements, sample_types);
+    }
+
+    // Sample types of n values, out of the under/overflow lane masks
+    inline void
+    store_sample_types(int underflows,
+                       int overflows,
+                       size_t n,
+                       SampleType *sample_types)
+    {
+        if ((underflows | overflows) == 0)
+        {
+            std::fill_n(sample_types, n, SampleType::regular);
+            return;
+        }
+
+        for (size_t j = 0; j != n; ++j)
+            sample_types[j] = underflows >> j & 1 ? SampleType::underflow
+                              : overflows >> j & 1 ? SampleType::overflow
+                                                   : SampleType::regular;
+    }
+
+#if defined(COLUMN_DECODER_X86) && defined(__SSE2__)
+    // Check and scale 2 values
+    inline void
+    finish_sse2(__m128d values,
+                column_t const &column,
+                size_t i,
+                double *measurements,
+                SampleType *sample_types)
+    {
+        __m128d const under =
+          _mm_cmplt_pd(values, _mm_loadu_pd(&column.min[i]));
+        __m128d const over = _mm_cmpgt_pd(values, _mm_loadu_pd(&column.max[i]));
+        __m128d const out  = _mm_or_pd(under, over);
+
+        __m128d const scaled =
+          _mm_mul_pd(values, _mm_loadu_pd(&column.scale[i]));
+        _mm_storeu_pd(measurements + i,
+                      _mm_or_pd(_mm_andnot_pd(out, scaled),
+                                _mm_and_pd(out, _mm_set1_pd(nan))));
+
+        store_sample_types(
+          _mm_movemask_pd(under), _mm_movemask_pd(over), 2, sample_types + i);
+    }
+
+    // Convert the 4 int32 lanes, unsigned ones being biased by -2^31
+    inline void
+    finish_sse2(__m128i values,
+                bool biased,
+                column_t const &column,
+                size_t i,
+                double *measurements,
+                SampleType *sample_types)
+    {
+        __m128d const bias = _mm_set1_pd(biased ? 2147483648.0 : 0.0);
+
+        finish_sse2(_mm_add_pd(_mm_cvtepi32_pd(values), bias),
+                    column,
+                    i,
+                    measurements,
+                    sample_types);
+        finish_sse2(
+          _mm_add_pd(_mm_cvtepi32_pd(_mm_unpackhi_epi64(values, values)), bias),
+          column,
+          i + 2,
+          measurements,
+          sample_types);
+    }
+
+    void
+    decode_column_sse2(column_t const &column,
+                       uint16_t const *regs,
+                       double *measurements,
+                       Reporter::SampleType *sample_types)
+    {
+        bool const is_signed = modbus::value_signed(column.value_type);
+        size_t i             = 0;
+
+        if (modbus::reg_size(column.value_type) == 1)
+        {
+            // 8 values at a time, widened to int32
+            for (; i + 8 <= column.size(); i += 8)
+            {
+                __m128i const words =
+                  _mm_loadu_si128(reinterpret_cast<__m128i const *>(regs + i));
+                __m128i lo, hi;
+                if (is_signed)
+                {
+                    lo = _mm_srai_epi32(_mm_unpacklo_epi16(words, words), 16);
+                    hi = _mm_srai_epi32(_mm_unpackhi_epi16(words, words), 16);
+                }
+                else
+                {
+                    lo = _mm_unpacklo_epi16(words, _mm_setzero_si128());
+                    hi = _mm_unpackhi_epi16(words, _mm_setzero_si128());
+                }
+
+                finish_sse2(lo, false, column, i, measurements, sample_types);
+                finish_sse2(
+                  hi, false, column, i + 4, measurements, sample_types);
+            }
+        }
+        else
+        {
+            // 4 values at a time. Loading the registers as little endian
+            // int32 gives the little word order, the big one needs the
+            // words of each value to be swapped
+            bool const swap = column.endianess == word_endianess::big;
+            for (; i + 4 <= column.size(); i += 4)
+            {
+                __m128i values = _mm_loadu_si128(
+                  reinterpret_cast<__m128i const *>(regs + 2 * i));
+                if (swap)
+                    values = _mm_or_si128(_mm_slli_epi32(values, 16),
+                                          _mm_srli_epi32(values, 16));
+                if (!is_signed)
+                    values =
+                      _mm_xor_si128(values, _mm_set1_epi32(INT32_MIN));
+
+                finish_sse2(
+                  values, !is_signed, column, i, measurements, sample_types);
+            }
+        }
+
+        decode_tail(column, regs, i, measurements, sample_types);
+    }
+#endif
+
+#if defined(COLUMN_DECODER_X86)
+    // Check and scale 4 values
+    TARGET_AVX2 inline void
+    finish_avx2(__m256d values,
+                column_t const &column,
+                size_t i,
+                double *measurements,
+                SampleType *sample_types)
+    {
+        __m256d const under =
+          _mm256_cmp_pd(values, _mm256_loadu_pd(&column.min[i]), _CMP_LT_OQ);
+        __m256d const over =
+          _mm256_cmp_pd(values, _mm256_loadu_pd(&column.max[i]), _CMP_GT_OQ);
+
+        __m256d const scaled =
+          _mm256_mul_pd(values, _mm256_loadu_pd(&column.scale[i]));
+        _mm256_storeu_pd(measurements + i,
+                         _mm256_blendv_pd(scaled,
+                                          _mm256_set1_pd(nan),
+                                          _mm256_or_pd(under, over)));
+
+        store_sample_types(_mm256_movemask_pd(under),
+                           _mm256_movemask_pd(over),
+                           4,
+                           sample_types + i);
+    }
+
+    // Convert the 8 int32 lanes, unsigned ones being biased by -2^31
+    TARGET_AVX2 inline void
+    finish_avx2(__m256i values,
+                bool biased,
+                column_t const &column,
+                size_t i,
+                double *measurements,
+                SampleType *sample_types)
+    {
+        __m256d const bias = _mm256_set1_pd(biased ? 2147483648.0 : 0.0);
+
+        finish_avx2(
+          _mm256_add_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(values)),
+                        bias),
+          column,
+          i,
+          measurements,
+          sample_types);
+        finish_avx2(
+          _mm256_add_pd(
+            _mm256_cvtepi32_pd(_mm256_extracti128_si256(values, 1)), bias),
+          column,
+          i + 4,
+          measurements,
+          sample_types);
+    }
+
+    TARGET_AVX2 void
+    decode_column_avx2(column_t const &column,
+                       uint16_t const *regs,
+                       double *measurements,
+                       Reporter::SampleType *sample_types)
+    {
+        bool const is_signed = modbus::value_signed(column.value_type);
+        size_t i             = 0;
+
+        if (modbus::reg_size(column.value_type) == 1)
+        {
+            for (; i + 8 <= column.size(); i += 8)
+            {
+                __m128i const words =
+                  _mm_loadu_si128(reinterpret_cast<__m128i const *>(regs + i));
+                __m256i const values = is_signed ? _mm256_cvtepi16_epi32(words)
+                                                 : _mm256_cvtepu16_epi32(words);
+
+                finish_avx2(
+                  values, false, column, i, measurements, sample_types);
+            }
+        }
+        else
+        {
+            bool const swap = column.endianess == word_endianess::big;
+            for (; i + 8 <= column.size(); i += 8)
+            {
+                __m256i values = _mm256_loadu_si256(
+                  reinterpret_cast<__m256i const *>(regs + 2 * i));
+                if (swap)
+                    values = _mm256_or_si256(_mm256_slli_epi32(values, 16),
+                                             _mm256_srli_epi32(values, 16));
+                if (!is_signed)
+                    values =
+                      _mm256_xor_si256(values, _mm256_set1_epi32(INT32_MIN));
+
+                finish_avx2(
+                  values, !is_signed, column, i, measurements, sample_types);
+            }
+        }
+
+        decode_tail(column, regs, i, measurements, sample_types);
+    }
+#endif
+
+    using decode_column_fn = void (*)(column_t const &,
+                                      uint16_t const *,
+                                      double *,
+                                      Reporter::SampleType *);
+
+    decode_column_fn
+    select_implementation()
+    {
+#if defined(COLUMN_DECODER_X86)
+        if (__builtin_cpu_supports("avx2"))
+            return &decode_column_avx2;
+#endif
+#if defined(COLUMN_DECODER_X86) && defined(__SSE2__)
+        return &decode_column_sse2;
+#else
+        return &decode_column_scalar;
+#endif
+    }
+} // namespace
+
+void
+column_t::append(source_register_t const &source)
+{
+    assert(source.value_type == value_type &&
+           source.endianess == endianess);
+
+    scale.push_back(source.scale_factor);
+    if (modbus::value_signed(value_type))
+    {
+        min.push_back(static_cast<double>(source.min_read_value.as_signed()));
+        max.push_back(static_cast<double>(source.max_read_value.as_signed()));
+    }
+    else
+    {
+        min.push_back(
+          static_cast<double>(source.min_read_value.as_unsigned()));
+        max.push_back(
+          static_cast<double>(source.max_read_value.as_unsigned()));
+    }
+}
+
+void
+decode_column(column_t const &column,
+              uint16_t const *regs,
+              double *measurements,
+              Reporter::SampleType *sample_types)
+{
+    static decode_column_fn const implementation = select_implementation();
+
+    implementation(column, regs, measurements, sample_types);
+}
+
+void
+decode_column_scalar(column_t const &column,
+                     uint16_t const *regs,
+                     double *measurements,
+                     Reporter::SampleType *sample_types)
+{
+    decode_tail(column, regs, 0, measurements, sample_types);
+}
+} // namespace measure
+
+TEST_CASE("Columns decode as their values one by one")
+{
+    using modbus::value_type;
+    using modbus::word_endianess;
+
+    // decode_column only ever runs the widest implementation the CPU
+    // supports, so each of them is checked against the scalar one
+    std::vector<std::pair<char const *, measure::decode_column_fn>>
+      implementations{{"dispatched", &measure::decode_column}};
+#if defined(COLUMN_DECODER_X86) && defined(__SSE2__)
+    implementations.emplace_back("sse2", &measure::decode_column_sse2);
+#endif
+#if defined(COLUMN_DECODER_X86)
+    if (__builtin_cpu_supports("avx2"))
+        implementations.emplace_back("avx2", &measure::decode_column_avx2);
+#endif
+
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<uint16_t> word;
+
+    // Not a multiple of the vector sizes, to go through the tails as well
+    constexpr size_t num_values = 37;
+    std::vector<uint16_t> regs(num_values * 2);
+
+    for (auto const vt: {value_type::INT16,
+                         value_type::UINT16,
+                         value_type::INT32,
+                         value_type::UINT32})
+        for (auto const e: {word_endianess::little, word_endianess::big})
+        {
+            for (auto &r: regs)
+                r = word(gen);
+
+            measure::column_t column(vt, e);
+            std::vector<measure::sample_decoder> decoders;
+            for (size_t i = 0; i != num_values; ++i)
+            {
+                measure::source_register_t source;
+                source.value_type   = vt;
+                source.endianess    = e;
+                source.scale_factor = 0.1 * i;
+                // Tight thresholds, for some values to be out of them
+                if (modbus::value_signed(vt))
+                {
+                    source.min_read_value = -20000;
+                    source.max_read_value = 30000;
+                }
+                else
+                {
+                    source.min_read_value = 1000u;
+                    source.max_read_value = 50000u;
+                }
+
+                column.append(source);
+                decoders.emplace_back(source);
+            }
+
+            std::vector<double> measurements(num_values);
+            std::vector<measure::Reporter::SampleType> sample_types(
+              num_values);
+            measure::decode_column_scalar(
+              column, regs.data(), measurements.data(), sample_types.data());
+
+            auto const regsize = static_cast<size_t>(modbus::reg_size(vt));
+            for (size_t i = 0; i != num_values; ++i)
+            {
+                intmax_t raw;
+                double expected = std::numeric_limits<double>::quiet_NaN();
+                auto const expected_type =
+                  decoders[i](regs.data() + i * regsize, raw, expected);
+
+                INFO("value " << i << " raw " << raw);
+                CHECK(sample_types[i] == expected_type);
+                if (expected_type == measure::Reporter::SampleType::regular)
+                    CHECK(measurements[i] == expected);
+                else
+                    CHECK(std::isnan(measurements[i]));
+            }
+
+            for (auto const &[name, implementation]: implementations)
+            {
+                std::vector<double> vector_measurements(num_values);
+                std::vector<measure::Reporter::SampleType> vector_types(
+                  num_values);
+                implementation(column,
+                               regs.data(),
+                               vector_measurements.data(),
+                               vector_types.data());
+
+                for (size_t i = 0; i != num_values; ++i)
+                {
+                    INFO(name << " value " << i);
+                    CHECK(vector_types[i] == sample_types[i]);
+                    if (std::isnan(measurements[i]))
+                        CHECK(std::isnan(vector_measurements[i]));
+                    else
+                        CHECK(vector_measurements[i] == measurements[i]);
+                }
+            }
+        }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "meas_config.h"
+#include "meas_reporter.h"
+#include "modbus_types.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace measure {
+
+// A run of back to back values of the same 16 or 32 bits type and word
+// order, e.g. the many similar quantities of a meter, decoded at once.
+// Each value keeps its own scale factor and thresholds, the latter as
+// doubles, which represent exactly any value of these sizes
+struct column_t
+{
+    modbus::value_type value_type;
+    modbus::word_endianess endianess;
+    std::vector<double> scale;
+    std::vector<double> min;
+    std::vector<double> max;
+
+    column_t(modbus::value_type vt, modbus::word_endianess e)
+      : value_type(vt)
+      , endianess(e)
+    {}
+
+    // 64 bits values don't fit a double, they are left to sample_decoder,
+    // as well as bits, which aren't read as registers
+    [[nodiscard]] static bool supports(modbus::value_type vt) noexcept
+    {
+        return vt != modbus::value_type::BIT && modbus::reg_size(vt) <= 2;
+    }
+
+    // Append the value of the next registers, which must be of the
+    // column's type and word order
+    void append(source_register_t const &source);
+
+    [[nodiscard]] size_t size() const noexcept { return scale.size(); }
+};
+
+// Decode, check and scale the column's values, the first one starting at
+// regs. Values out of their thresholds get a NaN measurement. Uses AVX2 or
+// SSE2, whichever the CPU supports, and the scalar implementation otherwise
+void
+decode_column(column_t const &column,
+              uint16_t const *regs,
+              double *measurements,
+              Reporter::SampleType *sample_types);
+
+// Portable implementation, which the vectorized ones must match
+void
+decode_column_scalar(column_t const &column,
+                     uint16_t const *regs,
+                     double *measurements,
+                     Reporter::SampleType *sample_types);
+} // namespace measure
@@ -0,0 +1,523 @@
+#include "control_server.h"
+
+#include "doctest.h"
+#include "meas_decoder.h"
+#include "meas_planner.h"
+#include "modbus_ops.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdlib>
+#include <functional>
+#include <istream>
+#include <limits>
+#include <loguru.hpp>
+#include <memory>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace measure {
+namespace {
+    using clock_type = std::chrono::steady_clock;
+
+    long long latency_us(clock_type::time_point received)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                 clock_type::now() - received)
+          .count();
+    }
+
+    // A server as "<modbus id>[@<serial device | host:port>]", see
+    // server_key_t. Returns false if there's no valid modbus id
+    bool parse_server(std::string const &spec, server_key_t &key)
+    {
+        auto const at = spec.find('@');
+        auto const id = spec.substr(0, at);
+
+        char *end = nullptr;
+        long const modbus_id = std::strtol(id.c_str(), &end, 0);
+        if (id.empty() || *end != '\0')
+            return false;
+
+        key.transport =
+          at == std::string::npos ? std::string{} : spec.substr(at + 1);
+        key.modbus_id = static_cast<modbus::slave_id_t>(modbus_id);
+        return true;
+    }
+
+    // A request in progress on a server's control slave. Only the slave's
+    // asynchronous API is used, as the asio transports must not be driven
+    // from the thread the request runs on. The models without an
+    // asynchronous transport complete each operation before returning
+    class request
+    {
+    public:
+        // Called once the reply is ready, with the last reference to the
+        // request
+        using done_t = std::function<void(std::shared_ptr<request>)>;
+
+        request(modbus::slave &slave,
+                descriptor_t const &descriptor,
+                std::string line,
+                clock_type::time_point received,
+                done_t done)
+          : slave_(slave)
+          , descriptor_(descriptor)
+          , line_(std::move(line))
+          , received_(received)
+          , done_(std::move(done))
+          , on_registers_(
+              [this](std::error_code const &ec, uint16_t const *regs)
+              { on_registers(ec, regs); })
+          , on_bits_([this](std::error_code const &ec, uint8_t const *bits)
+                     { on_block(ec, nullptr, bits); })
+          , on_write_([this](std::error_code const &ec) { on_write(ec); })
+        {}
+
+        // The slave's handlers refer to this, which holds on to itself
+        // until done
+        request(request const &) = delete;
+        request &operator=(request const &) = delete;
+
+        static void start(std::shared_ptr<request> r)
+        {
+            auto &self = *r;
+            self.self_ = std::move(r);
+            self.perform();
+        }
+
+        [[nodiscard]] std::string const &reply() const noexcept
+        {
+            return reply_;
+        }
+
+    private:
+        void perform()
+        {
+            try
+            {
+                std::istringstream iss(line_);
+                std::string op;
+                std::string server;
+                iss >> op >> server;
+
+                if (op == "S")
+                {
+                    // Random slaves only know about the configured addresses
+                    auto const max_block_registers =
+                      descriptor_.server.random_source()
+                        ? 0
+                        : descriptor_.server.max_block_registers;
+                    blocks_ = plan_read_blocks(descriptor_.measures,
+                                               max_block_registers);
+                    return read_next_block();
+                }
+
+                std::string address_arg;
+                std::string arg;
+                if (!(iss >> address_arg >> arg))
+                    throw std::invalid_argument(
+                      "expected <register> <regsize> or <register> <value>");
+
+                int const address =
+                  std::strtol(address_arg.c_str(), nullptr, 0);
+                if (op == "W")
+                {
+                    intmax_t const value =
+                      std::strtoimax(arg.c_str(), nullptr, 0);
+                    if (value < 0 ||
+                        value > std::numeric_limits<uint16_t>::max())
+                        throw std::invalid_argument(
+                          "invalid value: must be [0..65535]");
+
+                    return slave_.async_write_holding_register(
+                      address, value, on_write_);
+                }
+
+                spec_ = modbus::parse_regspec(arg);
+                slave_.async_read_registers(
+                  modbus::regtype::holding,
+                  address,
+                  spec_.regsize,
+                  on_registers_);
+            }
+            catch (std::exception const &e)
+            {
+                fail(e.what());
+            }
+        }
+
+        void on_registers(std::error_code const &ec, uint16_t const *regs)
+        {
+            if (!blocks_.empty())
+                return on_block(ec, regs, nullptr);
+
+            if (ec)
+                return fail("Failed read_holding_registers: " + ec.message());
+
+            if (spec_.raw)
+                values_.assign(regs, regs + spec_.regsize);
+            else
+                values_.push_back(
+                  modbus::detail::to_val(regs, spec_.regsize, spec_.endianess));
+            finish();
+        }
+
+        void on_write(std::error_code const &ec)
+        {
+            if (ec)
+                return fail("Failed write_holding_register: " + ec.message());
+            finish();
+        }
+
+        // A snapshot reads all the measures of the server, in as few blocks
+        // as the polls, into "<measure>|<raw value>|<value>" lines
+        void read_next_block()
+        {
+            if (next_block_ == blocks_.size())
+                return finish();
+
+            auto const &block = blocks_[next_block_];
+            if (modbus::is_bit(block.reg_type))
+                slave_.async_read_bits(
+                  block.reg_type, block.address, block.num_regs, on_bits_);
+            else
+                slave_.async_read_registers(block.reg_type,
+                                            block.address,
+                                            block.num_regs,
+                                            on_registers_);
+        }
+
+        void on_block(std::error_code const &ec,
+                      uint16_t const *regs,
+                      uint8_t const *bits)
+        {
+            auto const &block = blocks_[next_block_++];
+            for (auto const &item: block.items)
+            {
+                lines_ << item.measure.name << '|';
+                if (ec)
+                {
+                    lines_ << "ERROR|" << ec.message() << '\n';
+                    continue;
+                }
+
+                sample_decoder const decoder(item.measure.source);
+                intmax_t raw;
+                double measurement = std::numeric_limits<double>::quiet_NaN();
+                if (bits)
+                {
+                    raw = bits[item.offset / 8] >> (item.offset % 8) & 1;
+                    decoder.evaluate(raw, measurement);
+                }
+                else
+                    decoder(regs + item.offset, raw, measurement);
+                lines_ << raw << '|' << measurement << '\n';
+            }
+
+            read_next_block();
+        }
+
+        void fail(std::string const &message)
+        {
+            reply_ = "ERROR " + std::to_string(latency_us(received_)) + " " +
+                     message + "\n";
+            complete();
+        }
+
+        void finish()
+        {
+            lines_ << "OK " << latency_us(received_);
+            for (auto const value: values_)
+                lines_ << ' ' << value;
+            lines_ << '\n';
+            reply_ = lines_.str();
+            complete();
+        }
+
+        // Nothing of this is touched past handing the last reference over
+        void complete()
+        {
+            auto const done = std::move(done_);
+            done(std::move(self_));
+        }
+
+        modbus::slave &slave_;
+        descriptor_t const &descriptor_;
+        std::string const line_;
+        clock_type::time_point const received_;
+        done_t done_;
+        std::shared_ptr<request> self_;
+
+        modbus::regspec_t spec_{};
+        std::vector<intmax_t> values_;
+        std::vector<read_block_t> blocks_;
+        size_t next_block_ = 0;
+        std::ostringstream lines_;
+        std::string reply_;
+
+        // The slave takes its handlers by reference
+        modbus::slave_concept::read_handler_t const on_registers_;
+        modbus::slave_concept::bits_handler_t const on_bits_;
+        modbus::slave_concept::write_handler_t const on_write_;
+    };
+} // namespace
+
+// A client connection, taking one request at a time
+class ControlServer::session: public std::enable_shared_from_this<session>
+{
+    modbus::net::local::stream_protocol::socket socket_;
+    Executor &executor_;
+    modbus::net::streambuf buffer_;
+    std::string reply_;
+
+public:
+    session(modbus::net::local::stream_protocol::socket socket,
+            Executor &executor)
+      : socket_(std::move(socket))
+      , executor_(executor)
+    {}
+
+    void read()
+    {
+        modbus::net::async_read_until(
+          socket_,
+          buffer_,
+          '\n',
+          [self = shared_from_this()](auto const &ec, size_t)
+          {
+              if (ec)
+                  return;
+
+              std::istream is(&self->buffer_);
+              std::string line;
+              std::getline(is, line);
+              self->handle(line);
+          });
+    }
+
+private:
+    void handle(std::string const &line)
+    {
+        auto const received = clock_type::now();
+
+        std::istringstream iss(line);
+        std::string op;
+        std::string server;
+        server_key_t key;
+        if (!(iss >> op))
+            return read();
+
+        LOG_S(INFO) << "CONTROL|" << line;
+
+        if (!(iss >> server) || !parse_server(server, key) ||
+            (op != "R" && op != "W" && op != "S"))
+            return write("ERROR 0 expected R, W or S <server> ...\n");
+
+        // The reply is written back by the thread servicing the socket
+        auto const queued = executor_.control(
+          key,
+          [self = shared_from_this(), line, received](
+            modbus::slave &slave, descriptor_t const &descriptor)
+          {
+              request::start(std::make_shared<request>(
+                slave,
+                descriptor,
+                line,
+                received,
+                [self](std::shared_ptr<request> r)
+                {
+                    modbus::net::post(self->socket_.get_executor(),
+                                      [self, r = std::move(r)]
+                                      { self->write(r->reply()); });
+                }));
+          });
+
+        if (!queued)
+            write("ERROR 0 unknown or ambiguous server " + server + "\n");
+    }
+
+    void write(std::string reply)
+    {
+        reply_ = std::move(reply);
+        modbus::net::async_write(socket_,
+                                 modbus::net::buffer(reply_),
+                                 [self = shared_from_this()](auto const &ec,
+                                                             size_t)
+                                 {
+                                     if (!ec)
+                                         self->read();
+                                 });
+    }
+};
+
+ControlServer::ControlServer(modbus::net::io_context &ctx,
+                             std::string path,
+                             Executor &executor)
+  : path_(std::move(path))
+  , executor_(executor)
+  , acceptor_(ctx)
+{
+    // Only a socket left behind by a previous run is ours to remove
+    struct stat st;
+    if (::lstat(path_.c_str(), &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+            throw std::runtime_error("control socket path " + path_ +
+                                     " exists and is not a socket");
+        ::unlink(path_.c_str());
+    }
+    else if (errno != ENOENT)
+        throw std::system_error(
+          errno, std::generic_category(), "control socket path " + path_);
+
+    modbus::net::local::stream_protocol::endpoint const endpoint(path_);
+    acceptor_.open(endpoint.protocol());
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+
+    LOG_S(INFO) << "Control socket listening on " << path_;
+    accept();
+}
+
+ControlServer::~ControlServer()
+{
+    modbus::net_error_code ignored;
+    acceptor_.close(ignored);
+    ::unlink(path_.c_str());
+}
+
+void
+ControlServer::accept()
+{
+    acceptor_.async_accept(
+      [this](auto const &ec, modbus::net::local::stream_protocol::socket socket)
+      {
+          if (ec)
+              return;
+
+          std::make_shared<session>(std::move(socket), executor_)->read();
+          accept();
+      });
+}
+} // namespace measure
+
+namespace {
+// Registers hold their address, from 100 onwards there are none
+class FakeControlDevice: public modbus::slave_concept
+{
+    std::vector<uint16_t> &regs_;
+
+public:
+    explicit FakeControlDevice(std::vector<uint16_t> &regs)
+      : slave_concept(1, "fake"), regs_(regs)
+    {}
+
+    std::error_code try_read_registers(modbus::regtype,
+                                       int address,
+                                       int num_regs,
+                                       uint16_t *dest) override
+    {
+        if (address + num_regs > static_cast<int>(regs_.size()))
+            return modbus::errc::illegal_data_address;
+        std::copy_n(regs_.begin() + address, num_regs, dest);
+        return {};
+    }
+
+    void write_holding_register(int address, uint16_t value) override
+    {
+        if (address >= static_cast<int>(regs_.size()))
+            throw std::system_error(modbus::errc::illegal_data_address);
+        regs_[address] = value;
+    }
+};
+} // namespace
+
+TEST_CASE("Control requests reply with their values or their error")
+{
+    std::vector<uint16_t> regs(100);
+    for (size_t i = 0; i != regs.size(); ++i)
+        regs[i] = static_cast<uint16_t>(i);
+    modbus::slave s(modbus::slave::model_type<FakeControlDevice>{}, regs);
+
+    measure::descriptor_t descriptor;
+    for (auto const address: {10, 150})
+    {
+        measure::measure_t m;
+        m.name              = "m" + std::to_string(address);
+        m.source.address    = address;
+        m.source.endianess  = modbus::word_endianess::big;
+        m.source.reg_type   = modbus::regtype::holding;
+        m.source.value_type = modbus::value_type::UINT32;
+        m.source.min_read_value.assign_min(m.source.value_type);
+        m.source.max_read_value.assign_max(m.source.value_type);
+        descriptor.measures.push_back(m);
+    }
+
+    // The reply, without its latency
+    auto const perform = [&](std::string const &line)
+    {
+        std::string reply;
+        measure::request::start(std::make_shared<measure::request>(
+          s,
+          descriptor,
+          line,
+          measure::clock_type::now(),
+          [&](std::shared_ptr<measure::request> r) { reply = r->reply(); }));
+        return std::regex_replace(reply, std::regex("(OK|ERROR) [0-9]+"), "$1");
+    };
+
+    CHECK(perform("R 1 10 1b") == "OK 10\n");
+    CHECK(perform("R 1 10 2b") == "OK 655371\n");
+    CHECK(perform("R 1 10 2l") == "OK 720906\n");
+    CHECK(perform("R 1 0x10 3r") == "OK 16 17 18\n");
+    CHECK(perform("R 1 99 2b") ==
+          "ERROR Failed read_holding_registers: Illegal data address\n");
+
+    CHECK(perform("W 1 20 0xABCD") == "OK\n");
+    CHECK(regs[20] == 0xABCD);
+    CHECK(perform("W 1 100 1") ==
+          "ERROR Failed write_holding_register: Illegal data address\n");
+
+    CHECK(perform("S 1") == "m10|655371|655371\n"
+                            "m150|ERROR|Illegal data address\n"
+                            "OK\n");
+
+    CHECK(perform("W 1 20 65536") ==
+          "ERROR invalid value: must be [0..65535]\n");
+    CHECK(perform("W 1 20 -1") == "ERROR invalid value: must be [0..65535]\n");
+    CHECK(perform("W 1 20") ==
+          "ERROR expected <register> <regsize> or <register> <value>\n");
+    CHECK(perform("R 1") ==
+          "ERROR expected <register> <regsize> or <register> <value>\n");
+    CHECK(perform("R 1 10 3b") == "ERROR regsize must be 1, 2 or 4\n");
+    CHECK(perform("R 1 10 x") == "ERROR invalid regsize specification: x\n");
+    CHECK(regs[20] == 0xABCD);
+}
+
+TEST_CASE("Control requests designate servers by modbus id and transport")
+{
+    measure::server_key_t key;
+
+    REQUIRE(measure::parse_server("3", key));
+    CHECK(key.modbus_id == 3);
+    CHECK(key.transport.empty());
+
+    REQUIRE(measure::parse_server("0x10@/dev/ttyUSB1", key));
+    CHECK(key.modbus_id == 16);
+    CHECK(key.transport == "/dev/ttyUSB1");
+
+    REQUIRE(measure::parse_server("1@10.0.0.2:502", key));
+    CHECK(key.transport == "10.0.0.2:502");
+
+    CHECK(!measure::parse_server("", key));
+    CHECK(!measure::parse_server("@/dev/ttyUSB1", key));
+    CHECK(!measure::parse_server("x@/dev/ttyUSB1", key));
+}
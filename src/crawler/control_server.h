@@ -0,0 +1,44 @@
+#pragma once
+
+#include "asio_net.h"
+#include "meas_executor.h"
+
+#include <string>
+
+namespace measure {
+
+// Local UNIX socket taking reads, writes and snapshots while the servers
+// are being polled, one request per line:
+//     R <server> <register> <regsize ={{1|2|4}{l|b} | Nr}>
+//     W <server> <register> <value [0..65535]>
+//     S <server>
+// with <server> as <modbus id>[@<serial device | host:port>], the modbus id
+// alone being enough when no other transport has a server with it. Each
+// request gets an "OK <latency us> <value>..." or an "ERROR <latency
+// us> <message>" line in reply. A snapshot reads all the measures of the
+// server right away, replying with a "<measure>|<raw value>|<value>" line
+// per measure before the OK one. Requests go through the executor's control
+// slaves, ahead of the polls waiting for the same bus
+class ControlServer
+{
+public:
+    // Serviced by the thread running ctx. A stale socket file at path is
+    // replaced, anything else there is left alone and throws
+    ControlServer(modbus::net::io_context &ctx,
+                  std::string path,
+                  Executor &executor);
+    ~ControlServer();
+
+    ControlServer(ControlServer const &) = delete;
+    ControlServer &operator=(ControlServer const &) = delete;
+
+private:
+    class session;
+
+    void accept();
+
+    std::string const path_;
+    Executor &executor_;
+    modbus::net::local::stream_protocol::acceptor acceptor_;
+};
+} // namespace measure
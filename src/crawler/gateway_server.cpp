@@ -0,0 +1,264 @@
+#include "gateway_server.h"
+
+#include "modbus_pdu.hpp"
+
+#include "doctest.h"
+
+#include <array>
+#include <loguru.hpp>
+#include <memory>
+#include <utility>
+
+namespace measure {
+namespace {
+    namespace pdu = modbus::pdu;
+    using modbus::errc;
+
+    // Transaction id, protocol id, length and unit id
+    size_t constexpr mbap_size = 7;
+
+    pdu::buffer_t exception_response(uint8_t fc, errc code)
+    {
+        pdu::buffer_t rsp;
+        rsp.push_u8(fc | pdu::exception_flag);
+        rsp.push_u8(static_cast<uint8_t>(code));
+        return rsp;
+    }
+
+    // The response to a request for the given unit, out of the image
+    pdu::buffer_t answer(modbus::register_image const &image,
+                         GatewayServer::view v,
+                         modbus::slave_id_t unit,
+                         uint8_t const *req,
+                         size_t len,
+                         modbus::register_image::clock_type::time_point now)
+    {
+        uint8_t const fc = req[0];
+
+        modbus::regtype type;
+        switch (static_cast<pdu::function>(fc))
+        {
+        case pdu::function::read_coils:
+            type = modbus::regtype::coil;
+            break;
+        case pdu::function::read_discrete_inputs:
+            type = modbus::regtype::discrete_input;
+            break;
+        case pdu::function::read_holding_registers:
+            type = modbus::regtype::holding;
+            break;
+        case pdu::function::read_input_registers:
+            type = modbus::regtype::input;
+            break;
+        default:
+            return exception_response(fc, errc::illegal_function);
+        }
+
+        bool const bits = modbus::is_bit(type);
+        bool const ages = v == GatewayServer::view::ages;
+        if (bits && ages)
+            return exception_response(fc, errc::illegal_function);
+
+        if (len != 5)
+            return exception_response(fc, errc::illegal_data_value);
+
+        int const address = pdu::detail::get_u16(req + 1);
+        int const num     = pdu::detail::get_u16(req + 3);
+        if (num < 1 ||
+            num > (bits ? MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS))
+            return exception_response(fc, errc::illegal_data_value);
+        if (address + num > 0x10000)
+            return exception_response(fc, errc::illegal_data_address);
+
+        uint16_t values[MODBUS_MAX_READ_BITS];
+        uint16_t read_ages[MODBUS_MAX_READ_REGISTERS];
+        if (auto const ec = image.read(unit,
+                                       type,
+                                       address,
+                                       num,
+                                       now,
+                                       values,
+                                       ages ? read_ages : nullptr))
+            return exception_response(fc, static_cast<errc>(ec.value()));
+
+        pdu::buffer_t rsp;
+        rsp.push_u8(fc);
+        if (bits)
+        {
+            rsp.push_u8((num + 7) / 8);
+            for (int i = 0; i < num; i += 8)
+            {
+                uint8_t byte = 0;
+                for (int b = 0; b != 8 && i + b != num; ++b)
+                    byte |= values[i + b] << b;
+                rsp.push_u8(byte);
+            }
+        }
+        else
+        {
+            rsp.push_u8(num * 2);
+            for (int i = 0; i != num; ++i)
+                rsp.push_u16(ages ? read_ages[i] : values[i]);
+        }
+        return rsp;
+    }
+} // namespace
+
+// A master's connection, answering its requests one at a time
+class GatewayServer::session: public std::enable_shared_from_this<session>
+{
+    modbus::net::ip::tcp::socket socket_;
+    modbus::register_image const &image_;
+    view const view_;
+    std::array<uint8_t, MODBUS_TCP_MAX_ADU_LENGTH> adu_;
+
+public:
+    session(modbus::net::ip::tcp::socket socket,
+            modbus::register_image const &image,
+            view v)
+      : socket_(std::move(socket))
+      , image_(image)
+      , view_(v)
+    {}
+
+    void read_header()
+    {
+        modbus::net::async_read(
+          socket_,
+          modbus::net::buffer(adu_.data(), mbap_size),
+          [self = shared_from_this()](auto const &ec, size_t)
+          {
+              if (ec)
+                  return;
+
+              uint16_t const protocol = pdu::detail::get_u16(&self->adu_[2]);
+              uint16_t const length   = pdu::detail::get_u16(&self->adu_[4]);
+
+              // No way to resynchronize on the stream after a bogus header
+              if (protocol != 0 || length < 2 ||
+                  length > self->adu_.size() - mbap_size + 1)
+              {
+                  LOG_S(WARNING) << "GATEWAY|bad MBAP header, disconnecting";
+                  return;
+              }
+
+              self->read_pdu(length - 1);
+          });
+    }
+
+private:
+    void read_pdu(size_t len)
+    {
+        modbus::net::async_read(
+          socket_,
+          modbus::net::buffer(adu_.data() + mbap_size, len),
+          [self = shared_from_this(), len](auto const &ec, size_t)
+          {
+              if (!ec)
+                  self->respond(len);
+          });
+    }
+
+    // Transaction id, protocol id and unit id are echoed
+    void respond(size_t len)
+    {
+        auto const rsp =
+          answer(image_,
+                 view_,
+                 adu_[6],
+                 adu_.data() + mbap_size,
+                 len,
+                 modbus::register_image::clock_type::now());
+
+        uint16_t const length = rsp.size + 1;
+        adu_[4]               = length >> 8;
+        adu_[5]               = length & 0xFF;
+        std::copy_n(rsp.data.begin(), rsp.size, adu_.begin() + mbap_size);
+
+        modbus::net::async_write(
+          socket_,
+          modbus::net::buffer(adu_.data(), mbap_size + rsp.size),
+          [self = shared_from_this()](auto const &ec, size_t)
+          {
+              if (!ec)
+                  self->read_header();
+          });
+    }
+};
+
+GatewayServer::GatewayServer(modbus::net::io_context &ctx,
+                             unsigned short port,
+                             modbus::register_image const &image,
+                             view v)
+  : image_(image)
+  , view_(v)
+  , acceptor_(ctx, {modbus::net::ip::tcp::v4(), port})
+{
+    LOG_S(INFO) << "Gateway serving register "
+                << (view_ == view::ages ? "ages" : "values") << " on port "
+                << port;
+    accept();
+}
+
+void
+GatewayServer::accept()
+{
+    acceptor_.async_accept(
+      [this](auto const &ec, modbus::net::ip::tcp::socket socket)
+      {
+          if (ec)
+              return;
+
+          socket.set_option(modbus::net::ip::tcp::no_delay(true));
+          std::make_shared<session>(std::move(socket), image_, view_)
+            ->read_header();
+          accept();
+      });
+}
+} // namespace measure
+
+TEST_CASE("Gateway answers out of the register image")
+{
+    using namespace std::chrono_literals;
+    using modbus::regtype;
+    using measure::GatewayServer;
+
+    modbus::register_image image;
+    auto const t0 = modbus::register_image::clock_type::now();
+
+    uint16_t const regs[] = {0x1234, 0xABCD};
+    image.add_range(7, regtype::holding, 100, 2);
+    image.store(7, regtype::holding, 100, 2, regs, t0);
+
+    uint8_t const bits[] = {0x05};
+    image.add_range(7, regtype::coil, 0, 3);
+    image.store_bits(7, regtype::coil, 0, 3, bits, t0);
+
+    auto const check = [&](GatewayServer::view v,
+                           modbus::slave_id_t unit,
+                           std::initializer_list<uint8_t> req,
+                           std::initializer_list<uint8_t> expected)
+    {
+        auto const rsp = measure::answer(
+          image, v, unit, req.begin(), req.size(), t0 + 3s);
+        CHECK(std::equal(expected.begin(),
+                         expected.end(),
+                         rsp.data.begin(),
+                         rsp.data.begin() + rsp.size));
+        CHECK(rsp.size == expected.size());
+    };
+
+    auto const values = GatewayServer::view::values;
+    auto const ages   = GatewayServer::view::ages;
+
+    check(values, 7, {0x03, 0, 100, 0, 2}, {0x03, 4, 0x12, 0x34, 0xAB, 0xCD});
+    check(ages, 7, {0x03, 0, 100, 0, 2}, {0x03, 4, 0, 3, 0, 3});
+    check(values, 7, {0x01, 0, 0, 0, 3}, {0x01, 1, 0x05});
+
+    // Not read, unknown unit, not polled, and read-only
+    check(values, 7, {0x04, 0, 100, 0, 1}, {0x84, 0x02});
+    check(values, 8, {0x03, 0, 100, 0, 1}, {0x83, 0x0A});
+    check(values, 7, {0x03, 0, 101, 0, 2}, {0x83, 0x02});
+    check(values, 7, {0x06, 0, 100, 0, 1}, {0x86, 0x01});
+    check(ages, 7, {0x01, 0, 0, 0, 3}, {0x81, 0x01});
+}
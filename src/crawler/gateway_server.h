@@ -0,0 +1,44 @@
+#pragma once
+
+#include "asio_net.h"
+#include "register_image.hpp"
+
+namespace measure {
+
+// Modbus TCP server answering from the register image instead of the
+// slaves, so that other masters can read what is being polled without any
+// more traffic on the buses. The unit id is the server's gateway_unit_id,
+// its modbus id unless configured otherwise. With view::values, the read
+// coils, discrete inputs, holding and input registers functions return the
+// values last read. With view::ages, the read holding and input registers
+// ones return instead how many seconds ago each register was read. The
+// image is read-only, any other function is answered with an illegal
+// function exception
+class GatewayServer
+{
+public:
+    enum class view
+    {
+        values,
+        ages
+    };
+
+    // Serviced by the thread running ctx
+    GatewayServer(modbus::net::io_context &ctx,
+                  unsigned short port,
+                  modbus::register_image const &image,
+                  view v = view::values);
+
+    GatewayServer(GatewayServer const &) = delete;
+    GatewayServer &operator=(GatewayServer const &) = delete;
+
+private:
+    class session;
+
+    void accept();
+
+    modbus::register_image const &image_;
+    view const view_;
+    modbus::net::ip::tcp::acceptor acceptor_;
+};
+} // namespace measure
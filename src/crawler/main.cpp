@@ -1,6 +1,8 @@
 #define DOCTEST_CONFIG_IMPLEMENT
 #define DOCTEST_CONFIG_NO_UNPREFIXED_OPTIONS
 #include "doctest.h"
+#include "control_server.h"
+#include "gateway_server.h"
 #include "meas_config.h"
 #include "meas_executor.h"
 #include "meas_reporter.h"
@@ -10,11 +12,14 @@
 
 #include <chrono>
 #include <cinttypes>
+#include <fstream>
 #include <iostream>
 #include <loguru.hpp>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <unistd.h>
+#include <vector>
 
 using namespace std::chrono_literals;
 namespace {
@@ -34,6 +39,10 @@ usage(int res, std::string const &msg = "")
                     -m <measconfig_file.json>
                     [-r <reporting period = 5min>]
                     [-o(ut folder) = /tmp]
+                    [-p(oll each serial bus on its own thread)]
+                    [-u <control socket path = "" (disabled)>]
+                    [-g <modbus TCP gateway port, ages on port + 1 = 0
+                        (disabled)>]
 
                     |
                     -R
@@ -53,6 +62,16 @@ usage(int res, std::string const &msg = "")
                     <register>
                     <value [0..65535]>
 
+                    |
+                    -X
+                    [-d <device = /dev/ttyCOM1>]
+                    [-c <line_config ="9600:8:N:1">]
+                    [-a <answering_timeout_ms =500>]
+                    [<script =stdin, an operation per line:
+                        R <server_id> <register> <regsize ={{1|2|4}{l|b} | Nr}>
+                        W <server_id> <register> <value [0..65535]>
+                    >]
+
                     |
                     -F
                     [-d <device = /dev/ttyCOM1>]
@@ -67,8 +86,36 @@ usage(int res, std::string const &msg = "")
                     [-d <device = /dev/ttyCOM1>]
                     [-c <line_config ="9600:8:N:1">]
                     [-a <answering_timeout_ms =500>]
+                    [-V(erify lines by reading them back)]
+                    [-n <max_retransmissions_per_line =3>]
                     -s <server_id>
                     <filename>
+                    [<image on the device, to only send the changed lines>]
+
+                    |
+                    -B
+                    [-c <line_config ="9600:8:N:1">]
+                    [-a <answering_timeout_ms =500>]
+                    [-V(erify lines by reading them back)]
+                    [-n <max_retransmissions_per_line =3>]
+                    <manifest, a "<device> <server_id> <filename>" per line>
+
+                    |
+                    -C
+                    [-d <device = /dev/ttyCOM1>]
+                    [-c <line_config ="9600:8:N:1">]
+                    [-a <answering_timeout_ms =500>]
+                    [-i <inter_frame_delay_ms =50>]
+                    [-V(erify lines by reading them back)]
+                    [-n <max_retransmissions_per_line =3>]
+                    <filename>
+                    <server_id>...
+
+                    |
+                    -S
+                    [-c <line_config ="9600:8:N:1">]...
+                    [-T <probe_timeout_ms =50>]
+                    <device>...
                 })"
               << std::endl;
     return res;
@@ -85,8 +132,12 @@ enum class mode_t
     meas_scheduler,
     single_read,
     single_write,
+    batch,
     file_transfer,
     flash_update,
+    flash_rollout,
+    flash_broadcast,
+    bus_scan,
 };
 namespace defaults {
     mode_t const mode = mode_t::unknown;
@@ -96,10 +147,19 @@ namespace defaults {
     std::string const serial_config                = "9600:8:N:1";
     std::chrono::milliseconds const answering_time = 500ms;
 
+    bool const verify                               = false;
+    int const max_retries                           = 3;
+    std::chrono::milliseconds const broadcast_delay = 50ms;
+
+    std::chrono::milliseconds const probe_timeout = 50ms;
+
     std::string const log_path                    = "";
     std::chrono::seconds const logrotation_period = 1h;
     std::string const out_folder                  = "/tmp";
     std::chrono::seconds const reporting_period   = 5min;
+    bool const bus_threads                        = false;
+    std::string const control_socket              = "";
+    unsigned short const gateway_port             = 0;
 } // namespace defaults
 
 auto mode = defaults::mode;
@@ -111,6 +171,15 @@ inline namespace rtu_parameters {
     auto answering_time = defaults::answering_time;
 } // namespace rtu_parameters
 
+// Flash update specific
+auto verify          = defaults::verify;
+auto max_retries     = defaults::max_retries;
+auto broadcast_delay = defaults::broadcast_delay;
+
+// Bus scan specific
+std::vector<std::string> line_configs;
+auto probe_timeout = defaults::probe_timeout;
+
 // Single-shot reads specific
 auto log_path           = defaults::log_path;
 auto logrotation_period = defaults::logrotation_period;
@@ -118,6 +187,9 @@ auto logrotation_period = defaults::logrotation_period;
 // Measure mode specific
 auto out_folder       = defaults::out_folder;
 auto reporting_period = defaults::reporting_period;
+auto bus_threads      = defaults::bus_threads;
+auto control_socket   = defaults::control_socket;
+auto gateway_port     = defaults::gateway_port;
 std::string measconfig_file;
 } // namespace options
 
@@ -144,7 +216,8 @@ main(int argc, char *argv[])
 
     optind = 1;
     int ch;
-    while ((ch = getopt(argc, argv, "UFRWhd:c:l:s:a:m:r:t:o:")) != -1)
+    while ((ch = getopt(
+              argc, argv, "UBCFRSWXVphd:c:l:s:a:m:r:t:o:i:n:T:u:g:")) != -1)
     {
         switch (ch)
         {
@@ -154,12 +227,38 @@ main(int argc, char *argv[])
         case 'W':
             options::mode = options::mode_t::single_write;
             break;
+        case 'X':
+            options::mode = options::mode_t::batch;
+            break;
         case 'F':
             options::mode = options::mode_t::file_transfer;
             break;
         case 'U':
             options::mode = options::mode_t::flash_update;
             break;
+        case 'B':
+            options::mode = options::mode_t::flash_rollout;
+            break;
+        case 'C':
+            options::mode = options::mode_t::flash_broadcast;
+            break;
+        case 'S':
+            options::mode = options::mode_t::bus_scan;
+            break;
+        case 'T':
+            options::probe_timeout =
+              std::chrono::milliseconds(std::stoi(optarg));
+            break;
+        case 'i':
+            options::broadcast_delay =
+              std::chrono::milliseconds(std::stoi(optarg));
+            break;
+        case 'V':
+            options::verify = true;
+            break;
+        case 'n':
+            options::max_retries = std::stoi(optarg);
+            break;
         case 'd':
             options::serial_device = optarg;
             break;
@@ -168,6 +267,7 @@ main(int argc, char *argv[])
             break;
         case 'c':
             options::serial_config = optarg;
+            options::line_configs.emplace_back(optarg);
             break;
         case 's':
             options::slave_id = std::stoi(optarg);
@@ -190,6 +290,15 @@ main(int argc, char *argv[])
         case 'o':
             options::out_folder = optarg;
             break;
+        case 'p':
+            options::bus_threads = true;
+            break;
+        case 'u':
+            options::control_socket = optarg;
+            break;
+        case 'g':
+            options::gateway_port = std::stoi(optarg);
+            break;
         case '?':
             return usage(-1);
         case 'h':
@@ -207,6 +316,10 @@ main(int argc, char *argv[])
       .serial_config  = options::serial_config,
       .answering_time = options::answering_time};
 
+    modbus::flash_session::options_t const flash_options{
+      .verify      = options::verify,
+      .max_retries = options::max_retries};
+
     char log_file[PATH_MAX];
     if (!options::log_path.empty())
     {
@@ -243,6 +356,24 @@ main(int argc, char *argv[])
                                   loguru::Verbosity_MAX);
             return 0;
         }
+        else if (options::mode == options::mode_t::batch)
+        {
+            std::ifstream ifs;
+            if (argc > 0)
+            {
+                ifs.open(argv[0]);
+                if (!ifs)
+                    return usage(-1, std::string("invalid script ") + argv[0]);
+            }
+
+            return modbus::run_batch(rtu_parameters,
+                                     argc > 0 ? ifs : std::cin,
+                                     std::cout,
+                                     loguru::g_stderr_verbosity >=
+                                       loguru::Verbosity_MAX)
+                     ? -1
+                     : 0;
+        }
         else if (options::mode == options::mode_t::single_write)
         {
             if (rtu_parameters.slave_id < 0 || argc < 2)
@@ -280,10 +411,63 @@ main(int argc, char *argv[])
 
             modbus::flash_update(rtu_parameters,
                                  argv[0],
+                                 argc > 1 ? argv[1] : "",
+                                 flash_options,
                                  loguru::g_stderr_verbosity >=
                                    loguru::Verbosity_MAX);
             return 0;
         }
+        else if (options::mode == options::mode_t::flash_rollout)
+        {
+            if (argc < 1)
+                return usage(
+                  -1, "missing mandatory parameters for flash_rollout mode");
+
+            return modbus::flash_rollout(rtu_parameters,
+                                         argv[0],
+                                         flash_options,
+                                         loguru::g_stderr_verbosity >=
+                                           loguru::Verbosity_MAX)
+                     ? -1
+                     : 0;
+        }
+        else if (options::mode == options::mode_t::flash_broadcast)
+        {
+            if (argc < 2)
+                return usage(
+                  -1, "missing mandatory parameters for flash_broadcast mode");
+
+            std::vector<int> slave_ids;
+            for (int i = 1; i != argc; ++i)
+                slave_ids.push_back(std::stoi(argv[i]));
+
+            return modbus::flash_broadcast(rtu_parameters,
+                                           argv[0],
+                                           slave_ids,
+                                           options::broadcast_delay,
+                                           flash_options,
+                                           loguru::g_stderr_verbosity >=
+                                             loguru::Verbosity_MAX)
+                     ? -1
+                     : 0;
+        }
+        else if (options::mode == options::mode_t::bus_scan)
+        {
+            if (argc < 1)
+                return usage(
+                  -1, "missing mandatory parameters for bus_scan mode");
+
+            if (options::line_configs.empty())
+                options::line_configs.push_back(options::serial_config);
+
+            return modbus::bus_scan({argv, argv + argc},
+                                    options::line_configs,
+                                    options::probe_timeout,
+                                    loguru::g_stderr_verbosity >=
+                                      loguru::Verbosity_MAX)
+                     ? 0
+                     : -1;
+        }
     }
     catch (std::invalid_argument const &e)
     {
@@ -328,6 +512,16 @@ main(int argc, char *argv[])
       [&reporter](infra::when_t now) { reporter.close_period(now); },
       infra::PeriodicScheduler::TaskMode::execute_at_multiples_of_period);
 
+    if (options::bus_threads)
+    {
+        // Keep the per-bus channels drained between reports
+        scheduler.addTask(
+          "SampleCollector",
+          1s,
+          [&reporter](infra::when_t) { reporter.collect(); },
+          infra::PeriodicScheduler::TaskMode::skip_first_execution);
+    }
+
 #if LOGURU_WITH_FILEABS
     if (!options::log_path.empty())
     {
@@ -346,7 +540,39 @@ main(int argc, char *argv[])
           infra::PeriodicScheduler::TaskMode::skip_first_execution);
     }
 #endif
-    measure::Executor measure_executor(scheduler, reporter, meas_config);
+    // Shared with the masters reading through the gateway
+    std::unique_ptr<modbus::register_image> register_image;
+    if (options::gateway_port)
+        register_image = std::make_unique<modbus::register_image>();
+
+    measure::Executor measure_executor(scheduler,
+                                       reporter,
+                                       meas_config,
+                                       options::bus_threads,
+                                       register_image.get());
+
+    // On a lane of its own, so that waiting for a bus doesn't hold the polls
+    std::unique_ptr<measure::ControlServer> control_server;
+    if (!options::control_socket.empty())
+        control_server = std::make_unique<measure::ControlServer>(
+          scheduler.context("control"),
+          options::control_socket,
+          measure_executor);
+
+    std::unique_ptr<measure::GatewayServer> gateway_values;
+    std::unique_ptr<measure::GatewayServer> gateway_ages;
+    if (register_image)
+    {
+        gateway_values = std::make_unique<measure::GatewayServer>(
+          scheduler.context("gateway"),
+          options::gateway_port,
+          *register_image);
+        gateway_ages = std::make_unique<measure::GatewayServer>(
+          scheduler.context("gateway"),
+          options::gateway_port + 1,
+          *register_image,
+          measure::GatewayServer::view::ages);
+    }
 
     scheduler.run();
     return 0;
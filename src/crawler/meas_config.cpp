@@ -4,8 +4,11 @@
 #include "json_support.h"
 
 #include <algorithm>
+#include <cstdlib>
+#include <fstream>
 #include <nlohmann/json.hpp>
 #include <stdexcept>
+#include <unistd.h>
 
 using json = nlohmann::json;
 
@@ -22,6 +25,8 @@ NLOHMANN_JSON_SERIALIZE_ENUM(regtype,
                                {regtype::INVALID, nullptr},
                                {regtype::holding, "holding"},
                                {regtype::input, "input"},
+                               {regtype::coil, "coil"},
+                               {regtype::discrete_input, "discrete_input"},
                              })
 NLOHMANN_JSON_SERIALIZE_ENUM(value_type,
                              {
@@ -32,6 +37,7 @@ NLOHMANN_JSON_SERIALIZE_ENUM(value_type,
                                {value_type::UINT32, "UINT32"},
                                {value_type::INT64, "INT64"},
                                {value_type::UINT64, "UINT64"},
+                               {value_type::BIT, "BIT"},
                              })
 
 } // namespace modbus
@@ -45,9 +51,20 @@ to_json(json &j, modbus_server_t const &s)
     j = json{{"modbus_id", s.modbus_id},
              {"name", s.name},
              {"serial_device", s.serial_device},
+             {"tcp_endpoint", s.tcp_endpoint},
              {"sampling_period", s.sampling_period},
              {"line_config", s.line_config},
-             {"answering_time_ms", s.answering_time}};
+             {"answering_time_ms", s.answering_time},
+             {"timeout_factor", s.timeout_factor},
+             {"min_answering_time_ms", s.min_answering_time},
+             {"breaker_threshold", s.breaker_threshold},
+             {"breaker_max_backoff", s.breaker_max_backoff},
+             {"max_block_registers", s.max_block_registers},
+             {"async_transport", s.async_transport},
+             {"tcp_max_in_flight", s.tcp_max_in_flight},
+             {"change_counter_address", s.change_counter_address},
+             {"change_counter_reg_type", s.change_counter_reg_type},
+             {"gateway_unit_id", s.gateway_unit_id}};
 }
 
 void
@@ -65,6 +82,14 @@ from_json(json const &j, modbus_server_t &s)
     if (serial_device_it != j.end()) // A real modbus source
         serial_device_it->get_to(s.serial_device);
 
+    auto tcp_endpoint_it = j.find("tcp_endpoint");
+    if (tcp_endpoint_it != j.end()) // A real modbus TCP source
+        tcp_endpoint_it->get_to(s.tcp_endpoint);
+
+    if (!s.serial_device.empty() && !s.tcp_endpoint.empty())
+        throw std::invalid_argument(
+          "Only one of serial_device and tcp_endpoint can be specified");
+
     // Required fields
     j.at("modbus_id").get_to(s.modbus_id);
     j.at("name").get_to(s.name);
@@ -77,6 +102,64 @@ from_json(json const &j, modbus_server_t &s)
     auto const at_it = j.find("answering_time_ms");
     if (at_it != j.end())
         at_it->get_to(s.answering_time);
+
+    auto const tf_it = j.find("timeout_factor");
+    if (tf_it != j.end())
+        tf_it->get_to(s.timeout_factor);
+
+    auto const mat_it = j.find("min_answering_time_ms");
+    if (mat_it != j.end())
+        mat_it->get_to(s.min_answering_time);
+
+    auto const bt_it = j.find("breaker_threshold");
+    if (bt_it != j.end())
+        bt_it->get_to(s.breaker_threshold);
+
+    auto const bmb_it = j.find("breaker_max_backoff");
+    if (bmb_it != j.end())
+        bmb_it->get_to(s.breaker_max_backoff);
+
+    auto const mbr_it = j.find("max_block_registers");
+    if (mbr_it != j.end())
+    {
+        mbr_it->get_to(s.max_block_registers);
+        if (s.max_block_registers < 0 ||
+            s.max_block_registers > MODBUS_MAX_READ_REGISTERS)
+            throw std::invalid_argument(
+              "max_block_registers must be [0.." +
+              std::to_string(MODBUS_MAX_READ_REGISTERS) + "]");
+    }
+
+    auto const async_it = j.find("async_transport");
+    if (async_it != j.end())
+        async_it->get_to(s.async_transport);
+
+    auto const mif_it = j.find("tcp_max_in_flight");
+    if (mif_it != j.end())
+        mif_it->get_to(s.tcp_max_in_flight);
+
+    auto const cca_it = j.find("change_counter_address");
+    if (cca_it != j.end())
+        cca_it->get_to(s.change_counter_address);
+
+    auto const cct_it = j.find("change_counter_reg_type");
+    if (cct_it != j.end())
+    {
+        cct_it->get_to(s.change_counter_reg_type);
+        modbus::check_enum(s.change_counter_reg_type);
+        if (modbus::is_bit(s.change_counter_reg_type))
+            throw std::invalid_argument(
+              "change_counter_reg_type must be a register type");
+    }
+
+    s.gateway_unit_id = s.modbus_id;
+    auto const gui_it = j.find("gateway_unit_id");
+    if (gui_it != j.end())
+    {
+        gui_it->get_to(s.gateway_unit_id);
+        if (s.gateway_unit_id < 0 || s.gateway_unit_id > UINT8_MAX)
+            throw std::invalid_argument("gateway_unit_id must be [0..255]");
+    }
 }
 
 // NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(source_register_t,
@@ -106,14 +189,27 @@ to_json(json &j, source_register_t const &s)
 void
 from_json(json const &j, source_register_t &s)
 {
-    s.address   = j.at("address");
-    s.endianess = j.at("endianess");
-    modbus::check_enum(s.endianess);
+    s.address  = j.at("address");
     s.reg_type = j.at("reg_type");
     modbus::check_enum(s.reg_type);
     s.value_type = j.at("value_type");
     modbus::check_enum(s.value_type);
 
+    // Coils and discrete inputs hold BITs, and only them
+    if (modbus::is_bit(s.reg_type) != (s.value_type == modbus::value_type::BIT))
+        throw std::invalid_argument(
+          "BIT values go with coil or discrete_input registers only");
+
+    // Meaningless for a single bit, hence optional
+    auto const endianess_it = j.find("endianess");
+    if (endianess_it == j.end() && s.value_type == modbus::value_type::BIT)
+        s.endianess = modbus::word_endianess::little;
+    else
+    {
+        s.endianess = j.at("endianess");
+        modbus::check_enum(s.endianess);
+    }
+
     auto scale_factor_it = j.find("scale_factor");
     if (scale_factor_it != j.end())
         scale_factor_it->get_to(s.scale_factor);
@@ -155,6 +251,7 @@ to_json(json &j, measure_t const &m)
       {"sampling_period", m.sampling_period},
       {"accumulating", m.accumulating},
       {"report_raw_samples", m.report_raw_samples},
+      {"cache_ttl", m.cache_ttl},
       {"source", m.source},
     };
 }
@@ -180,6 +277,10 @@ from_json(json const &j, measure_t &m)
     if (report_raw_it != j.end())
         report_raw_it->get_to(m.report_raw_samples);
 
+    auto cache_ttl_it = j.find("cache_ttl");
+    if (cache_ttl_it != j.end())
+        cache_ttl_it->get_to(m.cache_ttl);
+
     j.at("source").get_to(m.source);
 }
 
@@ -200,15 +301,14 @@ read_config(std::string const &measconfig_file)
         if (!desc.server.enabled)
             continue;
 
-        auto const server_id = desc.server.modbus_id;
+        auto const key = desc.server.key();
         bool added;
 
-        auto insertion =
-          measure_descriptors.try_emplace(server_id, std::move(desc));
+        auto insertion = measure_descriptors.try_emplace(key, std::move(desc));
 
         if (!insertion.second)
             throw std::invalid_argument("Duplicate Modbus ID: " +
-                                        std::to_string(server_id));
+                                        key.to_string());
 
         // Prune non-enabled measures
         auto &measures = insertion.first->second.measures;
@@ -237,4 +337,53 @@ read_config(std::string const &measconfig_file)
 TEST_CASE("invalid config must throw")
 {
     CHECK_THROWS(measure::read_config("bla"));
-}
\ No newline at end of file
+}
+
+TEST_CASE("max_block_registers is bounded by the protocol limit")
+{
+    auto server = json::parse(R"({"modbus_id": 1, "name": "s"})");
+    CHECK(server.get<measure::modbus_server_t>().max_block_registers ==
+          MODBUS_MAX_READ_REGISTERS);
+
+    server["max_block_registers"] = 0;
+    CHECK(server.get<measure::modbus_server_t>().max_block_registers == 0);
+
+    server["max_block_registers"] = MODBUS_MAX_READ_REGISTERS + 1;
+    CHECK_THROWS_AS(server.get<measure::modbus_server_t>(),
+                    std::invalid_argument);
+    server["max_block_registers"] = -1;
+    CHECK_THROWS_AS(server.get<measure::modbus_server_t>(),
+                    std::invalid_argument);
+}
+TEST_CASE("Modbus ids are unique per serial device or TCP endpoint")
+{
+    auto const server = [](int id, char const *transport, char const *device)
+    {
+        json entry{{"server", {{"modbus_id", id}, {"name", "s"}}},
+                   {"measures", json::array()}};
+        entry["server"][transport] = device;
+        return entry;
+    };
+
+    char path[] = "/tmp/meas_config_XXXXXX";
+    int const fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    close(fd);
+
+    auto config = json::array({server(1, "serial_device", "/dev/ttyUSB0"),
+                               server(1, "serial_device", "/dev/ttyUSB1"),
+                               server(1, "tcp_endpoint", "10.0.0.1:502")});
+    std::ofstream(path) << config;
+    auto const descriptors = measure::read_config(path);
+    CHECK(descriptors.size() == 3);
+    CHECK(descriptors.count({"/dev/ttyUSB1", 1}) == 1);
+    CHECK(descriptors.count({"10.0.0.1:502", 1}) == 1);
+
+    config.push_back(server(1, "serial_device", "/dev/ttyUSB0"));
+    std::ofstream(path) << config;
+    CHECK_THROWS_WITH_AS(measure::read_config(path),
+                         "Duplicate Modbus ID: 1@/dev/ttyUSB0",
+                         std::invalid_argument);
+
+    unlink(path);
+}
@@ -7,7 +7,9 @@
 #include <cinttypes>
 #include <fstream>
 #include <map>
+#include <modbus.h>
 #include <string>
+#include <tuple>
 #include <vector>
 
 /*
@@ -85,6 +87,8 @@ public:
             return operator=(std::numeric_limits<int64_t>::min());
         case modbus::value_type::UINT64:
             return operator=(std::numeric_limits<uint64_t>::min());
+        case modbus::value_type::BIT:
+            return operator=(uintmax_t{0});
         default:
             assert(!"Unreachable switch case");
         }
@@ -107,6 +111,8 @@ public:
             return operator=(std::numeric_limits<int64_t>::max());
         case modbus::value_type::UINT64:
             return operator=(std::numeric_limits<uint64_t>::max());
+        case modbus::value_type::BIT:
+            return operator=(uintmax_t{1});
         default:
             assert(!"Unreachable switch case");
         }
@@ -157,18 +163,96 @@ public:
     }
 };
 
+// A server is told apart by the serial device or TCP endpoint it is reached
+// through, its transport, along with its modbus id, as each transport
+// numbers its devices on its own. The RANDOM servers have no transport
+struct server_key_t
+{
+    std::string transport;
+    modbus::slave_id_t modbus_id;
+
+    // "<modbus id>@<transport>", the same as the control socket takes
+    [[nodiscard]] std::string to_string() const
+    {
+        return transport.empty() ? std::to_string(modbus_id)
+                                 : std::to_string(modbus_id) + "@" + transport;
+    }
+};
+
+inline bool
+operator<(server_key_t const &lhs, server_key_t const &rhs)
+{
+    return std::tie(lhs.transport, lhs.modbus_id) <
+           std::tie(rhs.transport, rhs.modbus_id);
+}
 
 struct modbus_server_t
 {
+    // Unique per serial device or TCP endpoint only: each RS-485 port or
+    // gateway numbers its devices on its own, from 1
     int modbus_id;
     std::string name;
     std::string serial_device;
+    // "host:port" of a Modbus TCP device or gateway, alternative to
+    // serial_device
+    std::string tcp_endpoint;
 
     // Optionally present in json, so they have default values
     bool enabled            = true;
     std::string line_config = "9600:8:N:1";
     std::chrono::milliseconds answering_time{500};
     std::chrono::seconds sampling_period{5};
+
+    // Adaptive response timeout: a multiple of the observed response times,
+    // between min_answering_time and answering_time. 0 disables it, always
+    // waiting up to answering_time
+    double timeout_factor = 0;
+    std::chrono::milliseconds min_answering_time{20};
+
+    // After breaker_threshold consecutive poll cycles without a response,
+    // the server is only probed with an exponential backoff, starting at
+    // sampling_period and up to breaker_max_backoff. A cycle is all the
+    // blocks of the server polled at the same time, any of them answered
+    // meaning that the server is alive. 0, the default, disables it
+    unsigned breaker_threshold = 0;
+    std::chrono::seconds breaker_max_backoff{300};
+
+    // Upper bound for coalescing adjacent measures into a single read
+    // request, within [0, MODBUS_MAX_READ_REGISTERS], the protocol limit and
+    // default. 0 disables coalescing for devices not supporting block reads
+    int max_block_registers = MODBUS_MAX_READ_REGISTERS;
+
+    // Use the non-blocking asio based transport instead of libmodbus
+    bool async_transport = false;
+
+    // Outstanding requests on the connection to tcp_endpoint, shared by all
+    // the servers behind the same endpoint (the first one configures it)
+    int tcp_max_in_flight = 8;
+
+    // Register the device increments whenever its measures are updated.
+    // When set, it is read once per poll cycle, before the blocks polled,
+    // and each block is only read again when the counter has changed since
+    // it was last read, its previous samples being repeated otherwise. A
+    // negative address disables it
+    int change_counter_address              = -1;
+    modbus::regtype change_counter_reg_type = modbus::regtype::holding;
+
+    // Unit id the gateway serves the server's registers under, modbus_id
+    // unless set. With the gateway enabled, the servers sharing a modbus id
+    // on different transports need distinct ones
+    int gateway_unit_id = 0;
+
+    // Neither serial nor TCP, a RANDOM measurements generator
+    [[nodiscard]] bool random_source() const
+    {
+        return serial_device.empty() && tcp_endpoint.empty();
+    }
+
+    [[nodiscard]] server_key_t key() const
+    {
+        return {tcp_endpoint.empty() ? serial_device : tcp_endpoint,
+                modbus_id};
+    }
 };
 struct source_register_t
 {
@@ -195,6 +279,10 @@ struct measure_t
     bool enabled            = true;
     bool accumulating       = false;
     bool report_raw_samples = false;
+    // For static or slowly changing values, e.g. a firmware version: within
+    // cache_ttl of a read, the value is served from the slave's register
+    // cache instead of being read again. 0 disables it
+    std::chrono::seconds cache_ttl = std::chrono::seconds::zero();
     source_register_t source;
 };
 
@@ -204,7 +292,9 @@ struct descriptor_t
     std::vector<measure_t> measures;
 };
 
-using configuration_map_t = std::map<modbus::slave_id_t, descriptor_t>;
+// Servers sharing a transport need distinct modbus ids, while those on
+// different transports can reuse them
+using configuration_map_t = std::map<server_key_t, descriptor_t>;
 
 configuration_map_t
 read_config(std::string const& measconfig_file);
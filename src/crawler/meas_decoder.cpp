@@ -0,0 +1,180 @@
+#include "meas_decoder.h"
+
+#include "doctest.h"
+#include "modbus_decode.hpp"
+
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+
+namespace measure {
+namespace {
+    using modbus::value_type;
+    using modbus::word_endianess;
+    using SampleType = Reporter::SampleType;
+
+    template <class T>
+    SampleType
+    check_and_scale(sample_decoder::limits_t const &limits,
+                    T value,
+                    double &measurement)
+    {
+        if constexpr (std::is_signed_v<T>)
+        {
+            if (value < limits.min_signed)
+                return SampleType::underflow;
+            if (value > limits.max_signed)
+                return SampleType::overflow;
+        }
+        else
+        {
+            if (value < limits.min_unsigned)
+                return SampleType::underflow;
+            if (value > limits.max_unsigned)
+                return SampleType::overflow;
+        }
+
+        measurement = static_cast<double>(value) * limits.scale;
+        return SampleType::regular;
+    }
+
+    template <value_type VT, word_endianess E>
+    SampleType
+    decode_sample(sample_decoder::limits_t const &limits,
+                  uint16_t const *regs,
+                  intmax_t &raw,
+                  double &measurement)
+    {
+        auto const value = modbus::decode<VT, E>(regs);
+        raw              = static_cast<intmax_t>(value);
+        return check_and_scale(limits, value, measurement);
+    }
+
+    // Values decoded elsewhere are sign extended whatever their type
+    template <bool Signed>
+    SampleType
+    evaluate_sample(sample_decoder::limits_t const &limits,
+                    intmax_t raw,
+                    double &measurement)
+    {
+        if constexpr (Signed)
+            return check_and_scale(limits, raw, measurement);
+        else
+            return check_and_scale(
+              limits, static_cast<uintmax_t>(raw), measurement);
+    }
+
+    // Coils and discrete inputs come packed, this is for a bit which has
+    // been unpacked into a register of its own
+    SampleType
+    decode_bit(sample_decoder::limits_t const &limits,
+               uint16_t const *regs,
+               intmax_t &raw,
+               double &measurement)
+    {
+        raw = regs[0] & 1;
+        return check_and_scale(
+          limits, static_cast<uintmax_t>(raw), measurement);
+    }
+
+    template <value_type VT>
+    constexpr sample_decoder::decode_fn decoders[] = {
+      &decode_sample<VT, word_endianess::little>,
+      &decode_sample<VT, word_endianess::big>};
+
+    // Indexed by value_type, then by word_endianess, both less their INVALID
+    constexpr sample_decoder::decode_fn const *decoder_table[] = {
+      decoders<value_type::INT16>,
+      decoders<value_type::UINT16>,
+      decoders<value_type::INT32>,
+      decoders<value_type::UINT32>,
+      decoders<value_type::INT64>,
+      decoders<value_type::UINT64>};
+
+    static_assert(static_cast<int>(value_type::INT16) == 1 &&
+                  static_cast<int>(value_type::UINT64) == 6);
+    static_assert(static_cast<int>(word_endianess::little) == 1 &&
+                  static_cast<int>(word_endianess::big) == 2);
+
+    sample_decoder::decode_fn
+    lookup_decoder(value_type vt, word_endianess endianess)
+    {
+        if (vt == value_type::BIT)
+            return &decode_bit;
+
+        auto const vt_idx  = static_cast<int>(vt) - 1;
+        auto const end_idx = static_cast<int>(endianess) - 1;
+
+        if (vt_idx < 0 || vt_idx >= static_cast<int>(std::size(decoder_table)))
+            throw std::invalid_argument("Invalid value type");
+        if (end_idx < 0 || end_idx > 1)
+            throw std::invalid_argument("Invalid word endianess");
+
+        return decoder_table[vt_idx][end_idx];
+    }
+} // namespace
+
+sample_decoder::sample_decoder(source_register_t const &source)
+  : decode_(lookup_decoder(source.value_type, source.endianess))
+  , evaluate_(modbus::value_signed(source.value_type)
+                ? &evaluate_sample<true>
+                : &evaluate_sample<false>)
+{
+    limits_.scale = source.scale_factor;
+
+    if (modbus::value_signed(source.value_type))
+    {
+        limits_.min_signed = source.min_read_value.as_signed();
+        limits_.max_signed = source.max_read_value.as_signed();
+    }
+    else
+    {
+        limits_.min_unsigned = source.min_read_value.as_unsigned();
+        limits_.max_unsigned = source.max_read_value.as_unsigned();
+    }
+}
+} // namespace measure
+
+TEST_CASE("Samples are decoded, checked and scaled")
+{
+    using measure::Reporter;
+    using modbus::value_type;
+    using modbus::word_endianess;
+
+    measure::source_register_t source;
+    source.endianess    = word_endianess::little;
+    source.value_type   = value_type::UINT32;
+    source.scale_factor = 0.5;
+    source.min_read_value.assign_min(source.value_type);
+    source.max_read_value = 0x20000u;
+
+    measure::sample_decoder const decode(source);
+
+    intmax_t raw;
+    double measurement;
+
+    uint16_t const regs[] = {0x0000, 0x0001, 0xFFFF};
+    CHECK(decode(regs, raw, measurement) == Reporter::SampleType::regular);
+    CHECK(raw == 0x10000);
+    CHECK(measurement == 0x8000);
+
+    // Unsigned values keep their top bit
+    CHECK(decode(regs + 1, raw, measurement) ==
+          Reporter::SampleType::overflow);
+    CHECK(raw == 0xFFFF0001);
+
+    source.endianess      = word_endianess::big;
+    source.value_type     = value_type::INT16;
+    source.min_read_value = -10;
+    source.max_read_value.assign_max(source.value_type);
+
+    measure::sample_decoder const decode_signed(source);
+    CHECK(decode_signed(regs + 2, raw, measurement) ==
+          Reporter::SampleType::regular);
+    CHECK(measurement == -0.5);
+    CHECK(decode_signed.evaluate(-11, measurement) ==
+          Reporter::SampleType::underflow);
+
+    source.endianess = word_endianess::INVALID;
+    CHECK_THROWS_AS(measure::sample_decoder{source}, std::invalid_argument);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "meas_config.h"
+#include "meas_reporter.h"
+
+#include <cstdint>
+
+namespace measure {
+
+// The decode-check-scale pipeline of a measure. Each (value_type,
+// word_endianess) pair gets its own routine, specialized at compile time,
+// which is looked up once, when the measure is configured, so that polling
+// doesn't branch on the measure's configuration for each sample
+class sample_decoder
+{
+public:
+    // Thresholds and scale factor, resolved from the source register
+    struct limits_t
+    {
+        intmax_t min_signed;
+        intmax_t max_signed;
+        uintmax_t min_unsigned;
+        uintmax_t max_unsigned;
+        double scale;
+    };
+
+    using decode_fn = Reporter::SampleType (*)(limits_t const &limits,
+                                                uint16_t const *regs,
+                                                intmax_t &raw,
+                                                double &measurement);
+    using evaluate_fn = Reporter::SampleType (*)(limits_t const &limits,
+                                                  intmax_t raw,
+                                                  double &measurement);
+
+    explicit sample_decoder(source_register_t const &source);
+
+    // Decode the value the registers starting at regs hold into raw, then
+    // check it against the thresholds and, when within them, scale it into
+    // measurement
+    Reporter::SampleType operator()(uint16_t const *regs,
+                                    intmax_t &raw,
+                                    double &measurement) const
+    {
+        return decode_(limits_, regs, raw, measurement);
+    }
+
+    // Same as above, for a value decoded elsewhere
+    Reporter::SampleType evaluate(intmax_t raw, double &measurement) const
+    {
+        return evaluate_(limits_, raw, measurement);
+    }
+
+    [[nodiscard]] limits_t const &limits() const noexcept { return limits_; }
+
+private:
+    limits_t limits_{};
+    decode_fn decode_;
+    evaluate_fn evaluate_;
+};
+} // namespace measure
@@ -1,140 +1,1185 @@
 #include "meas_executor.h"
 
+#include "asio_slave.h"
+#include "circuit_breaker.h"
+#include "column_decoder.h"
+#include "doctest.h"
 #include "infra.hpp"
+#include "meas_decoder.h"
+#include "meas_planner.h"
 #include "meas_reporter.h"
 #include "periodic_scheduler.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
 #include <loguru.hpp>
-#include <sstream>
+#include <map>
+#include <nlohmann/json.hpp>
+#include <ostream>
+#include <unistd.h>
 
 namespace measure {
+namespace {
+    // Common prefix of the log lines about a sample. It is only formatted
+    // when a line is actually emitted, so that polling doesn't pay for the
+    // logs that are filtered out
+    struct sample_prefix
+    {
+        infra::when_t nowsecs;
+        modbus::slave const &slave;
+        measure_t const &meas;
 
-void
-Executor::add_schedule(infra::PeriodicScheduler &scheduler,
-                       Reporter &reporter,
-                       modbus::slave &slave,
-                       std::vector<measure_t> const &measures)
-{
-    for (auto const &meas: measures)
+        friend std::ostream &operator<<(std::ostream &os,
+                                        sample_prefix const &p)
+        {
+            auto const &source_value = p.meas.source;
+
+            return os << p.nowsecs.time_since_epoch().count() << "->"
+                      << p.meas.sampling_period.count() << '|'
+                      << p.slave.name() << "@" << p.slave.id() << '|'
+                      << p.meas.name << '|' << source_value.address << "#"
+                      << modbus::reg_size(source_value.value_type)
+                      << (modbus::value_signed(source_value.value_type)
+                            ? 'I'
+                            : 'U');
+        }
+    };
+
+    struct raw_value
+    {
+        intmax_t value;
+
+        friend std::ostream &operator<<(std::ostream &os, raw_value const &r)
+        {
+            return os << '|' << r.value << '(' << std::hex << r.value
+                      << std::dec << ')';
+        }
+    };
+
+    intmax_t raw_register_value(sample_decoder const &decoder,
+                                uint16_t const *regs)
+    {
+        intmax_t raw;
+        double ignored;
+        decoder(regs, raw, ignored);
+        return raw;
+    }
+
+    // The raw value of a measure decoded as a column, only decoded again
+    // when a log line is actually emitted
+    struct register_value
     {
-        assert(meas.enabled);
+        sample_decoder const &decoder;
+        uint16_t const *regs;
 
-        auto const meas_task =
-          [this, &reporter, &slave, meas](infra::when_t nowsecs)
+        friend std::ostream &operator<<(std::ostream &os,
+                                        register_value const &r)
         {
-            std::ostringstream msg;
-            auto const period = meas.sampling_period.count();
+            return os << raw_value{raw_register_value(r.decoder, r.regs)};
+        }
+    };
+
+    void log_out_of_range(sample_prefix const &prefix,
+                          sample_decoder const &decoder,
+                          intmax_t reg_value,
+                          Reporter::SampleType sample_type)
+    {
+        auto const &limits   = decoder.limits();
+        bool const underflow = sample_type == Reporter::SampleType::underflow;
+
+        if (modbus::value_signed(prefix.meas.source.value_type))
+            LOG_S(WARNING)
+              << prefix << raw_value{reg_value}
+              << (underflow ? "|UNDERFLOW: " : "|OVERFLOW: ") << reg_value
+              << (underflow ? " < " : " > ")
+              << (underflow ? limits.min_signed : limits.max_signed);
+        else
+            LOG_S(WARNING)
+              << prefix << raw_value{reg_value}
+              << (underflow ? "|UNDERFLOW: " : "|OVERFLOW: ")
+              << static_cast<uintmax_t>(reg_value)
+              << (underflow ? " < " : " > ")
+              << (underflow ? limits.min_unsigned : limits.max_unsigned);
+    }
+
+    // A server's change counter, see modbus_server_t, read once per poll
+    // cycle on behalf of all the blocks of the server
+    class change_counter
+    {
+        using read_handler_t = modbus::slave_concept::read_handler_t;
+
+        modbus::slave &slave_;
+        int const address_;
+        modbus::regtype const reg_type_;
+        // Outcome of the read for the cycle polled at cycle_
+        infra::when_t cycle_;
+        bool in_flight_ = false;
+        std::error_code ec_;
+        uint16_t value_ = 0;
+        // The blocks' handlers, waiting for the read in flight. Swapped
+        // with notified_ to be called, so that neither allocates once grown
+        std::vector<read_handler_t const *> waiting_;
+        std::vector<read_handler_t const *> notified_;
+        read_handler_t const on_read_;
+
+        void on_read(std::error_code const &ec, uint16_t const *registers)
+        {
+            in_flight_ = false;
+            ec_        = ec;
+            if (!ec)
+                value_ = registers[0];
+
+            notified_.swap(waiting_);
+            for (auto const *handler: notified_)
+                (*handler)(ec_, &value_);
+            notified_.clear();
+        }
+
+    public:
+        change_counter(modbus::slave &slave,
+                       int address,
+                       modbus::regtype reg_type)
+          : slave_(slave)
+          , address_(address)
+          , reg_type_(reg_type)
+          , on_read_([this](std::error_code const &ec,
+                            uint16_t const *registers)
+                     { on_read(ec, registers); })
+        {}
+
+        // The slave's handler refers to this
+        change_counter(change_counter const &) = delete;
+        change_counter &operator=(change_counter const &) = delete;
+
+        // Call handler with the counter as read for the cycle polled at
+        // nowsecs, the first block of the cycle reading it. The blocks of a
+        // later cycle join a read still in flight rather than queue another
+        void read(infra::when_t nowsecs, read_handler_t const &handler)
+        {
+            if (!in_flight_ && nowsecs == cycle_)
+                return handler(ec_, &value_);
+
+            waiting_.push_back(&handler);
+            if (in_flight_)
+                return;
+
+            in_flight_ = true;
+            cycle_     = nowsecs;
+            slave_.async_read_registers(reg_type_, address_, 1, on_read_);
+        }
+    };
 
-            msg << nowsecs.time_since_epoch().count() << "->" << period << '|'
-                << slave.name() << "@" << slave.id() << '|' << meas.name;
+    // Polls a block of registers and turns it into samples for each of the
+    // block's measures
+    class block_poller
+    {
+        Reporter &reporter_;
+        modbus::slave &slave_;
+        slave_health &health_;
+        infra::circuit_breaker &breaker_;
+        read_block_t const block_;
+        std::vector<Reporter::measure_handle_t> const handles_;
+        std::vector<sample_decoder> const decoders_;
+        // Runs of back to back measures of the same 16 or 32 bits type,
+        // decoded at once. The others go through their own decoder
+        struct column_run
+        {
+            size_t first_item;
+            column_t column;
+        };
+        std::vector<column_run> const columns_;
+        // Per item results of the last block read, kept around so that
+        // polling doesn't allocate
+        std::vector<double> measurements_;
+        std::vector<Reporter::SampleType> sample_types_;
+        Reporter::channel *const channel_;
+        // Where the raw blocks read are shared with the gateway, if any,
+        // under the server's gateway unit id
+        modbus::register_image *const image_;
+        modbus::slave_id_t const image_unit_;
+        bool const block_reads_;
+        bool in_flight_ = false;
+        infra::when_t polled_at_;
+        // Server's change counter, if any. While it keeps the value it had
+        // when the block was last read, the samples of that read are
+        // repeated instead of reading the block again
+        std::shared_ptr<change_counter> const change_counter_;
+        uint16_t counter_      = 0;
+        uint16_t next_counter_ = 0;
+        bool cached_           = false;
+        infra::when_t cached_at_;
+        // Registers of a cached block, served from the slave's cache. The
+        // cache only holds registers, not bits
+        std::vector<uint16_t> cached_regs_;
+        // Built once, so that polling doesn't need to allocate a new
+        // handler each time
+        modbus::slave_concept::read_handler_t const on_read_;
+        modbus::slave_concept::bits_handler_t const on_bits_;
+        modbus::slave_concept::read_handler_t const on_counter_;
+        // A block failing over and over is only reported once at ERROR
+        // level, so that dead devices don't flood the log
+        std::error_code last_error_;
 
-            Reporter::SampleType sample_type =
-              Reporter::SampleType::read_failure;
-            double measurement = std::numeric_limits<double>::quiet_NaN();
+        void report(size_t item_idx,
+                    infra::when_t nowsecs,
+                    double measurement,
+                    Reporter::SampleType sample_type)
+        {
+            Reporter::sample_t const sample{
+              handles_[item_idx], nowsecs, measurement, sample_type};
 
-            auto const &source_value = meas.source;
-            auto const reg_size = modbus::reg_size(source_value.value_type);
-            auto const value_signed =
-              modbus::value_signed(source_value.value_type);
+            if (channel_)
+                channel_->push(sample);
+            else
+                reporter_.add_measurement(sample);
+        }
 
-            msg << '|' << source_value.address << "#" << reg_size
-                << (value_signed ? 'I' : 'U');
+        // Only a missing response counts as a failure, an exception response
+        // still means that the slave is alive. The other blocks of the cycle
+        // failing too doesn't make it any more unresponsive
+        void track_health(std::error_code const &ec)
+        {
+            auto const prev_state = breaker_.state();
 
-            intmax_t reg_value;
-            try
+            if (!ec || modbus::is_exception(ec))
+                breaker_.on_success();
+            else if (health_.failed_cycle != polled_at_)
             {
-                LOG_SCOPE_F(1, "Reading register");
-                if (source_value.reg_type == modbus::regtype::holding)
-                    reg_value = slave.read_holding_registers(
-                      source_value.address, reg_size, source_value.endianess);
-                else
-                    reg_value = slave.read_input_registers(
-                      source_value.address, reg_size, source_value.endianess);
+                health_.failed_cycle = polled_at_;
+                breaker_.on_failure(infra::circuit_breaker::clock_type::now());
+            }
+
+            auto const state = breaker_.state();
+            LOG_IF_S(WARNING,
+                     state == infra::circuit_breaker::state_t::open &&
+                       prev_state != state)
+              << slave_.name() << "@" << slave_.id()
+              << "|unresponsive, next attempt in " << breaker_.backoff().count()
+              << "s";
+            LOG_IF_S(INFO,
+                     state == infra::circuit_breaker::state_t::closed &&
+                       prev_state != state)
+              << slave_.name() << "@" << slave_.id() << "|responsive again";
+        }
+
+        void on_failure(infra::when_t nowsecs, std::error_code const &ec)
+        {
+            auto const &first = block_.items.front().measure;
+
+            VLOG_S(ec != last_error_ ? loguru::Verbosity_ERROR
+                                     : loguru::Verbosity_1)
+              << sample_prefix{nowsecs, slave_, first} << "+"
+              << block_.items.size() - 1 << "|FAILED:" << ec.message();
+            last_error_ = ec;
+
+            for (size_t i = 0; i != block_.items.size(); ++i)
+                report(i,
+                       nowsecs,
+                       std::numeric_limits<double>::quiet_NaN(),
+                       Reporter::SampleType::read_failure);
+        }
+
+        void on_block(infra::when_t nowsecs,
+                      std::error_code const &ec,
+                      uint16_t const *registers)
+        {
+            if (ec)
+                return on_failure(nowsecs, ec);
+
+            last_error_.clear();
 
-                msg << '|' << reg_value << '(' << std::hex << reg_value
-                    << std::dec << ')';
+            for (auto const &run: columns_)
+                decode_column(run.column,
+                              registers + block_.items[run.first_item].offset,
+                              measurements_.data() + run.first_item,
+                              sample_types_.data() + run.first_item);
 
-                if (value_signed)
+            for (size_t i = 0; i != block_.items.size(); ++i)
+            {
+                auto const &item     = block_.items[i];
+                uint16_t const *regs = registers + item.offset;
+                auto &measurement    = measurements_[i];
+                auto &sample_type    = sample_types_[i];
+
+                if (!column_t::supports(item.measure.source.value_type))
                 {
-                    intmax_t const min_threshold =
-                      source_value.min_read_value.as_signed();
-                    intmax_t const max_threshold =
-                      source_value.max_read_value.as_signed();
-                    if (reg_value < min_threshold)
-                    {
-                        sample_type = Reporter::SampleType::underflow;
-                        LOG_S(WARNING)
-                          << msg.str() << "|UNDERFLOW: " << reg_value << " < "
-                          << min_threshold;
-                    }
-                    else if (reg_value > max_threshold)
-                    {
-                        sample_type = Reporter::SampleType::overflow;
-                        LOG_S(WARNING)
-                          << msg.str() << "|OVERFLOW: " << reg_value << " > "
-                          << max_threshold;
-                    }
-                    else
-                    {
-                        sample_type = Reporter::SampleType::regular;
-                        measurement = static_cast<double>(reg_value) *
-                                      source_value.scale_factor;
-                    }
+                    intmax_t raw;
+                    measurement = std::numeric_limits<double>::quiet_NaN();
+                    sample_type = decoders_[i](regs, raw, measurement);
+                }
+
+                sample_prefix const prefix{nowsecs, slave_, item.measure};
+
+                if (sample_type != Reporter::SampleType::regular)
+                    log_out_of_range(prefix,
+                                     decoders_[i],
+                                     raw_register_value(decoders_[i], regs),
+                                     sample_type);
+
+                report(i, nowsecs, measurement, sample_type);
+
+                LOG_IF_S(INFO, sample_type == Reporter::SampleType::regular)
+                  << prefix << register_value{decoders_[i], regs} << '|'
+                  << measurement;
+            }
+        }
+
+        // Coils and discrete inputs, each measure being a single bit
+        void on_bits(infra::when_t nowsecs,
+                     std::error_code const &ec,
+                     uint8_t const *bits)
+        {
+            if (ec)
+                return on_failure(nowsecs, ec);
+
+            last_error_.clear();
+
+            for (size_t i = 0; i != block_.items.size(); ++i)
+            {
+                auto const &item  = block_.items[i];
+                auto &measurement = measurements_[i];
+                auto &sample_type = sample_types_[i];
+
+                intmax_t const bit =
+                  bits[item.offset / 8] >> (item.offset % 8) & 1;
+
+                measurement = std::numeric_limits<double>::quiet_NaN();
+                sample_type = decoders_[i].evaluate(bit, measurement);
+
+                sample_prefix const prefix{nowsecs, slave_, item.measure};
+
+                if (sample_type != Reporter::SampleType::regular)
+                    log_out_of_range(prefix, decoders_[i], bit, sample_type);
+
+                report(i, nowsecs, measurement, sample_type);
+
+                LOG_IF_S(INFO, sample_type == Reporter::SampleType::regular)
+                  << prefix << raw_value{bit} << '|' << measurement;
+            }
+        }
+
+        // Bookkeeping common to register and bit blocks, once read
+        void on_read(std::error_code const &ec)
+        {
+            in_flight_ = false;
+            track_health(ec);
+
+            cached_    = !ec && change_counter_;
+            counter_   = next_counter_;
+            cached_at_ = polled_at_;
+        }
+
+        void read_block()
+        {
+            if (modbus::is_bit(block_.reg_type))
+                slave_.async_read_bits(
+                  block_.reg_type, block_.address, block_.num_regs, on_bits_);
+            else
+                slave_.async_read_registers(
+                  block_.reg_type, block_.address, block_.num_regs, on_read_);
+        }
+
+        void on_counter(std::error_code const &ec, uint16_t const *registers)
+        {
+            if (ec)
+            {
+                in_flight_ = false;
+                cached_    = false;
+                track_health(ec);
+                return on_failure(polled_at_, ec);
+            }
+
+            if (!cached_ || registers[0] != counter_)
+            {
+                next_counter_ = registers[0];
+                return read_block();
+            }
+
+            in_flight_ = false;
+            track_health(ec);
+
+            if (image_)
+                image_->refresh(image_unit_,
+                                block_.reg_type,
+                                block_.address,
+                                block_.num_regs,
+                                modbus::register_image::clock_type::now());
+
+            LOG_S(1) << polled_at_.time_since_epoch().count() << "|"
+                     << slave_.name() << "@" << slave_.id()
+                     << "|unchanged, repeating the samples of "
+                     << cached_at_.time_since_epoch().count();
+
+            for (size_t i = 0; i != block_.items.size(); ++i)
+                report(i,
+                       cached_at_,
+                       measurements_[i],
+                       sample_types_[i] == Reporter::SampleType::regular
+                         ? Reporter::SampleType::repeated
+                         : sample_types_[i]);
+        }
+
+        // RANDOM slaves only know about the configured addresses, so each
+        // of their measures is read on its own through the single-value API
+        void poll_single(infra::when_t nowsecs)
+        {
+            for (size_t i = 0; i != block_.items.size(); ++i)
+            {
+                auto const &meas         = block_.items[i].measure;
+                auto const &source_value = meas.source;
+
+                sample_prefix const prefix{nowsecs, slave_, meas};
+
+                Reporter::SampleType sample_type =
+                  Reporter::SampleType::read_failure;
+                double measurement = std::numeric_limits<double>::quiet_NaN();
+
+                LOG_SCOPE_F(1, "Reading register");
+                auto const reg_value = slave_.try_read_value(
+                  block_.reg_type,
+                  source_value.address,
+                  modbus::reg_size(source_value.value_type),
+                  source_value.endianess);
+
+                if (reg_value)
+                {
+                    sample_type =
+                      decoders_[i].evaluate(*reg_value, measurement);
+                    if (sample_type != Reporter::SampleType::regular)
+                        log_out_of_range(
+                          prefix, decoders_[i], *reg_value, sample_type);
                 }
                 else
+                    LOG_S(ERROR) << prefix
+                                 << "|FAILED:" << reg_value.error().message();
+
+                report(i, nowsecs, measurement, sample_type);
+
+                LOG_IF_S(INFO, sample_type == Reporter::SampleType::regular)
+                  << prefix << raw_value{*reg_value} << '|' << measurement;
+            }
+        }
+
+        static std::vector<column_run> plan_columns(read_block_t const &block)
+        {
+            std::vector<column_run> columns;
+
+            for (size_t i = 0; i != block.items.size(); ++i)
+            {
+                auto const &item   = block.items[i];
+                auto const &source = item.measure.source;
+                if (!column_t::supports(source.value_type))
+                    continue;
+
+                bool extends = false;
+                if (!columns.empty())
                 {
-                    uintmax_t const min_threshold =
-                      source_value.min_read_value.as_unsigned();
-                    uintmax_t const max_threshold =
-                      source_value.max_read_value.as_unsigned();
-                    uintmax_t const unsigned_value =
-                      static_cast<uintmax_t>(reg_value);
-
-                    if (unsigned_value < min_threshold)
-                    {
-                        sample_type = Reporter::SampleType::underflow;
-                        LOG_S(WARNING)
-                          << msg.str() << "|UNDERFLOW: " << unsigned_value
-                          << " < " << min_threshold;
-                    }
-                    else if (unsigned_value > max_threshold)
-                    {
-                        sample_type = Reporter::SampleType::overflow;
-                        LOG_S(WARNING)
-                          << msg.str() << "|OVERFLOW: " << unsigned_value
-                          << " > " << max_threshold;
-                    }
-                    else
-                    {
-                        sample_type = Reporter::SampleType::regular;
-                        measurement = static_cast<double>(unsigned_value) *
-                                      source_value.scale_factor;
-                    }
+                    auto const &last = columns.back();
+                    auto const next  = last.first_item + last.column.size();
+                    auto const &prev = block.items[next - 1];
+
+                    auto const regsize = modbus::reg_size(source.value_type);
+
+                    extends = next == i &&
+                              last.column.value_type == source.value_type &&
+                              last.column.endianess == source.endianess &&
+                              prev.offset + regsize == item.offset;
                 }
+
+                if (!extends)
+                    columns.push_back(
+                      {i, column_t(source.value_type, source.endianess)});
+                columns.back().column.append(source);
             }
-            catch (std::exception &e)
+
+            return columns;
+        }
+
+    public:
+        block_poller(Reporter &reporter,
+                     modbus::slave &slave,
+                     slave_health &health,
+                     read_block_t block,
+                     Reporter::channel *channel,
+                     modbus::register_image *image,
+                     modbus::slave_id_t image_unit,
+                     bool block_reads,
+                     std::shared_ptr<change_counter> counter)
+          : reporter_(reporter)
+          , slave_(slave)
+          , health_(health)
+          , breaker_(health.breaker)
+          , block_(std::move(block))
+          , handles_(
+              [&]
+              {
+                  std::vector<Reporter::measure_handle_t> handles;
+                  for (auto const &item: block_.items)
+                      handles.push_back(reporter.measure_handle(
+                        {slave.name(), slave.id()}, item.measure.name));
+                  return handles;
+              }())
+          , decoders_(
+              [&]
+              {
+                  std::vector<sample_decoder> decoders;
+                  for (auto const &item: block_.items)
+                      decoders.emplace_back(item.measure.source);
+                  return decoders;
+              }())
+          , columns_(plan_columns(block_))
+          , measurements_(block_.items.size())
+          , sample_types_(block_.items.size())
+          , channel_(channel)
+          , image_(image)
+          , image_unit_(image_unit)
+          , block_reads_(block_reads)
+          , change_counter_(std::move(counter))
+          , cached_regs_(block_.cache_ttl > std::chrono::seconds::zero() &&
+                             !modbus::is_bit(block_.reg_type)
+                           ? block_.num_regs
+                           : 0)
+          , on_read_(
+              [this](std::error_code const &ec, uint16_t const *registers)
+              {
+                  on_read(ec);
+                  on_block(polled_at_, ec, registers);
+
+                  if (!ec && !cached_regs_.empty())
+                      slave_.cache().store(
+                        block_.reg_type,
+                        block_.address,
+                        block_.num_regs,
+                        registers,
+                        modbus::register_cache::clock_type::now());
+                  if (!ec && image_)
+                      image_->store(image_unit_,
+                                    block_.reg_type,
+                                    block_.address,
+                                    block_.num_regs,
+                                    registers,
+                                    modbus::register_image::clock_type::now());
+              })
+          , on_bits_(
+              [this](std::error_code const &ec, uint8_t const *bits)
+              {
+                  on_read(ec);
+                  on_bits(polled_at_, ec, bits);
+
+                  if (!ec && image_)
+                      image_->store_bits(
+                        image_unit_,
+                        block_.reg_type,
+                        block_.address,
+                        block_.num_regs,
+                        bits,
+                        modbus::register_image::clock_type::now());
+              })
+          , on_counter_(
+              [this](std::error_code const &ec, uint16_t const *registers)
+              { on_counter(ec, registers); })
+        {
+            if (image_ && block_reads_)
+                image_->add_range(image_unit_,
+                                  block_.reg_type,
+                                  block_.address,
+                                  block_.num_regs);
+        }
+
+        // The handlers refer to this
+        block_poller(block_poller const &) = delete;
+        block_poller &operator=(block_poller const &) = delete;
+
+        [[nodiscard]] read_block_t const &block() const noexcept
+        {
+            return block_;
+        }
+
+        void poll(infra::when_t nowsecs)
+        {
+            if (!block_reads_)
+                return poll_single(nowsecs);
+
+            // With an asynchronous transport, the previous request could
+            // still be waiting for its turn on a congested bus
+            if (in_flight_)
             {
-                sample_type = Reporter::SampleType::read_failure;
-                LOG_S(ERROR) << msg.str() << "|FAILED:" << e.what();
+                LOG_S(WARNING) << nowsecs.time_since_epoch().count() << "|"
+                               << slave_.name() << "@" << slave_.id()
+                               << "|previous block read still in progress";
+                return;
             }
 
-            reporter.add_measurement({slave.name(), slave.id()},
-                                     meas.name,
-                                     nowsecs,
-                                     measurement,
-                                     sample_type);
+            if (!cached_regs_.empty() &&
+                slave_.cache().lookup(block_.reg_type,
+                                      block_.address,
+                                      block_.num_regs,
+                                      block_.cache_ttl,
+                                      modbus::register_cache::clock_type::now(),
+                                      cached_regs_.data()))
+            {
+                LOG_S(1) << nowsecs.time_since_epoch().count() << "|"
+                         << slave_.name() << "@" << slave_.id()
+                         << "|served from cache";
+                return on_block(nowsecs, {}, cached_regs_.data());
+            }
 
-            LOG_IF_S(INFO, sample_type == Reporter::SampleType::regular)
-              << msg.str() << '|' << measurement;
-        };
+            // Don't waste the bus on a slave known to be unresponsive, but
+            // still account for the missing samples
+            if (!breaker_.allow(infra::circuit_breaker::clock_type::now()))
+            {
+                LOG_S(1) << nowsecs.time_since_epoch().count() << "|"
+                         << slave_.name() << "@" << slave_.id()
+                         << "|skipped, slave unresponsive";
+                for (size_t i = 0; i != block_.items.size(); ++i)
+                    report(i,
+                           nowsecs,
+                           std::numeric_limits<double>::quiet_NaN(),
+                           Reporter::SampleType::read_failure);
+                return;
+            }
+
+            in_flight_ = true;
+            polled_at_ = nowsecs;
+            LOG_SCOPE_F(1, "Reading register block");
+            if (change_counter_)
+                change_counter_->read(nowsecs, on_counter_);
+            else
+                read_block();
+        }
+    };
+} // namespace
+
+Executor::Executor(infra::PeriodicScheduler &scheduler,
+                   Reporter &reporter,
+                   configuration_map_t const &configmap,
+                   bool bus_threads,
+                   modbus::register_image *image)
+{
+    std::unordered_map<std::string, Reporter::channel *> bus_channels;
+    std::string const tcp_lane = "tcp";
+    // The gateway only tells the servers apart by their unit id
+    std::map<int, std::string> gateway_units;
+
+    for (auto const &el: configmap)
+    {
+        auto const &key           = el.first;
+        auto const &server_config = el.second.server;
 
-        scheduler.addTask("Server_" + std::to_string(slave.id()) + "/" +
-                            meas.name,
-                          meas.sampling_period,
-                          meas_task,
-                          infra::PeriodicScheduler::TaskMode::execute_at_start);
+        if (image && !server_config.random_source())
+        {
+            auto const unit = gateway_units.try_emplace(
+              server_config.gateway_unit_id, server_config.name);
+            if (!unit.second)
+                throw std::invalid_argument(
+                  "Gateway unit id " +
+                  std::to_string(server_config.gateway_unit_id) +
+                  " of server " + server_config.name +
+                  " already used by server " + unit.first->second +
+                  ", set gateway_unit_id");
+        }
+
+        std::string lane;
+        Reporter::channel *channel = nullptr;
+        if (bus_threads && !server_config.random_source())
+        {
+            lane = server_config.tcp_endpoint.empty()
+                     ? server_config.serial_device
+                     : tcp_lane;
+            auto &bus_ch = bus_channels[lane];
+            if (!bus_ch)
+                bus_ch = &reporter.add_channel();
+            channel = bus_ch;
+        }
+
+        modbus::latency_tracker const timeouts(
+          server_config.answering_time,
+          server_config.timeout_factor,
+          server_config.min_answering_time);
+
+        auto slave_insertion_result = [&]()
+        {
+            if (server_config.random_source())
+            {
+                // A RANDOM measurements generator for testing purposes....
+
+                // Collect the random generator MEAN/STDEV parameters
+                std::map<int, modbus::RandomSlave::random_params>
+                  random_params;
+
+                for (auto const &m: el.second.measures)
+                    random_params.try_emplace(m.source.address,
+                                              m.source.random_mean_dev);
+
+                return slaves_.try_emplace(
+                  // Key
+                  key,
+                  // Args for RANDOM Slave
+                  modbus::slave::model_type<modbus::RandomSlave>{},
+                  server_config.modbus_id,
+                  server_config.name,
+                  random_params,
+                  loguru::g_stderr_verbosity >= loguru::Verbosity_MAX);
+            }
+            else if (!server_config.tcp_endpoint.empty())
+            {
+                // A modbus TCP device, or a device behind a gateway
+
+                return slaves_.try_emplace(
+                  // Key
+                  key,
+                  // Args for TCP MODBUS Slave
+                  modbus::slave::model_type<modbus::TCPSlave>{},
+                  server_config.modbus_id,
+                  server_config.name,
+                  get_tcp_connection(scheduler, server_config, lane),
+                  timeouts);
+            }
+            else if (server_config.async_transport)
+            {
+                // The real modbus slave data-source, through the
+                // non-blocking transport
+
+                return slaves_.try_emplace(
+                  // Key
+                  key,
+                  // Args for ASIO MODBUS Slave
+                  modbus::slave::model_type<modbus::AsioRTUSlave>{},
+                  server_config.modbus_id,
+                  server_config.name,
+                  get_asio_bus(scheduler, server_config, lane),
+                  timeouts);
+            }
+            else
+            {
+                // The real modbus slave data-source...
+
+                return slaves_.try_emplace(
+                  // Key
+                  key,
+                  // Args for MODBUS Slave
+                  modbus::slave::model_type<modbus::RTUSlave>{},
+                  server_config.modbus_id,
+                  server_config.name,
+                  get_bus(server_config),
+                  timeouts);
+            }
+        }();
+
+
+        if (!slave_insertion_result.second)
+            throw std::runtime_error(
+              "Failed creating modbus slave for modbus id " +
+              key.to_string());
+
+        auto &health =
+          health_
+            .try_emplace(key,
+                         slave_health{{server_config.breaker_threshold,
+                                       server_config.sampling_period,
+                                       server_config.breaker_max_backoff},
+                                      {}})
+            .first->second;
+
+        add_schedule(scheduler,
+                     reporter,
+                     slave_insertion_result.first->second,
+                     health,
+                     el.second,
+                     lane,
+                     channel,
+                     image);
+
+        add_control(scheduler,
+                    el.second,
+                    slave_insertion_result.first->second,
+                    lane,
+                    timeouts);
+    }
+}
+
+bool
+Executor::control(
+  server_key_t const &key,
+  std::function<void(modbus::slave &, descriptor_t const &)> f)
+{
+    auto it = controls_.find(key);
+    if (key.transport.empty())
+    {
+        // Whatever the transport, as long as it is the only one
+        auto const matches = [&key](auto const &el)
+        { return el.first.modbus_id == key.modbus_id; };
+        it = std::find_if(controls_.begin(), controls_.end(), matches);
+        if (it != controls_.end() &&
+            std::find_if(std::next(it), controls_.end(), matches) !=
+              controls_.end())
+            return false;
+    }
+    if (it == controls_.end())
+        return false;
+
+    auto &target = it->second;
+    target.dispatch([&target, f = std::move(f)]
+                    { f(*target.slave, target.descriptor); });
+    return true;
+}
+
+std::shared_ptr<modbus::RTUBus>
+Executor::get_bus(modbus_server_t const &server)
+{
+    modbus::serial_line const line(server.serial_device, server.line_config);
+
+    if (asio_buses_.count(server.serial_device))
+        throw std::invalid_argument("Conflicting transport for server " +
+                                    server.name + " on " +
+                                    server.serial_device);
+
+    auto &bus = buses_[server.serial_device];
+    if (!bus)
+    {
+        bus = std::make_shared<modbus::RTUBus>(
+          line, loguru::g_stderr_verbosity >= loguru::Verbosity_MAX);
+    }
+    else if (bus->line() != line)
+    {
+        throw std::invalid_argument(
+          "Conflicting line_config for server " + server.name + " on " +
+          server.serial_device + ": " + server.line_config);
+    }
+
+    return bus;
+}
+
+std::shared_ptr<modbus::AsioRTUBus>
+Executor::get_asio_bus(infra::PeriodicScheduler &scheduler,
+                       modbus_server_t const &server,
+                       std::string const &lane)
+{
+    modbus::serial_line const line(server.serial_device, server.line_config);
+
+    if (buses_.count(server.serial_device))
+        throw std::invalid_argument("Conflicting transport for server " +
+                                    server.name + " on " +
+                                    server.serial_device);
+
+    auto &bus = asio_buses_[server.serial_device];
+    if (!bus)
+    {
+        // The bus must be serviced by the same thread polling its slaves
+        bus = std::make_shared<modbus::AsioRTUBus>(scheduler.context(lane),
+                                                   line);
+    }
+    else if (bus->line() != line)
+    {
+        throw std::invalid_argument(
+          "Conflicting line_config for server " + server.name + " on " +
+          server.serial_device + ": " + server.line_config);
+    }
+
+    return bus;
+}
+
+std::shared_ptr<modbus::TCPConnection>
+Executor::get_tcp_connection(infra::PeriodicScheduler &scheduler,
+                             modbus_server_t const &server,
+                             std::string const &lane)
+{
+    auto &connection = tcp_connections_[server.tcp_endpoint];
+    if (!connection)
+    {
+        connection = std::make_shared<modbus::TCPConnection>(
+          scheduler.context(lane),
+          server.tcp_endpoint,
+          server.tcp_max_in_flight);
+    }
+
+    return connection;
+}
+
+void
+Executor::add_schedule(infra::PeriodicScheduler &scheduler,
+                       Reporter &reporter,
+                       modbus::slave &slave,
+                       slave_health &health,
+                       descriptor_t const &descriptor,
+                       std::string const &lane,
+                       Reporter::channel *channel,
+                       modbus::register_image *image)
+{
+    // Random slaves only know about the configured addresses, so they can't
+    // be read in blocks
+    bool const block_reads = !descriptor.server.random_source();
+    auto const max_block_registers =
+      block_reads ? descriptor.server.max_block_registers : 0;
+
+    // Shared by the server's blocks, read once for those polled together
+    std::shared_ptr<change_counter> counter;
+    if (block_reads && descriptor.server.change_counter_address >= 0)
+        counter = std::make_shared<change_counter>(
+          slave,
+          descriptor.server.change_counter_address,
+          descriptor.server.change_counter_reg_type);
+
+    for (auto &block:
+         plan_read_blocks(descriptor.measures, max_block_registers))
+    {
+        auto const poller = std::make_shared<block_poller>(
+          reporter,
+          slave,
+          health,
+          std::move(block),
+          channel,
+          image,
+          descriptor.server.gateway_unit_id,
+          block_reads,
+          counter);
+
+        auto const &items = poller->block().items;
+        auto task_name    = "Server_" + descriptor.server.key().to_string() +
+                         "/" + items.front().measure.name +
+                         (items.size() > 1
+                            ? "+" + std::to_string(items.size() - 1)
+                            : std::string{});
+
+        scheduler.addTask(
+          std::move(task_name),
+          poller->block().sampling_period,
+          [poller](infra::when_t nowsecs) { poller->poll(nowsecs); },
+          infra::PeriodicScheduler::TaskMode::execute_at_start,
+          lane);
+    }
+}
+
+void
+Executor::add_control(infra::PeriodicScheduler &scheduler,
+                      descriptor_t const &descriptor,
+                      modbus::slave &slave,
+                      std::string const &lane,
+                      modbus::latency_tracker const &timeouts)
+{
+    auto const &server = descriptor.server;
+
+    auto &target      = controls_[server.key()];
+    target.descriptor = descriptor;
+
+    if (server.random_source())
+    {
+        // Nothing to contend for, but the generator isn't thread safe
+        target.slave = &slave;
+    }
+    else if (!server.tcp_endpoint.empty())
+    {
+        target.priority_slave = std::make_unique<modbus::slave>(
+          modbus::slave::model_type<modbus::TCPSlave>{},
+          server.modbus_id,
+          server.name,
+          get_tcp_connection(scheduler, server, lane),
+          timeouts,
+          true);
+    }
+    else if (server.async_transport)
+    {
+        target.priority_slave = std::make_unique<modbus::slave>(
+          modbus::slave::model_type<modbus::AsioRTUSlave>{},
+          server.modbus_id,
+          server.name,
+          get_asio_bus(scheduler, server, lane),
+          timeouts,
+          true);
+    }
+    else
+    {
+        // The bus serializes the transactions of all the threads, the
+        // priority ones first
+        target.priority_slave = std::make_unique<modbus::slave>(
+          modbus::slave::model_type<modbus::RTUSlave>{},
+          server.modbus_id,
+          server.name,
+          get_bus(server),
+          timeouts,
+          true);
+        target.dispatch = [](std::function<void()> const &f) { f(); };
+    }
+
+    if (target.priority_slave)
+    {
+        // So that the control writes invalidate what the polls have cached
+        target.priority_slave->share_cache(slave);
+        target.slave = target.priority_slave.get();
     }
+
+    // The asio transports are only ever driven by the thread of their lane
+    if (!target.dispatch)
+        target.dispatch =
+          [&ctx = scheduler.context(lane)](std::function<void()> f)
+        { modbus::net::post(ctx, std::move(f)); };
 }
 } // namespace measure
+
+namespace {
+struct fake_counted_state
+{
+    std::vector<uint16_t> regs = std::vector<uint16_t>(256);
+    // Reads per starting address
+    std::map<int, int> reads;
+};
+
+class FakeCountedDevice: public modbus::slave_concept
+{
+    fake_counted_state &s_;
+
+public:
+    explicit FakeCountedDevice(fake_counted_state &s)
+      : slave_concept(1, "fake"), s_(s)
+    {}
+
+    std::error_code try_read_registers(modbus::regtype,
+                                       int address,
+                                       int num_regs,
+                                       uint16_t *dest) override
+    {
+        ++s_.reads[address];
+        std::copy_n(s_.regs.begin() + address, num_regs, dest);
+        return {};
+    }
+};
+} // namespace
+
+TEST_CASE("Blocks are read again only once the change counter moves")
+{
+    using namespace std::chrono_literals;
+    using measure::Reporter;
+
+    fake_counted_state device;
+    device.regs[0]   = 1; // The change counter
+    device.regs[10]  = 100;
+    device.regs[200] = 200;
+    modbus::slave s(modbus::slave::model_type<FakeCountedDevice>{}, device);
+
+    char out_folder[] = "/tmp/meas_executor_XXXXXX";
+    REQUIRE(mkdtemp(out_folder));
+    Reporter reporter(out_folder);
+
+    std::vector<measure::measure_t> measures;
+    for (auto const address: {10, 200})
+    {
+        measure::measure_t m;
+        m.name               = "m" + std::to_string(address);
+        m.sampling_period    = 5s;
+        m.report_raw_samples = true;
+        m.source.address     = address;
+        m.source.endianess   = modbus::word_endianess::little;
+        m.source.reg_type    = modbus::regtype::holding;
+        m.source.value_type  = modbus::value_type::UINT16;
+        m.source.min_read_value.assign_min(m.source.value_type);
+        m.source.max_read_value.assign_max(m.source.value_type);
+        measures.push_back(m);
+
+        reporter.configure_measurement(
+          {s.name(), s.id()}, m.name, {m.sampling_period, false, true});
+    }
+
+    // Two blocks, sharing the server's counter
+    auto const blocks = measure::plan_read_blocks(measures, 125);
+    REQUIRE(blocks.size() == 2);
+
+    measure::slave_health health{{0, 5s, 300s}, {}};
+    auto const counter = std::make_shared<measure::change_counter>(
+      s, 0, modbus::regtype::holding);
+    std::vector<std::unique_ptr<measure::block_poller>> pollers;
+    for (auto const &block: blocks)
+        pollers.push_back(std::make_unique<measure::block_poller>(
+          reporter, s, health, block, nullptr, nullptr, 1, true, counter));
+
+    auto const poll = [&](infra::when_t nowsecs)
+    {
+        for (auto const &poller: pollers)
+            poller->poll(nowsecs);
+    };
+
+    infra::when_t const t0(1000s);
+    poll(t0);
+    CHECK(device.reads == std::map<int, int>{{0, 1}, {10, 1}, {200, 1}});
+
+    // Unchanged counter, the samples of t0 are repeated
+    device.regs[10] = 101;
+    poll(t0 + 5s);
+    CHECK(device.reads == std::map<int, int>{{0, 2}, {10, 1}, {200, 1}});
+
+    device.regs[0] = 2;
+    poll(t0 + 10s);
+    CHECK(device.reads == std::map<int, int>{{0, 3}, {10, 2}, {200, 2}});
+
+    auto const t1 = t0 + 15s;
+    reporter.close_period(t1);
+
+    auto const report_file =
+      std::string(out_folder) + "/" + infra::to_compact_string(t1) + ".json";
+    nlohmann::json report;
+    std::ifstream(report_file) >> report;
+    std::remove(report_file.c_str());
+    ::rmdir(out_folder);
+
+    auto const &results = report["servers"][0]["results"];
+    REQUIRE(results.size() == 2);
+    auto const &data = results[0]["data"];
+    CHECK(results[0]["measure_name"] == "m10");
+    CHECK(data["period_repeated"] == 1);
+    CHECK(data["samples"] ==
+          nlohmann::json::parse(R"([{"t": 1000, "v": 100.0},
+                                    {"t": 1000, "v": 100.0},
+                                    {"t": 1010, "v": 101.0}])"));
+    CHECK(results[1]["data"]["samples"] ==
+          nlohmann::json::parse(R"([{"t": 1000, "v": 200.0},
+                                    {"t": 1000, "v": 200.0},
+                                    {"t": 1010, "v": 200.0}])"));
+}
+
+TEST_CASE("Servers are told apart by their transport and modbus id")
+{
+    measure::configuration_map_t configmap;
+    for (auto const *endpoint: {"127.0.0.1:1", "127.0.0.1:2"})
+    {
+        measure::descriptor_t descriptor;
+        descriptor.server.modbus_id       = 1;
+        descriptor.server.gateway_unit_id = 1;
+        descriptor.server.name            = endpoint;
+        descriptor.server.tcp_endpoint    = endpoint;
+        configmap.try_emplace(descriptor.server.key(), descriptor);
+    }
+    REQUIRE(configmap.size() == 2);
+
+    infra::PeriodicScheduler scheduler;
+    measure::Reporter reporter("/tmp");
+
+    // The gateway can't tell them apart without their own unit ids
+    modbus::register_image image;
+    CHECK_THROWS_AS(
+      measure::Executor(scheduler, reporter, configmap, false, &image),
+      std::invalid_argument);
+    configmap.rbegin()->second.server.gateway_unit_id = 2;
+    measure::Executor executor(scheduler, reporter, configmap, false, &image);
+
+    std::string controlled;
+    auto const control = [&](measure::server_key_t const &key)
+    {
+        return executor.control(
+          key,
+          [&controlled](modbus::slave &, measure::descriptor_t const &d)
+          { controlled = d.server.name; });
+    };
+
+    CHECK(control({"127.0.0.1:2", 1}));
+    scheduler.context().poll();
+    CHECK(controlled == "127.0.0.1:2");
+
+    // A modbus id alone must be unambiguous
+    CHECK(!control({"", 1}));
+    CHECK(!control({"127.0.0.1:3", 1}));
+    CHECK(!control({"127.0.0.1:1", 2}));
+}
@@ -1,17 +1,36 @@
 #pragma once
 
+#include "circuit_breaker.h"
+#include "infra.hpp"
 #include "meas_config.h"
+#include "meas_reporter.h"
 #include "modbus_slave.hpp"
+#include "register_image.hpp"
 
 #include <chrono>
+#include <functional>
 #include <loguru.hpp>
+#include <map>
+#include <memory>
+#include <string>
 #include <unordered_map>
 namespace infra {
 class PeriodicScheduler;
 }
+namespace modbus {
+class AsioRTUBus;
+class TCPConnection;
+} // namespace modbus
 namespace measure {
 
-class Reporter;
+// The breaker counts poll cycles, not block reads: however many of the
+// blocks polled at the same time go unanswered, the cycle is a single failure
+struct slave_health
+{
+    infra::circuit_breaker breaker;
+    // Last cycle counted as a failure
+    infra::when_t failed_cycle;
+};
 
 class Executor
 {
@@ -19,75 +38,80 @@ class Executor
     // search through the container, but that would force const on all
     // the elements and that doesn't work well with the lower level modbus C-api
     // which works with (non-const) modbus_t *
-    std::unordered_map<modbus::slave_id_t, modbus::slave> slaves_;
+    std::map<server_key_t, modbus::slave> slaves_;
+
+    // Health of each slave, shared by all the tasks polling it
+    std::map<server_key_t, slave_health> health_;
+
+    // All the slaves on the same serial device share a single bus
+    std::unordered_map<std::string, std::shared_ptr<modbus::RTUBus>> buses_;
+    std::unordered_map<std::string, std::shared_ptr<modbus::AsioRTUBus>>
+      asio_buses_;
+    // ... and all the servers behind the same TCP endpoint a connection
+    std::unordered_map<std::string, std::shared_ptr<modbus::TCPConnection>>
+      tcp_connections_;
+
+    // A server as the control requests see it: a slave sharing the
+    // server's transport, with priority over the polls, and how to get onto
+    // the thread the transport requires
+    struct control_target
+    {
+        std::unique_ptr<modbus::slave> priority_slave;
+        modbus::slave *slave = nullptr;
+        descriptor_t descriptor;
+        std::function<void(std::function<void()>)> dispatch;
+    };
+    std::map<server_key_t, control_target> controls_;
+
+    std::shared_ptr<modbus::RTUBus> get_bus(modbus_server_t const &server);
+    std::shared_ptr<modbus::AsioRTUBus>
+    get_asio_bus(infra::PeriodicScheduler &scheduler,
+                 modbus_server_t const &server,
+                 std::string const &lane);
+    std::shared_ptr<modbus::TCPConnection>
+    get_tcp_connection(infra::PeriodicScheduler &scheduler,
+                       modbus_server_t const &server,
+                       std::string const &lane);
 
     void add_schedule(infra::PeriodicScheduler &scheduler,
                       Reporter &reporter,
                       modbus::slave &slave,
-                      std::vector<measure_t> const &measures);
+                      slave_health &health,
+                      descriptor_t const &descriptor,
+                      std::string const &lane,
+                      Reporter::channel *channel,
+                      modbus::register_image *image);
+
+    void add_control(infra::PeriodicScheduler &scheduler,
+                     descriptor_t const &descriptor,
+                     modbus::slave &slave,
+                     std::string const &lane,
+                     modbus::latency_tracker const &timeouts);
 
 public:
+    // With bus_threads, the slaves of each serial bus are polled on a
+    // dedicated thread, handing their samples over to the reporter through
+    // a per-bus channel, and all the TCP servers share one more thread, as
+    // their transport never blocks. Otherwise everything runs on the
+    // scheduler's main thread. The blocks read are kept in image, if any,
+    // under each server's gateway unit id, the RANDOM servers' values
+    // excepted, as they aren't read in blocks
     Executor(infra::PeriodicScheduler &scheduler,
              Reporter &reporter,
-             configuration_map_t const &configmap)
-    {
-        for (auto const &el: configmap)
-        {
-            auto const &server_config = el.second.server;
-
-            auto slave_insertion_result = [&]()
-            {
-                if (server_config.serial_device.empty())
-                {
-                    // A RANDOM measurements generator for testing purposes....
-
-                    // Collect the random generator MEAN/STDEV parameters
-                    std::map<int, modbus::RandomSlave::random_params>
-                      random_params;
-
-                    for (auto const &m: el.second.measures)
-                        random_params.try_emplace(m.source.address,
-                                                  m.source.random_mean_dev);
-
-                    return slaves_.try_emplace(
-                      // Key
-                      server_config.modbus_id,
-                      // Args for RANDOM Slave
-                      modbus::slave::model_type<modbus::RandomSlave>{},
-                      server_config.modbus_id,
-                      server_config.name,
-                      random_params,
-                      loguru::g_stderr_verbosity >= loguru::Verbosity_MAX);
-                }
-                else
-                {
-                    // The real modbus slave data-source...
-
-                    return slaves_.try_emplace(
-                      // Key
-                      server_config.modbus_id,
-                      // Args for MODBUS Slave
-                      modbus::slave::model_type<modbus::RTUSlave>{},
-                      server_config.modbus_id,
-                      server_config.name,
-                      modbus::RTUSlave::serial_line(server_config.serial_device,
-                                                    server_config.line_config),
-                      server_config.answering_time,
-                      loguru::g_stderr_verbosity >= loguru::Verbosity_MAX);
-                }
-            }();
-
-
-            if (!slave_insertion_result.second)
-                throw std::runtime_error(
-                  "Failed creating modbus slave for modbus id " +
-                  std::to_string(server_config.modbus_id));
+             configuration_map_t const &configmap,
+             bool bus_threads = false,
+             modbus::register_image *image = nullptr);
 
-            add_schedule(scheduler,
-                         reporter,
-                         slave_insertion_result.first->second,
-                         el.second.measures);
-        }
-    }
+    // Run f(slave, descriptor) for the given server, the slave's
+    // transactions going ahead of the polls on the same bus. f runs on the
+    // calling thread for the blocking serial buses, on the thread servicing
+    // the server otherwise, possibly after control() has returned. f must
+    // only use the slave's asynchronous API, the asio transports being
+    // driven by that very thread. A key without transport designates the
+    // server with that modbus id, if there's a single one. Returns false for
+    // an unknown or ambiguous server
+    bool control(
+      server_key_t const &key,
+      std::function<void(modbus::slave &, descriptor_t const &)> f);
 };
 } // namespace measure
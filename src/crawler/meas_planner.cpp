@@ -0,0 +1,160 @@
+#include "meas_planner.h"
+
+#include "doctest.h"
+
+#include <algorithm>
+#include <map>
+#include <modbus.h>
+#include <tuple>
+#include <utility>
+
+namespace measure {
+
+std::vector<read_block_t>
+plan_read_blocks(std::vector<measure_t> const &measures, int max_block_regs)
+{
+    // Only measures sharing the sampling period and the register type can
+    // end up in the same modbus request. Cached measures are kept apart as
+    // well, their blocks being skipped altogether while the cache is fresh
+    using group_key_t =
+      std::tuple<std::chrono::seconds, modbus::regtype, std::chrono::seconds>;
+    std::map<group_key_t, std::vector<measure_t const *>> groups;
+
+    for (auto const &m: measures)
+        groups[{m.sampling_period, m.source.reg_type, m.cache_ttl}]
+          .push_back(&m);
+
+    std::vector<read_block_t> blocks;
+
+    for (auto &group_el: groups)
+    {
+        auto &group = group_el.second;
+        std::stable_sort(std::begin(group),
+                         std::end(group),
+                         [](auto const *lhs, auto const *rhs)
+                         { return lhs->source.address < rhs->source.address; });
+
+        auto const max_block_size =
+          modbus::is_bit(std::get<1>(group_el.first)) && max_block_regs > 0
+            ? MODBUS_MAX_READ_BITS
+            : max_block_regs;
+
+        read_block_t *current = nullptr;
+        for (auto const *m: group)
+        {
+            auto const address  = m->source.address;
+            auto const reg_size = modbus::reg_size(m->source.value_type);
+
+            // Extend the current block only if the measure is adjacent to (or
+            // overlapping with) it and the resulting block still fits in a
+            // single request
+            if (current && address <= current->address + current->num_regs)
+            {
+                auto const new_num_regs =
+                  std::max(current->num_regs,
+                           address - current->address + reg_size);
+
+                if (new_num_regs <= max_block_size)
+                {
+                    current->num_regs = new_num_regs;
+                    current->items.push_back({*m, address - current->address});
+                    continue;
+                }
+            }
+
+            blocks.push_back({std::get<0>(group_el.first),
+                              std::get<1>(group_el.first),
+                              address,
+                              reg_size,
+                              {{*m, 0}},
+                              std::get<2>(group_el.first)});
+            current = &blocks.back();
+        }
+    }
+
+    return blocks;
+}
+
+} // namespace measure
+
+namespace {
+measure::measure_t
+make_measure(std::string name,
+             int address,
+             modbus::value_type vt,
+             modbus::regtype rt          = modbus::regtype::holding,
+             std::chrono::seconds period = std::chrono::seconds(5))
+{
+    measure::measure_t m;
+    m.name              = std::move(name);
+    m.sampling_period   = period;
+    m.source.address    = address;
+    m.source.endianess  = modbus::word_endianess::little;
+    m.source.reg_type   = rt;
+    m.source.value_type = vt;
+    return m;
+}
+} // namespace
+
+TEST_CASE("read blocks coalesce contiguous measures")
+{
+    using modbus::value_type;
+    std::vector<measure::measure_t> measures{
+      make_measure("a", 100, value_type::UINT16),
+      make_measure("b", 101, value_type::INT32),
+      make_measure("c", 103, value_type::UINT64),
+      make_measure("gap", 200, value_type::UINT16),
+      make_measure("input", 104, value_type::UINT16, modbus::regtype::input),
+      make_measure("slow",
+                   102,
+                   value_type::UINT16,
+                   modbus::regtype::holding,
+                   std::chrono::seconds(60)),
+    };
+
+    auto const blocks = measure::plan_read_blocks(measures, 125);
+    REQUIRE(blocks.size() == 4);
+
+    auto const &first = blocks[0];
+    CHECK(first.address == 100);
+    CHECK(first.num_regs == 7);
+    REQUIRE(first.items.size() == 3);
+    CHECK(first.items[2].measure.name == "c");
+    CHECK(first.items[2].offset == 3);
+
+    CHECK(blocks[1].items.front().measure.name == "gap");
+    CHECK(blocks[2].items.front().measure.name == "input");
+    CHECK(blocks[3].items.front().measure.name == "slow");
+}
+
+TEST_CASE("read blocks respect the maximum request size")
+{
+    std::vector<measure::measure_t> measures;
+    for (int i = 0; i != 100; ++i)
+        measures.push_back(make_measure(
+          "m" + std::to_string(i), 2 * i, modbus::value_type::UINT32));
+
+    auto const blocks = measure::plan_read_blocks(measures, 125);
+    REQUIRE(blocks.size() == 2);
+    CHECK(blocks[0].num_regs == 124);
+    CHECK(blocks[1].address == 124);
+    CHECK(blocks[1].num_regs == 76);
+
+    CHECK(measure::plan_read_blocks(measures, 0).size() == measures.size());
+}
+
+TEST_CASE("cached measures get their own blocks")
+{
+    using modbus::value_type;
+    std::vector<measure::measure_t> measures{
+      make_measure("power", 100, value_type::UINT16),
+      make_measure("serial", 101, value_type::UINT32),
+      make_measure("energy", 103, value_type::UINT16),
+    };
+    measures[1].cache_ttl = std::chrono::hours(1);
+
+    auto const blocks = measure::plan_read_blocks(measures, 125);
+    REQUIRE(blocks.size() == 3);
+    CHECK(blocks[2].items.front().measure.name == "serial");
+    CHECK(blocks[2].cache_ttl == std::chrono::hours(1));
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "meas_config.h"
+
+#include <chrono>
+#include <vector>
+
+namespace measure {
+
+// A single modbus read request covering the registers of one or more
+// measures, all sharing the same sampling period, register type and cache
+// TTL
+struct read_block_t
+{
+    struct item_t
+    {
+        measure_t measure;
+        int offset; // Register offset of the measure inside the block
+    };
+
+    std::chrono::seconds sampling_period;
+    modbus::regtype reg_type;
+    int address;
+    int num_regs;
+    std::vector<item_t> items;
+    std::chrono::seconds cache_ttl{};
+};
+
+// Group the measures of a server into the minimum number of contiguous
+// register ranges, each one no larger than max_block_regs registers.
+// A max_block_regs <= 0 disables coalescing, i.e. each measure gets its own
+// block. Coils and discrete inputs are packed 8 to a byte on the wire, so
+// their ranges go up to MODBUS_MAX_READ_BITS bits instead
+std::vector<read_block_t>
+plan_read_blocks(std::vector<measure_t> const &measures, int max_block_regs);
+
+} // namespace measure
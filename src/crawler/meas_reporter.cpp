@@ -3,6 +3,7 @@
 #include "json_support.h"
 
 #include <algorithm>
+#include <cassert>
 #include <cmath>
 #include <iomanip>
 #include <iostream>
@@ -60,28 +61,54 @@ Reporter::configure_measurement(server_key_t const &sk,
           " for server " + sk.to_string());
 }
 
-void
-Reporter::add_measurement(server_key_t const &sk,
-                          std::string const &meas_name,
-                          infra::when_t when,
-                          double value,
-                          SampleType sample_type)
+Reporter::measure_handle_t
+Reporter::measure_handle(server_key_t const &sk, std::string const &meas_name)
 {
     auto server_it = results_.find(sk);
 
     if (server_it == std::end(results_))
-        throw std::runtime_error("add_measurement: unknown server " +
+        throw std::runtime_error("measure_handle: unknown server " +
                                  sk.to_string());
 
     auto &results_for_server = server_it->second;
     auto meas_it             = results_for_server.find(meas_name);
 
     if (meas_it == std::end(results_for_server))
-        throw std::runtime_error("add_measurement: duplicate measure: " +
+        throw std::runtime_error("measure_handle: unknown measure: " +
                                  meas_name + " for server " + sk.to_string());
 
-    auto &data = meas_it->second.data;
+    return measure_handle_t(&meas_it->second);
+}
+
+void
+Reporter::add_measurement(server_key_t const &sk,
+                          std::string const &meas_name,
+                          infra::when_t when,
+                          double value,
+                          SampleType sample_type)
+{
+    add_sample(measure_handle(sk, meas_name).result_->data,
+               when,
+               value,
+               sample_type);
+}
 
+void
+Reporter::add_measurement(sample_t const &sample)
+{
+    assert(sample.measure.result_);
+    add_sample(sample.measure.result_->data,
+               sample.when,
+               sample.value,
+               sample.sample_type);
+}
+
+void
+Reporter::add_sample(data_t &data,
+                     infra::when_t when,
+                     double value,
+                     SampleType sample_type)
+{
     switch (sample_type)
     {
     case SampleType::regular:
@@ -99,12 +126,41 @@ Reporter::add_measurement(server_key_t const &sk,
         ++data.period_overflows;
         ++data.total_overflows;
         break;
+    case SampleType::repeated:
+        data.samples.emplace_back(when, value);
+        ++data.period_repeated;
+        ++data.total_repeated;
+        break;
+    }
+}
+
+Reporter::channel &
+Reporter::add_channel()
+{
+    channels_.push_back(std::make_unique<channel>());
+    return *channels_.back();
+}
+
+void
+Reporter::collect()
+{
+    for (auto &ch: channels_)
+    {
+        ch->queue_.consume_all([this](sample_t const &sample)
+                               { add_measurement(sample); });
+
+        auto const dropped =
+          ch->dropped_.exchange(0, std::memory_order_relaxed);
+        LOG_IF_S(WARNING, dropped != 0)
+          << "collect: " << dropped << " samples dropped on full channel";
     }
 }
 
 void
 Reporter::close_period(infra::when_t now)
 {
+    collect();
+
     ++period_id_;
 
     std::ofstream os = std::ofstream(out_folder_ + '/' +
@@ -148,6 +204,8 @@ Reporter::close_period(infra::when_t now)
               {"total_underflows", result.data.total_underflows},
               {"period_overflows", result.data.period_overflows},
               {"total_overflows", result.data.total_overflows},
+              {"period_repeated", result.data.period_repeated},
+              {"total_repeated", result.data.total_repeated},
             };
             jdata["num_samples"] = result.data.samples.size();
 
@@ -2,11 +2,15 @@
 
 #include "infra.hpp"
 #include "meas_config.h"
+#include "spsc_queue.hpp"
 
+#include <atomic>
 #include <limits>
 #include <map>
+#include <memory>
 #include <tuple>
 #include <utility>
+#include <vector>
 
 namespace measure {
 class Reporter
@@ -18,6 +22,9 @@ public:
         read_failure,
         underflow,
         overflow,
+        // The same value as a previous sample, with its timestamp, the
+        // device not having updated it since
+        repeated,
     };
     struct server_key_t
     {
@@ -36,6 +43,47 @@ public:
         bool report_raw_samples;
     };
 
+private:
+    struct result_t;
+
+public:
+    // Resolved once at configuration time, so that samples can be handed
+    // over without any lookup or string copy
+    class measure_handle_t
+    {
+        friend class Reporter;
+        result_t *result_ = nullptr;
+        explicit measure_handle_t(result_t *r) : result_(r) {}
+
+    public:
+        measure_handle_t() = default;
+    };
+
+    struct sample_t
+    {
+        measure_handle_t measure;
+        infra::when_t when;
+        double value;
+        SampleType sample_type;
+    };
+
+    // Lets a polling thread hand samples over to the Reporter without any
+    // locking: each channel must have a single producer thread, while only
+    // the Reporter's thread drains it
+    class channel
+    {
+        friend class Reporter;
+        infra::spsc_queue<sample_t, 4096> queue_;
+        std::atomic<size_t> dropped_{0};
+
+    public:
+        void push(sample_t const &sample)
+        {
+            if (!queue_.push(sample))
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+    };
+
 private:
     struct stats_t
     {
@@ -54,6 +102,8 @@ private:
         size_t period_underflows{};
         size_t total_overflows{};
         size_t period_overflows{};
+        size_t total_repeated{};
+        size_t period_repeated{};
         stats_t statistics{};
 
         void reset()
@@ -62,6 +112,7 @@ private:
             period_read_failures = 0;
             period_underflows    = 0;
             period_overflows     = 0;
+            period_repeated      = 0;
             statistics           = {};
         }
     };
@@ -78,6 +129,12 @@ private:
     std::map<server_key_t, std::map<meas_key_t, result_t>> results_;
     unsigned int period_id_ = 0;
     std::string out_folder_;
+    std::vector<std::unique_ptr<channel>> channels_;
+
+    static void add_sample(data_t &data,
+                           infra::when_t when,
+                           double value,
+                           SampleType sample_type);
 
     [[nodiscard]] static stats_t calculate_stats(decltype(data_t::samples)
                                                    const &samples);
@@ -89,12 +146,23 @@ public:
                                std::string const &meas_name,
                                descriptor_t descriptor);
 
+    [[nodiscard]] measure_handle_t
+    measure_handle(server_key_t const &sk, std::string const &meas_name);
+
     void add_measurement(server_key_t const &sk,
                          std::string const &meas_name,
                          infra::when_t when,
                          double value,
                          SampleType sample_type);
 
+    void add_measurement(sample_t const &sample);
+
+    // Channels must be all created before any polling thread is started
+    channel &add_channel();
+
+    // Move all the samples pending in the channels into the results
+    void collect();
+
     void close_period(infra::when_t now);
 };
 
@@ -2,6 +2,7 @@
 
 #include <chrono>
 #include <iostream>
+#include <thread>
 
 namespace infra {
 constexpr time_t
@@ -118,17 +119,39 @@ PeriodicScheduler::run()
       },
       false);
     */
-    return io_context_.run();
+    std::vector<std::thread> lane_threads;
+    for (auto& lane: lanes_)
+        lane_threads.emplace_back([&ctx = *lane.second]() { ctx.run(); });
+
+    auto const executed = io_context_.run();
+
+    for (auto& t: lane_threads)
+        t.join();
+
+    return executed;
 }
 
 void
 PeriodicScheduler::addTask(std::string const& name,
                            std::chrono::seconds interval,
                            task_t const& task,
-                           TaskMode mode)
+                           TaskMode mode,
+                           std::string const& lane)
 {
     tasks_.push_back(std::make_unique<scheduled_task>(
-      io_context_, name, interval, task, mode));
+      context(lane), name, interval, task, mode));
+}
+
+io_context&
+PeriodicScheduler::context(std::string const& lane)
+{
+    if (lane.empty())
+        return io_context_;
+
+    auto& lane_ctx = lanes_[lane];
+    if (!lane_ctx)
+        lane_ctx = std::make_unique<io_context>();
+    return *lane_ctx;
 }
 
 } // namespace infra
@@ -10,6 +10,7 @@
 
 #include <chrono>
 #include <functional>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -79,15 +80,27 @@ private:
     };
 
 public:
+    // Runs the main io_context on the calling thread, and each lane's
+    // io_context on a dedicated thread, returning when all of them are done
     unsigned long run();
 
+    // Tasks added to the same (non-empty) lane are executed sequentially on
+    // the lane's own thread, concurrently with the tasks of any other lane.
+    // Tasks without a lane run on the thread calling run()
     void addTask(std::string const& name,
                  std::chrono::seconds interval,
                  task_t const& task,
-                 TaskMode mode);
+                 TaskMode mode,
+                 std::string const& lane = {});
+
+    // The io_context driving the tasks of the given lane, for asynchronous
+    // operations that must be serviced by the same thread
+    io_context& context(std::string const& lane = {});
 
 private:
     io_context io_context_;
+    // Need to hold io_contexts behind a pointer as they're non-movable
+    std::map<std::string, std::unique_ptr<io_context>> lanes_;
     // Need to hold periodic_task behind a pointer as they're non-copy/non-move
     std::vector<std::unique_ptr<scheduled_task>> tasks_;
 };
@@ -0,0 +1,91 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+namespace infra {
+
+// Bounded, lock-free, single-producer/single-consumer ring buffer.
+// push() must only be called by the producer thread and consume_all() only
+// by the consumer thread, neither of them ever blocks
+template <class T, std::size_t Capacity>
+class spsc_queue
+{
+    static_assert(Capacity != 0 && (Capacity & (Capacity - 1)) == 0,
+                  "Capacity must be a power of 2");
+
+    static constexpr std::size_t mask = Capacity - 1;
+
+    std::array<T, Capacity> ring_{};
+
+    // Keep the indexes on different cache lines, so that producer and
+    // consumer don't keep stealing the same line from each other
+    alignas(64) std::atomic<std::size_t> head_{0}; // Next slot to consume
+    alignas(64) std::atomic<std::size_t> tail_{0}; // Next slot to fill
+
+public:
+    // Returns false, leaving the queue untouched, if it is full
+    bool push(T const &value)
+    {
+        auto const tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == Capacity)
+            return false;
+
+        ring_[tail & mask] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Invoke f on every element currently in the queue, in FIFO order,
+    // returning how many were consumed
+    template <class F>
+    std::size_t consume_all(F &&f)
+    {
+        auto head       = head_.load(std::memory_order_relaxed);
+        auto const tail = tail_.load(std::memory_order_acquire);
+        auto const num  = tail - head;
+
+        for (; head != tail; ++head)
+            f(ring_[head & mask]);
+
+        head_.store(head, std::memory_order_release);
+        return num;
+    }
+};
+} // namespace infra
+
+#if defined(DOCTEST_LIBRARY_INCLUDED)
+#    include <memory>
+#    include <thread>
+TEST_CASE("spsc_queue hands over elements in order across threads")
+{
+    auto queue = std::make_unique<infra::spsc_queue<int, 1024>>();
+
+    int constexpr num_elements = 100000;
+    std::thread producer(
+      [&]
+      {
+          for (int i = 0; i != num_elements; ++i)
+              while (!queue->push(i))
+                  std::this_thread::yield();
+      });
+
+    int expected  = 0;
+    bool in_order = true;
+    while (expected != num_elements)
+    {
+        auto const consumed = queue->consume_all(
+          [&](int v)
+          {
+              in_order = in_order && v == expected;
+              ++expected;
+          });
+        if (!consumed)
+            std::this_thread::yield();
+    }
+    producer.join();
+
+    CHECK(in_order);
+    CHECK(queue->consume_all([](int) {}) == 0);
+}
+#endif
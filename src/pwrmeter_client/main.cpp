@@ -10,6 +10,7 @@
 #include <iostream>
 #include <string>
 #include <unistd.h>
+#include <vector>
 
 using namespace std::chrono_literals;
 namespace {
@@ -32,6 +33,16 @@ usage(int res, std::string const &msg = "")
                     <register>
                     <regsize ={{1|2|4}{l|b} | Nr}>
 
+                    |
+                    -D
+                    [-d <device = /dev/ttyCOM1>]
+                    [-c <line_config ="9600:8:N:1">]
+                    [-a <answering_timeout_ms =500>]
+                    [-I(nput registers, instead of holding ones)]
+                    -s <server_id>
+                    <csv_filename>
+                    [<first_register =0> [<last_register =65535>]]
+
                     |
                     -W
                     [-d <device = /dev/ttyCOM1>]
@@ -41,13 +52,70 @@ usage(int res, std::string const &msg = "")
                     <register>
                     <value [0..65535]>
 
+                    |
+                    -X
+                    [-d <device = /dev/ttyCOM1>]
+                    [-c <line_config ="9600:8:N:1">]
+                    [-a <answering_timeout_ms =500>]
+                    [<script =stdin, an operation per line:
+                        R <server_id> <register> <regsize ={{1|2|4}{l|b} | Nr}>
+                        W <server_id> <register> <value [0..65535]>
+                    >]
+
                     |
                     -U
                     [-d <device = /dev/ttyCOM1>]
                     [-c <line_config ="9600:8:N:1">]
                     [-a <answering_timeout_ms =500>]
+                    [-V(erify lines by reading them back)]
+                    [-n <max_retransmissions_per_line =3>]
                     -s <server_id>
                     <filename>
+                    [<image on the device, to only send the changed lines>]
+
+                    |
+                    -F
+                    [-d <device = /dev/ttyCOM1>]
+                    [-c <line_config ="9600:8:N:1">]
+                    [-a <answering_timeout_ms =500>]
+                    -s <server_id>
+                    <file_number>
+                    <filename>
+
+                    |
+                    -G
+                    [-d <device = /dev/ttyCOM1>]
+                    [-c <line_config ="9600:8:N:1">]
+                    [-a <answering_timeout_ms =500>]
+                    -s <server_id>
+                    <file_number>
+                    <num_registers>
+                    <filename>
+
+                    |
+                    -B
+                    [-c <line_config ="9600:8:N:1">]
+                    [-a <answering_timeout_ms =500>]
+                    [-V(erify lines by reading them back)]
+                    [-n <max_retransmissions_per_line =3>]
+                    <manifest, a "<device> <server_id> <filename>" per line>
+
+                    |
+                    -C
+                    [-d <device = /dev/ttyCOM1>]
+                    [-c <line_config ="9600:8:N:1">]
+                    [-a <answering_timeout_ms =500>]
+                    [-i <inter_frame_delay_ms =50>]
+                    [-V(erify lines by reading them back)]
+                    [-n <max_retransmissions_per_line =3>]
+                    <filename>
+                    <server_id>...
+
+                    |
+                    -S
+                    [-c <line_config ="9600:8:N:1">]...
+                    [-T <probe_timeout_ms =50>]
+                    <device>...
                 })"
               << std::endl;
     return res;
@@ -63,7 +131,14 @@ enum class mode_t
     unknown,
     single_read,
     single_write,
+    batch,
+    register_dump,
     flash_update,
+    flash_rollout,
+    flash_broadcast,
+    bus_scan,
+    file_record_upload,
+    file_record_download,
 };
 namespace defaults {
     mode_t const mode = mode_t::unknown;
@@ -73,6 +148,14 @@ namespace defaults {
     std::string const serial_config                = "9600:8:N:1";
     std::chrono::milliseconds const answering_time = 500ms;
 
+    modbus::regtype const dump_type = modbus::regtype::holding;
+
+    bool const verify                               = false;
+    int const max_retries                           = 3;
+    std::chrono::milliseconds const broadcast_delay = 50ms;
+
+    std::chrono::milliseconds const probe_timeout = 50ms;
+
     bool verbose = false;
 } // namespace defaults
 
@@ -84,6 +167,19 @@ inline namespace rtu_parameters {
     auto answering_time = defaults::answering_time;
 } // namespace rtu_parameters
 
+auto dump_type = defaults::dump_type;
+
+inline namespace flash_options {
+    auto verify          = defaults::verify;
+    auto max_retries     = defaults::max_retries;
+    auto broadcast_delay = defaults::broadcast_delay;
+} // namespace flash_options
+
+inline namespace scan_options {
+    std::vector<std::string> line_configs;
+    auto probe_timeout = defaults::probe_timeout;
+} // namespace scan_options
+
 auto verbose = defaults::verbose;
 } // namespace options
 #pragma clang diagnostic pop
@@ -108,7 +204,7 @@ main(int argc, char *argv[])
 
     optind = 1;
     int ch;
-    while ((ch = getopt(argc, argv, "vURWd:c:s:a:h")) != -1)
+    while ((ch = getopt(argc, argv, "vURWXDIFGBCSVn:i:d:c:s:a:T:h")) != -1)
     {
         switch (ch)
         {
@@ -121,14 +217,53 @@ main(int argc, char *argv[])
         case 'W':
             options::mode = options::mode_t::single_write;
             break;
+        case 'X':
+            options::mode = options::mode_t::batch;
+            break;
+        case 'D':
+            options::mode = options::mode_t::register_dump;
+            break;
+        case 'I':
+            options::dump_type = modbus::regtype::input;
+            break;
         case 'U':
             options::mode = options::mode_t::flash_update;
             break;
+        case 'F':
+            options::mode = options::mode_t::file_record_upload;
+            break;
+        case 'G':
+            options::mode = options::mode_t::file_record_download;
+            break;
+        case 'B':
+            options::mode = options::mode_t::flash_rollout;
+            break;
+        case 'C':
+            options::mode = options::mode_t::flash_broadcast;
+            break;
+        case 'S':
+            options::mode = options::mode_t::bus_scan;
+            break;
+        case 'T':
+            options::probe_timeout =
+              std::chrono::milliseconds(std::stoi(optarg));
+            break;
+        case 'i':
+            options::broadcast_delay =
+              std::chrono::milliseconds(std::stoi(optarg));
+            break;
+        case 'V':
+            options::verify = true;
+            break;
+        case 'n':
+            options::max_retries = std::stoi(optarg);
+            break;
         case 'd':
             options::serial_device = optarg;
             break;
         case 'c':
             options::serial_config = optarg;
+            options::line_configs.emplace_back(optarg);
             break;
         case 's':
             options::slave_id = std::stoi(optarg);
@@ -168,6 +303,40 @@ main(int argc, char *argv[])
               rtu_parameters, address, regspec, options::verbose);
             return 0;
         }
+        else if (options::mode == options::mode_t::register_dump)
+        {
+            if (options::slave_id < 0 || argc < 1)
+                return usage(
+                  -1, "missing mandatory parameters for register_dump mode");
+
+            int const first = argc > 1 ? std::strtol(argv[1], nullptr, 0) : 0;
+            int const last =
+              argc > 2 ? std::strtol(argv[2], nullptr, 0) : 0xFFFF;
+            auto const result = modbus::register_dump(rtu_parameters,
+                                                      options::dump_type,
+                                                      first,
+                                                      last,
+                                                      argv[0],
+                                                      options::verbose);
+            return result.registers && result.skipped.empty() ? 0 : -1;
+        }
+        else if (options::mode == options::mode_t::batch)
+        {
+            std::ifstream ifs;
+            if (argc > 0)
+            {
+                ifs.open(argv[0]);
+                if (!ifs)
+                    return usage(-1, std::string("invalid script ") + argv[0]);
+            }
+
+            return modbus::run_batch(rtu_parameters,
+                                     argc > 0 ? ifs : std::cin,
+                                     std::cout,
+                                     options::verbose)
+                     ? -1
+                     : 0;
+        }
         else if (options::mode == options::mode_t::single_write)
         {
             if (options::slave_id < 0 || argc < 2)
@@ -186,9 +355,95 @@ main(int argc, char *argv[])
                 return usage(
                   -1, "missing mandatory parameters for flash_update mode");
 
-            modbus::flash_update(rtu_parameters, argv[0], options::verbose);
+            modbus::flash_session::options_t const flash_options{
+              .verify      = options::verify,
+              .max_retries = options::max_retries};
+            modbus::flash_update(rtu_parameters,
+                                 argv[0],
+                                 argc > 1 ? argv[1] : "",
+                                 flash_options,
+                                 options::verbose);
             return 0;
         }
+        else if (options::mode == options::mode_t::flash_rollout)
+        {
+            if (argc < 1)
+                return usage(
+                  -1, "missing mandatory parameters for flash_rollout mode");
+
+            modbus::flash_session::options_t const flash_options{
+              .verify      = options::verify,
+              .max_retries = options::max_retries};
+            return modbus::flash_rollout(rtu_parameters,
+                                         argv[0],
+                                         flash_options,
+                                         options::verbose)
+                     ? -1
+                     : 0;
+        }
+        else if (options::mode == options::mode_t::flash_broadcast)
+        {
+            if (argc < 2)
+                return usage(
+                  -1, "missing mandatory parameters for flash_broadcast mode");
+
+            std::vector<int> slave_ids;
+            for (int i = 1; i != argc; ++i)
+                slave_ids.push_back(std::stoi(argv[i]));
+
+            modbus::flash_session::options_t const flash_options{
+              .verify      = options::verify,
+              .max_retries = options::max_retries};
+            return modbus::flash_broadcast(rtu_parameters,
+                                           argv[0],
+                                           slave_ids,
+                                           options::broadcast_delay,
+                                           flash_options,
+                                           options::verbose)
+                     ? -1
+                     : 0;
+        }
+        else if (options::mode == options::mode_t::file_record_upload)
+        {
+            if (options::slave_id < 0 || argc < 2)
+                return usage(
+                  -1,
+                  "missing mandatory parameters for file_record_upload mode");
+
+            int const file = std::strtol(argv[0], nullptr, 0);
+            modbus::file_record_upload(
+              rtu_parameters, file, argv[1], options::verbose);
+            return 0;
+        }
+        else if (options::mode == options::mode_t::file_record_download)
+        {
+            if (options::slave_id < 0 || argc < 3)
+                return usage(
+                  -1,
+                  "missing mandatory parameters for file_record_download mode");
+
+            int const file     = std::strtol(argv[0], nullptr, 0);
+            int const num_regs = std::strtol(argv[1], nullptr, 0);
+            modbus::file_record_download(
+              rtu_parameters, file, num_regs, argv[2], options::verbose);
+            return 0;
+        }
+        else if (options::mode == options::mode_t::bus_scan)
+        {
+            if (argc < 1)
+                return usage(
+                  -1, "missing mandatory parameters for bus_scan mode");
+
+            if (options::line_configs.empty())
+                options::line_configs.push_back(options::serial_config);
+
+            return modbus::bus_scan({argv, argv + argc},
+                                    options::line_configs,
+                                    options::probe_timeout,
+                                    options::verbose)
+                     ? 0
+                     : -1;
+        }
     }
     catch (std::invalid_argument const &e)
     {
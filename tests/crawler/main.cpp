@@ -1,3 +1,10 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
-#include "modbus_slave.hpp"
\ No newline at end of file
+#include "crc32.hpp"
+#include "latency_tracker.hpp"
+#include "modbus_decode.hpp"
+#include "modbus_pdu.hpp"
+#include "modbus_slave.hpp"
+#include "register_cache.hpp"
+#include "register_image.hpp"
+#include "spsc_queue.hpp"
\ No newline at end of file